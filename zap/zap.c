@@ -59,60 +59,112 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "../zaplib/zaplib.h"
 #include "../zaplib/error.h"
+#include <ctype.h>
 
 zap_config_t *pcfg;
+zap_writer_t zap_results;						// -F, -L and -D output, written on a thread of its own.
 
 #define		INFO	0
 #define		ERROR	1
 
 // Prototypes
-unsigned __int32 get_stats( zap_history_t *history, double percentile );
-void gather_stats( zap_history_t *history, unsigned __int32 value );
+int zap_history_write( zap_history_t *history, FILE *fileio, const char *tag, const char *name );
+int zap_history_read( zap_history_t *history, FILE *fileio, char *tag, char *name );
+void zap_history_print( zap_history_t *history, const char *label );
+void dump_delay( zap_config_t *config, char delimit );
+int zap_window_parse( zap_window_t *window, const char *arg );
+int zap_window_init( zap_window_t *window );
+void zap_window_add( zap_window_t *window, double value, __int64 usec );
+double zap_window_mean( zap_window_t *window );
+void zap_window_free( zap_window_t *window );
+int zap_archive_add( zap_config_t *config, SOCKET s, zap_performance_frame_t *p );
+int zap_archive_block( zap_config_t *config );
+
+
+// The clock estimate for the station on control connection s.
+zap_clock_t *zap_station_clock( zap_config_t *config, SOCKET s )
+{
+	unsigned __int32	i;
 
+	for ( i = 0; i < config->rxs_count; i++ ) {
+		if ( config->rxs_socket_ctl[i] == s ) {
+			return &config->rxs_clock[i];
+		}
+	}
+	return &config->txs_clock;
+}
 
-// Generate an approximately unique test id.
-unsigned __int32 zap_generate_tid( void )
+// The throughput history of the receive station on control connection s, NULL if none.
+zap_history_t *zap_station_history( zap_config_t *config, SOCKET s )
 {
-	time_t	tv;
+	unsigned __int32	i;
 
-	time( &tv );
-	return ( unsigned __int32 )tv;
+	for ( i = 0; i < config->rxs_count; i++ ) {
+		if ( ( config->rxs_socket_ctl[i] == s ) && config->rxs_history[i].counts ) {
+			return &config->rxs_history[i];
+		}
+	}
+	return NULL;
 }
 
 
-int compare( const void *d1, const void *d2 )
+// Make room for one more receive station, growing the rxs_ arrays. Returns 0 on success.
+int zap_config_add_rx( zap_config_t *config )
 {
-	unsigned __int32 *data1 = ( unsigned __int32 * )d1;
-	unsigned __int32 *data2 = ( unsigned __int32 * )d2;
+	unsigned __int32	i, max;
 
-	if ( *data1 < *data2 ){
-		return -1;
+	if ( config->rxs_count < config->rxs_max ) {
+		return 0;
 	}
-	if ( *data1 > *data2 ){
+	max = config->rxs_max ? config->rxs_max * 2 : 4;
+	config->rxs_ip_address = ( unsigned __int32 * )realloc( config->rxs_ip_address, max * sizeof( *config->rxs_ip_address ) );
+	config->rxs_ip_address_ctl = ( unsigned __int32 * )realloc( config->rxs_ip_address_ctl, max * sizeof( *config->rxs_ip_address_ctl ) );
+	config->rxs_socket_ctl = ( SOCKET * )realloc( config->rxs_socket_ctl, max * sizeof( *config->rxs_socket_ctl ) );
+	config->rxs_clock = ( zap_clock_t * )realloc( config->rxs_clock, max * sizeof( *config->rxs_clock ) );
+	config->rxs_history = ( zap_history_t * )realloc( config->rxs_history, max * sizeof( *config->rxs_history ) );
+	if ( !config->rxs_ip_address || !config->rxs_ip_address_ctl || !config->rxs_socket_ctl || !config->rxs_clock ||
+		!config->rxs_history ) {
 		return 1;
 	}
-
+	for ( i = config->rxs_max; i < max; i++ ) {
+		config->rxs_ip_address[i] = 0;
+		config->rxs_ip_address_ctl[i] = 0;
+		config->rxs_socket_ctl[i] = INVALID_SOCKET;
+		memset( &config->rxs_clock[i], 0, sizeof( config->rxs_clock[i] ) );
+		memset( &config->rxs_history[i], 0, sizeof( config->rxs_history[i] ) );
+	}
+	config->rxs_max = max;
 	return 0;
 }
-int zap_log_error(zap_config_t *config, char *msg, int type)
+
+
+// Generate an approximately unique test id.
+unsigned __int32 zap_generate_tid( void )
 {
-	FILE            *fileio;
+	time_t	tv;
 
+	time( &tv );
+	// Seconds alone collide between controllers started together against one zapd.
+#ifdef WIN32
+	return ( unsigned __int32 )tv ^ ( ( unsigned __int32 )GetCurrentProcessId(  ) << 16 ) ^ ( unsigned __int32 )get_current_usecs(  );
+#else
+	return ( unsigned __int32 )tv ^ ( ( unsigned __int32 )getpid(  ) << 16 ) ^ ( unsigned __int32 )get_current_usecs(  );
+#endif
+}
+
+
+int zap_log_error(zap_config_t *config, char *msg, int type)
+{
 	if(config->debugfile) {
-		fileio = fopen( config->debugfile, "a+" );
-		if ( !fileio ) {
-			fprintf( stderr, "Error, file probably open by another application.\n" );
-			return 1;
-		}
 		if(type == ERROR) {
-			fprintf( fileio, "[ERROR]: %s", msg);
+			zap_writer_printf( &zap_results, "[ERROR]: %s", msg);
 		}
 		else {
-			fprintf( fileio, "[INFO]: %s", msg);
+			zap_writer_printf( &zap_results, "[INFO]: %s", msg);
 		}
 
-		fprintf( fileio, "\n");
-		fclose( fileio );
+		zap_writer_printf( &zap_results, "\n");
+		return zap_writer_commit( &zap_results, zap_writer_file( &zap_results, config->debugfile ) );
 	}
 	return 0;
 
@@ -134,7 +186,6 @@ int zap_debug_dump_file( zap_config_t *config,
 #endif
 	double          walk;
 	char            time_str[30];
-	FILE            *fileio;
 	int				i;
 	double race[] =	{ 0.0, 0.5, 0.90, 0.95, 0.990, 0.999 };
 
@@ -148,14 +199,7 @@ int zap_debug_dump_file( zap_config_t *config,
 	// Take off the newline.
 	time_str[24] = 0;
 
-	fileio = fopen( config->debugfile, "a+" );
-
-	if ( !fileio ) {
-		fprintf( stderr, "Error, file probably open by another application.\n" );
-		return 1;
-	}
-
-	fprintf( fileio, "%5d: %s->%s %6d=rx %3d=dr %3d=oo %3d=rp %5d=rx in %7.1fms  %6.1fmbps  %6.1f | ",
+	zap_writer_printf( &zap_results, "%5d: %s->%s %6d=rx %3d=dr %3d=oo %3d=rp %5d=rx in %7.1fms  %6.1fmbps  %6.1f | ",
 		p.batch,
 		inet_ntoa2( config->txs_ip_address ),
 		inet_ntoa2( config->rxs_ip_address[0] ),
@@ -169,12 +213,11 @@ int zap_debug_dump_file( zap_config_t *config,
 		( p.batch > 0 )? ( total/( p.batch+1 ) ) : ( total ) );
 
 	for ( i = 0; i < ( ( sizeof race ) / sizeof( double ) ); i++ ) {
-		fprintf( fileio, "%4.1f ", get_stats( history, race[i] ) / 1000000.0 );
+		zap_writer_printf( &zap_results, "%4.1f ", get_stats( history, race[i] ) / 1000000.0 );
 	}
-	fprintf( fileio, "\n");
-	fclose( fileio );
+	zap_writer_printf( &zap_results, "\n");
 
-	return 0;
+	return zap_writer_commit( &zap_results, zap_writer_file( &zap_results, config->debugfile ) );
 }
 
 
@@ -189,9 +232,7 @@ int zap_pkg_drop_dump_file( zap_config_t *config,
 #endif
 	double          walk;
 	char            time_str[30];
-	FILE            *fileio;
 	char            delimit=',';
-	int				new_file;
 	int				i;
 
 #ifdef WIN32
@@ -204,91 +245,73 @@ int zap_pkg_drop_dump_file( zap_config_t *config,
 	// Take off the newline.
 	time_str[24] = 0;
 
-	fileio = fopen( config->logfile, "r" );
-	if ( !fileio ) {
-		new_file = 1;
-	} else {
-		new_file = 0;
-		fclose( fileio );
-	}
-
-	fileio = fopen( config->logfile, "a+" );
-
-	if ( !fileio ) {
-		fprintf( stderr, "Error, file probably open by another application.\n" );
-		return 1;
-	}
-
-	// Dump package drop information.
-	if ( new_file ) {
-		// If a new file, make the first row have text tags for all the columns
+	// Dump package drop information. The first row has text tags for all the columns, written only if
+	// the file is new.
+	zap_writer_printf( &zap_results, "Zap Version%c", delimit );
+	zap_writer_printf( &zap_results, "Filename%c", delimit );
+	zap_writer_printf( &zap_results, "Protocol%c", delimit );
 
-		fprintf( fileio, "Zap Version%c", delimit );
-		fprintf( fileio, "Filename%c", delimit );
-		fprintf( fileio, "Protocol%c", delimit );
+	zap_writer_printf( &zap_results, "Invert Open%c", delimit );
+	zap_writer_printf( &zap_results, "Tx IP%c", delimit );
+	zap_writer_printf( &zap_results, "Rx IP%c", delimit );
+	zap_writer_printf( &zap_results, "Multicast%c", delimit );
+	zap_writer_printf( &zap_results, "ToS%c", delimit );
 
-		fprintf( fileio, "Invert Open%c", delimit );
-		fprintf( fileio, "Tx IP%c", delimit );
-		fprintf( fileio, "Rx IP%c", delimit );
-		fprintf( fileio, "Multicast%c", delimit );
-		fprintf( fileio, "ToS%c", delimit );
+	zap_writer_printf( &zap_results, "Samples%c", delimit );
+	zap_writer_printf( &zap_results, "Sample Size%c", delimit );
+	zap_writer_printf( &zap_results, "Payload Length%c", delimit );
+	zap_writer_printf( &zap_results, "Payload Transmit Delay%c", delimit );
 
-		fprintf( fileio, "Samples%c", delimit );
-		fprintf( fileio, "Sample Size%c", delimit );
-		fprintf( fileio, "Payload Length%c", delimit );
-		fprintf( fileio, "Payload Transmit Delay%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Received%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Dropped%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Repeated%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Outoforder%c", delimit );
 
-		fprintf( fileio, "Payloads Received%c", delimit );
-		fprintf( fileio, "Payloads Dropped%c", delimit );
-		fprintf( fileio, "Payloads Repeated%c", delimit );
-		fprintf( fileio, "Payloads Outoforder%c", delimit );
+	zap_writer_printf( &zap_results, "Date%c", delimit );
+	zap_writer_printf( &zap_results, "Notes%c", delimit );
+	zap_writer_printf( &zap_results, "Tag%c", delimit );
+	zap_writer_printf( &zap_results, "Sub Tag%c", delimit );
 
-		fprintf( fileio, "Date%c", delimit );
-		fprintf( fileio, "Notes%c", delimit );
-		fprintf( fileio, "Tag%c", delimit );
-		fprintf( fileio, "Sub Tag%c", delimit );
-
-		fprintf( fileio, "\n" );
-	}
+	zap_writer_printf( &zap_results, "\n" );
+	zap_writer_header( &zap_results );
 
 	// Add this test's results to the last row of the file
 
-	fprintf( fileio, "%d.%d%c", ZAP_MAJOR_VERSION, ZAP_MINOR_VERSION, delimit );
-	fprintf( fileio, "%s%c", config->logfile, delimit );
+	zap_writer_printf( &zap_results, "%d.%d%c", ZAP_MAJOR_VERSION, ZAP_MINOR_VERSION, delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->logfile, delimit );
 	if ( config->station_config.tcp ){
-		fprintf( fileio, "tcp%c", delimit );
+		zap_writer_printf( &zap_results, "tcp%c", delimit );
 	} else {
-		fprintf( fileio, "udp%c", delimit );
+		zap_writer_printf( &zap_results, "udp%c", delimit );
 	}
 
-	fprintf( fileio, "%s%c", config->open_reverse ? "On" : "Off", delimit );
-	fprintf( fileio, "%s:%s%c", inet_ntoa2( config->txs_ip_address ), inet_ntoa2( config->txs_ip_address_ctl ), delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->open_reverse ? "On" : "Off", delimit );
+	zap_writer_printf( &zap_results, "%s:%s%c", inet_ntoa2( config->txs_ip_address ), inet_ntoa2( config->txs_ip_address_ctl ), delimit );
 	for ( i = 0; i < ( int ) config->rxs_count; i++ ){
-		fprintf( fileio, "%s:%s", inet_ntoa2( config->rxs_ip_address[i] ), inet_ntoa2( config->rxs_ip_address_ctl[i] ) );
+		zap_writer_printf( &zap_results, "%s:%s", inet_ntoa2( config->rxs_ip_address[i] ), inet_ntoa2( config->rxs_ip_address_ctl[i] ) );
 	}
-	fprintf( fileio, "%c", delimit );
+	zap_writer_printf( &zap_results, "%c", delimit );
 	
-	fprintf( fileio, "%s%c",	   config->multi_ip_address ? inet_ntoa2( config->multi_ip_address ) : "Off", delimit );	
-	fprintf( fileio, "%.2hhXh%c", ( char ) config->ip_tos, delimit );
-
-	fprintf( fileio, "%d%c", config->station_config.batches, delimit );
-	fprintf( fileio, "%d%c", config->station_config.batch_size, delimit );
-	fprintf( fileio, "%d%c", config->station_config.payload_length, delimit );
-	fprintf( fileio, "%d%c", config->station_config.payload_transmit_delay, delimit );
-
-	fprintf( fileio, "%d%c", perf->payloads_received, delimit );
-	fprintf( fileio, "%d%c", perf->payloads_dropped, delimit );
-	fprintf( fileio, "%d%c", perf->payloads_repeated, delimit );
-	fprintf( fileio, "%d%c", perf->payloads_outoforder, delimit );
-
-	fprintf( fileio, "%s%c", time_str, delimit );
-	fprintf( fileio, "%s%c", config->note,delimit );
-	fprintf( fileio, "%s%c", config->tag, delimit );
-	fprintf( fileio, "%s%c", config->sub, delimit );
-	fprintf( fileio, "\n" );
-	fclose( fileio );
-
-	return 0;
+	zap_writer_printf( &zap_results, "%s%c",	   config->multi_ip_address ? inet_ntoa2( config->multi_ip_address ) : "Off", delimit );	
+	zap_writer_printf( &zap_results, "%.2hhXh%c", ( char ) config->ip_tos, delimit );
+
+	zap_writer_printf( &zap_results, "%d%c", config->station_config.batches, delimit );
+	zap_writer_printf( &zap_results, "%d%c", config->station_config.batch_size, delimit );
+	zap_writer_printf( &zap_results, "%d%c", config->station_config.payload_length, delimit );
+	dump_delay( config, delimit );
+
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_received, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_dropped, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_repeated, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_outoforder, delimit );
+
+	zap_writer_printf( &zap_results, "%s%c", time_str, delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->note,delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->tag, delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->sub, delimit );
+	zap_writer_printf( &zap_results, "\n" );
+
+	return zap_writer_commit( &zap_results, zap_writer_file( &zap_results, config->logfile ) );
 }
 
 int zap_control_dump_file( zap_config_t *config, 
@@ -303,9 +326,7 @@ int zap_control_dump_file( zap_config_t *config,
 #endif
 	double          walk;
 	char            time_str[30];
-	FILE            *fileio;
 	char            delimit=',';
-	int				new_file;
 	int				i;
 
 #ifdef WIN32
@@ -319,109 +340,113 @@ int zap_control_dump_file( zap_config_t *config,
 	// Take off the newline.
 	time_str[24] = 0;
 
-	fileio = fopen( config->filename, "r" );
-	if ( !fileio ) {
-		new_file = 1;
-	} else {
-		new_file = 0;
-		fclose( fileio );
-	}
-
-	fileio = fopen( config->filename, "a+" );
-
-	if ( !fileio ) {
-		fprintf( stderr, "Error, file probably open by another application.\n" );
-		return 1;
+	// Dump percentiles. The first row has text tags for all the columns, written only if
+	// the file is new.
+	//
+	// WARNING -- other software ( VPT ) may now rely on these text tags for testing automation.
+	// Removal of elements or editing of this tag text is discouraged.   Please change VPT if necessary.
+	zap_writer_printf( &zap_results, "Zap Version%c", delimit );
+	zap_writer_printf( &zap_results, "Filename%c", delimit );
+	zap_writer_printf( &zap_results, "Protocol%c", delimit );
+
+	zap_writer_printf( &zap_results, "Invert Open%c", delimit );
+	zap_writer_printf( &zap_results, "Tx IP%c", delimit );
+	zap_writer_printf( &zap_results, "Rx IP%c", delimit );
+	zap_writer_printf( &zap_results, "Multicast%c", delimit );
+	zap_writer_printf( &zap_results, "ToS%c", delimit );
+
+	zap_writer_printf( &zap_results, "Samples%c", delimit );
+	zap_writer_printf( &zap_results, "Sample Size%c", delimit );
+	zap_writer_printf( &zap_results, "Payload Length%c", delimit );
+	zap_writer_printf( &zap_results, "Payload Transmit Delay%c", delimit );
+
+	zap_writer_printf( &zap_results, "Payloads Received%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Dropped%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Repeated%c", delimit );
+	zap_writer_printf( &zap_results, "Payloads Outoforder%c", delimit );
+	//zap_writer_printf( &zap_results, "Avg Throughput%c", delimit );
+
+	zap_writer_printf( &zap_results, "Date%c", delimit );
+	zap_writer_printf( &zap_results, "Notes%c", delimit );
+	zap_writer_printf( &zap_results, "Tag%c", delimit );
+	zap_writer_printf( &zap_results, "Sub Tag%c", delimit );
+
+	// XXX percentiles must match below
+	for ( walk = 0.0; walk < 0.991; walk += 0.01 ) {    // 1.0% increments from 0% to 99%
+		zap_writer_printf( &zap_results, "%4.1f%%%c", walk*100.0, delimit );
 	}
-
-	// Dump percentiles.
-	if ( new_file ) {
-		// If a new file, make the first row have text tags for all the columns
-
-		// WARNING -- other software ( VPT ) may now rely on these text tags for testing automation.
-		// Removal of elements or editing of this tag text is discouraged.   Please change VPT if necessary.
-		fprintf( fileio, "Zap Version%c", delimit );
-		fprintf( fileio, "Filename%c", delimit );
-		fprintf( fileio, "Protocol%c", delimit );
-
-		fprintf( fileio, "Invert Open%c", delimit );
-		fprintf( fileio, "Tx IP%c", delimit );
-		fprintf( fileio, "Rx IP%c", delimit );
-		fprintf( fileio, "Multicast%c", delimit );
-		fprintf( fileio, "ToS%c", delimit );
-
-		fprintf( fileio, "Samples%c", delimit );
-		fprintf( fileio, "Sample Size%c", delimit );
-		fprintf( fileio, "Payload Length%c", delimit );
-		fprintf( fileio, "Payload Transmit Delay%c", delimit );
-
-		fprintf( fileio, "Payloads Received%c", delimit );
-		fprintf( fileio, "Payloads Dropped%c", delimit );
-		fprintf( fileio, "Payloads Repeated%c", delimit );
-		fprintf( fileio, "Payloads Outoforder%c", delimit );
-		//fprintf( fileio, "Avg Throughput%c", delimit );
-
-		fprintf( fileio, "Date%c", delimit );
-		fprintf( fileio, "Notes%c", delimit );
-		fprintf( fileio, "Tag%c", delimit );
-		fprintf( fileio, "Sub Tag%c", delimit );
-
-		// XXX percentiles must match below
-		for ( walk = 0.0; walk < 0.991; walk += 0.01 ) {    // 1.0% increments from 0% to 99%
-			fprintf( fileio, "%4.1f%%%c", walk*100.0, delimit );
-		}
-		for ( walk = 0.991; walk < 1.001; walk += 0.001 ) { // 0.1% increments from 99% to 100%
-			fprintf( fileio, "%4.1f%%%c", walk*100.0, delimit );
-		}
-		fprintf( fileio, "\n" );
+	for ( walk = 0.991; walk < 1.001; walk += 0.001 ) { // 0.1% increments from 99% to 100%
+		zap_writer_printf( &zap_results, "%4.1f%%%c", walk*100.0, delimit );
 	}
+	// Appended after the percentiles, so columns before them keep their places.
+	zap_writer_printf( &zap_results, "Jitter ms%c", delimit );
+	zap_writer_printf( &zap_results, "IPDV Min ms%c", delimit );
+	zap_writer_printf( &zap_results, "IPDV Mean ms%c", delimit );
+	zap_writer_printf( &zap_results, "IPDV Max ms%c", delimit );
+	zap_writer_printf( &zap_results, "IPDV 99%% ms%c", delimit );
+	zap_writer_printf( &zap_results, "Host Drops%c", delimit );
+	zap_writer_printf( &zap_results, "Network Drops%c", delimit );
+	zap_writer_printf( &zap_results, "UDP RcvbufErrors%c", delimit );
+	zap_writer_printf( &zap_results, "UDP InErrors%c", delimit );
+	zap_writer_printf( &zap_results, "IP ReasmFails%c", delimit );
+	zap_writer_printf( &zap_results, "\n" );
+	zap_writer_header( &zap_results );
 
 	// Add this test's results to the last row of the file
 
-	fprintf( fileio, "%d.%d%c", ZAP_MAJOR_VERSION, ZAP_MINOR_VERSION, delimit );
-	fprintf( fileio, "%s%c", config->filename, delimit );
+	zap_writer_printf( &zap_results, "%d.%d%c", ZAP_MAJOR_VERSION, ZAP_MINOR_VERSION, delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->filename, delimit );
 	if ( config->station_config.tcp ){
-		fprintf( fileio, "tcp%c", delimit );
+		zap_writer_printf( &zap_results, "tcp%c", delimit );
 	} else {
-		fprintf( fileio, "udp%c", delimit );
+		zap_writer_printf( &zap_results, "udp%c", delimit );
 	}
 
-	fprintf( fileio, "%s%c", config->open_reverse ? "On" : "Off", delimit );
-	fprintf( fileio, "%s:%s%c", inet_ntoa2( config->txs_ip_address ), inet_ntoa2( config->txs_ip_address_ctl ), delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->open_reverse ? "On" : "Off", delimit );
+	zap_writer_printf( &zap_results, "%s:%s%c", inet_ntoa2( config->txs_ip_address ), inet_ntoa2( config->txs_ip_address_ctl ), delimit );
 	for ( i = 0; i < ( int ) config->rxs_count; i++ ){
-		fprintf( fileio, "%s:%s", inet_ntoa2( config->rxs_ip_address[i] ), inet_ntoa2( config->rxs_ip_address_ctl[i] ) );
+		zap_writer_printf( &zap_results, "%s:%s", inet_ntoa2( config->rxs_ip_address[i] ), inet_ntoa2( config->rxs_ip_address_ctl[i] ) );
 	}
-	fprintf( fileio, "%c", delimit );
+	zap_writer_printf( &zap_results, "%c", delimit );
 	
-	fprintf( fileio, "%s%c",	   config->multi_ip_address ? inet_ntoa2( config->multi_ip_address ) : "Off", delimit );	
-	fprintf( fileio, "%.2hhXh%c", ( char ) config->ip_tos, delimit );
-
-	fprintf( fileio, "%d%c", config->station_config.batches, delimit );
-	fprintf( fileio, "%d%c", config->station_config.batch_size, delimit );
-	fprintf( fileio, "%d%c", config->station_config.payload_length, delimit );
-	fprintf( fileio, "%d%c", config->station_config.payload_transmit_delay, delimit );
-
-	fprintf( fileio, "%d%c", perf->payloads_received, delimit );
-	fprintf( fileio, "%d%c", perf->payloads_dropped, delimit );
-	fprintf( fileio, "%d%c", perf->payloads_repeated, delimit );
-	fprintf( fileio, "%d%c", perf->payloads_outoforder, delimit );
-	//fprintf( fileio, "%.1f%c", ( config->station_config.batches>0 )?( total/config->station_config.batches ):0, delimit );
-
-	fprintf( fileio, "%s%c", time_str, delimit );
-	fprintf( fileio, "%s%c", config->note,delimit );
-	fprintf( fileio, "%s%c", config->tag, delimit );
-	fprintf( fileio, "%s%c", config->sub, delimit );
+	zap_writer_printf( &zap_results, "%s%c",	   config->multi_ip_address ? inet_ntoa2( config->multi_ip_address ) : "Off", delimit );	
+	zap_writer_printf( &zap_results, "%.2hhXh%c", ( char ) config->ip_tos, delimit );
+
+	zap_writer_printf( &zap_results, "%d%c", config->station_config.batches, delimit );
+	zap_writer_printf( &zap_results, "%d%c", config->station_config.batch_size, delimit );
+	zap_writer_printf( &zap_results, "%d%c", config->station_config.payload_length, delimit );
+	dump_delay( config, delimit );
+
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_received, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_dropped, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_repeated, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_outoforder, delimit );
+	//zap_writer_printf( &zap_results, "%.1f%c", ( config->station_config.batches>0 )?( total/config->station_config.batches ):0, delimit );
+
+	zap_writer_printf( &zap_results, "%s%c", time_str, delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->note,delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->tag, delimit );
+	zap_writer_printf( &zap_results, "%s%c", config->sub, delimit );
 	// XXX percentiles must match above!
 	for ( walk = 0.0; walk < .991; walk += 0.01 ) {		// 1.0% increments from 0% to 99%
-		fprintf( fileio, "%4.1f%c", get_stats( rates, walk )/1000000.0, delimit );
+		zap_writer_printf( &zap_results, "%4.1f%c", get_stats( rates, walk )/1000000.0, delimit );
 	}
 	for ( walk = 0.991; walk < 1.001; walk += 0.001 ) {	// 0.1% increments from 99% to 100%
-		fprintf( fileio, "%4.1f%c", get_stats( rates, walk )/1000000.0, delimit );
+		zap_writer_printf( &zap_results, "%4.1f%c", get_stats( rates, walk )/1000000.0, delimit );
 	}
-	fprintf( fileio, "\n" );
-	fclose( fileio );
-
-	return 0;
+	zap_writer_printf( &zap_results, "%.3f%c", config->jitter / 1000000.0, delimit );
+	zap_writer_printf( &zap_results, "%.3f%c", config->ipdv_min / 1000000.0, delimit );
+	zap_writer_printf( &zap_results, "%.3f%c", config->ipdv_count ? ( double )config->ipdv_sum / config->ipdv_count / 1000000.0 : 0.0, delimit );
+	zap_writer_printf( &zap_results, "%.3f%c", config->ipdv_max / 1000000.0, delimit );
+	zap_writer_printf( &zap_results, "%.3f%c", config->ipdv_p99 / 1000000.0, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_dropped_host, delimit );
+	zap_writer_printf( &zap_results, "%d%c", perf->payloads_dropped - perf->payloads_dropped_host, delimit );
+	zap_writer_printf( &zap_results, "%u%c", perf->udp_rcvbuf_errors, delimit );
+	zap_writer_printf( &zap_results, "%u%c", perf->udp_in_errors, delimit );
+	zap_writer_printf( &zap_results, "%u%c", perf->ip_reasm_fails, delimit );
+	zap_writer_printf( &zap_results, "\n" );
+
+	return zap_writer_commit( &zap_results, zap_writer_file( &zap_results, config->filename ) );
 }
 
 /* -------------------------------------------------------------------
@@ -458,32 +483,203 @@ void zap_exit( int inSigno )
 } /* end sig_exit */
 
 
+// Throughput percentiles shown, of samples and of receivers.
+static double zap_rate_r[] =		{ 0.0, 0.5, 0.90, 0.95, 0.990, 0.999 };
+static const char *zap_rate_histarr[] = {"0%", 
+									     "50%",
+						                 "90%",
+							             "95%",
+							             "99%",
+							             "99.9%"};
+
+// Parse a -w horizon: <n> for the last n reports ( 0 for all ), e<n> to weight them
+// exponentially over about n, or t<seconds> for those in the last so many seconds.
+int zap_window_parse( zap_window_t *window, const char *arg )
+{
+	char	*end;
+
+	memset( window, 0, sizeof( *window ) );
+	window->type = zap_window_count;
+	if ( *arg == 'e' ) {
+		window->type = zap_window_ewma;
+		arg++;
+	}
+	else if ( *arg == 't' ) {
+		window->type = zap_window_time;
+		arg++;
+	}
+	window->span = strtod( arg, &end );
+	if ( ( end == arg ) || *end || ( window->span < 0 ) ||
+		( ( window->type != zap_window_count ) && ( window->span <= 0 ) ) ) {
+		return 1;
+	}
+	if ( window->type == zap_window_count ) {
+		window->span = ( double )( unsigned __int32 )window->span;
+	}
+	return 0;
+}
+
+// A report window holds its reports in a ring; a count window needs span of them, a time
+// window as many as arrive in span and grows to suit. Neither the EWMA nor the mean of
+// all reports keeps any.
+int zap_window_init( zap_window_t *window )
+{
+	window->first = window->count = window->max = 0;
+	window->sum = window->carry = 0;
+	if ( ( window->type == zap_window_ewma ) || !window->span ) {
+		return 0;
+	}
+	window->max = ( window->type == zap_window_count ) ? ( unsigned __int32 )window->span : 64;
+	window->values = ( double * )malloc( window->max * sizeof( double ) );
+	if ( !window->values ) {
+		return 1;
+	}
+	if ( window->type == zap_window_time ) {
+		window->usecs = ( __int64 * )malloc( window->max * sizeof( __int64 ) );
+		if ( !window->usecs ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Add value to the window's sum, carrying what rounds off ( Neumaier ) so that reports
+// going in and out over a long test leave no drift behind.
+static void zap_window_sum( zap_window_t *window, double value )
+{
+	double	t;
+
+	t = window->sum + value;
+	if ( ( ( window->sum < 0 ) ? -window->sum : window->sum ) >= ( ( value < 0 ) ? -value : value ) ) {
+		window->carry += ( window->sum - t ) + value;
+	}
+	else {
+		window->carry += ( value - t ) + window->sum;
+	}
+	window->sum = t;
+}
+
+// Drop the oldest report from the window.
+static void zap_window_pop( zap_window_t *window )
+{
+	zap_window_sum( window, -window->values[window->first] );
+	window->first = ( window->first + 1 ) % window->max;
+	window->count--;
+}
+
+// Take in a report of value, arriving at usec. Constant time, but for a time window
+// growing its ring.
+void zap_window_add( zap_window_t *window, double value, __int64 usec )
+{
+	unsigned __int32	i, max;
+	double				*values;
+	__int64				*usecs;
+
+	if ( window->type == zap_window_ewma ) {
+		if ( !window->count++ ) {
+			window->sum = value;
+		}
+		else {
+			window->sum += ( value - window->sum ) * 2.0 / ( window->span + 1.0 );
+		}
+		return;
+	}
+	if ( !window->max ) {
+		window->count++;
+		zap_window_sum( window, value );
+		return;
+	}
+
+	if ( window->type == zap_window_time ) {
+		while ( window->count && ( usec - window->usecs[window->first] >= ( __int64 )( window->span * 1000000.0 ) ) ) {
+			zap_window_pop( window );
+		}
+		if ( window->count == window->max ) {
+			max = window->max * 2;
+			values = ( double * )malloc( max * sizeof( double ) );
+			usecs = ( __int64 * )malloc( max * sizeof( __int64 ) );
+			if ( !values || !usecs ) {
+				// Out of room; let the oldest go early.
+				free( values );
+				free( usecs );
+				zap_window_pop( window );
+			}
+			else {
+				for ( i = 0; i < window->count; i++ ) {
+					values[i] = window->values[( window->first + i ) % window->max];
+					usecs[i] = window->usecs[( window->first + i ) % window->max];
+				}
+				free( window->values );
+				free( window->usecs );
+				window->values = values;
+				window->usecs = usecs;
+				window->first = 0;
+				window->max = max;
+			}
+		}
+	}
+	else if ( window->count == window->max ) {
+		zap_window_pop( window );
+	}
+
+	i = ( window->first + window->count ) % window->max;
+	window->values[i] = value;
+	if ( window->usecs ) {
+		window->usecs[i] = usec;
+	}
+	window->count++;
+	zap_window_sum( window, value );
+}
+
+double zap_window_mean( zap_window_t *window )
+{
+	if ( !window->count ) {
+		return 0;
+	}
+	if ( window->type == zap_window_ewma ) {
+		return window->sum;
+	}
+	return ( window->sum + window->carry ) / window->count;
+}
+
+void zap_window_free( zap_window_t *window )
+{
+	free( window->values );
+	free( window->usecs );
+	window->values = NULL;
+	window->usecs = NULL;
+}
+
 // 
 // Returns: 
 //   0 = Normal response processed.
 //   1 = Test complete message received.
 //  <0 = Error.
-int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *history, zap_performance_frame_t *perf, double* total, double* throughput_array )
+int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *history, zap_performance_frame_t *perf, double* total )
 {
-	static double r[] =		{ 0.0, 0.5, 0.90, 0.95, 0.990, 0.999 };
-	const char				*histarr[] = {"0%", 
-									      "50%",
-						                  "90%",
-							              "95%",
-							              "99%",
-							              "99.9%"};
 	zap_performance_frame_t p;
-	int						i, j, k;
+	int						i, j;
 	unsigned __int32		*src, *dst;
 	zap_frame_t				*frame;
+	unsigned __int64		bps;
 	double					throughput;
 	int                     len, lendst, lensrc;
 	char                    buf[15];
-	unsigned __int32		temp;
+	static double			owd_r[] = { 0.0, 0.5, 0.90, 0.99, 0.999, 1.0 };
+	const char				*owd_histarr[] = { "min", "50%", "90%", "99%", "99.9%", "max" };
+	unsigned __int32		owd_above[6];
+	__int64					owd_min, now;
+	__int64					ipdv_min, ipdv_max;
 
 	if ( zap_read_frame( s, 1, &frame, NULL, NULL ) ){
 		return -1;
 	}
+	now = get_wall_nsecs(  );
+
+	if ( ntohl( frame->header.zap_frame_type ) == zap_type_time_sync ) {
+		zap_clock_sample( zap_station_clock( config, s ), frame, now );
+		return 0;
+	}
 
 	src = ( unsigned __int32 * ) &( frame->payload.performance );
 	dst = ( unsigned __int32 * ) &p;
@@ -494,39 +690,32 @@ int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *histo
 	}
 
 	if ( ntohl( frame->header.zap_frame_type ) == zap_type_performance_result ) {
+		if ( config->archivefile && zap_archive_add( config, s, &p ) ) {
+			exit_error( "Can not allocate memory for the archive\n" );
+		}
 		perf->payloads_dropped += p.payloads_dropped;
 		perf->payloads_outoforder += p.payloads_outoforder;
 		perf->payloads_received += p.payloads_received;
 		perf->payloads_repeated += p.payloads_repeated;
+		perf->payloads_dropped_host += p.payloads_dropped_host;
+		perf->udp_rcvbuf_errors += p.udp_rcvbuf_errors;
+		perf->udp_in_errors += p.udp_in_errors;
+		perf->ip_reasm_fails += p.ip_reasm_fails;
+
+		bps = ( ( unsigned __int64 )p.bits_per_second_high << 32 ) | p.bits_per_second;
+		gather_stats( history, bps );
+		if ( zap_station_history( config, s ) ) {
+			gather_stats( zap_station_history( config, s ), bps );
+		}
 
-		gather_stats( history, p.bits_per_second );
-
-		throughput = ( double )( ( double )p.bits_per_second ) / 1000000.0;
+		throughput = ( double )( ( double )bps ) / 1000000.0;
 
-		if((config->average != 0) && (config->average >= p.batch + 1) ) {
-			throughput_array[p.batch] =  throughput;
-			*total = *total + throughput;
-		}
-		else if ((config->average != 0) && (config->average < p.batch + 1)) {
-			*total = *total + throughput - throughput_array[0];
-			for(k = 0; k < config->average - 1; k++){
-				//Delete the first element and shitf left one element
-				throughput_array[k] = throughput_array[k+1];
-			}
-			throughput_array[k] = throughput;
-		}
-		else{ // config->average == 0
-			*total = *total + throughput;
-		}
-		
-		if((config->average == 0) || config->average >= p.batch +1 ){
-			temp = p.batch + 1;
-		}
-		else {
-			temp = config->average;
+		*total = *total + throughput;
+		for ( i = 0; i < ( int )config->window_count; i++ ) {
+			zap_window_add( &config->windows[i], throughput, get_current_usecs(  ) );
 		}
 
-		printf( "%5d: %s->%s %6d=rx %3d=dr %3d=oo %3d=rp %5d=rx in %7.1fms  %6.1fmbps  %6.1f | ",
+		printf( "%5d: %s->%s %6d=rx %3d=dr %3d=oo %3d=rp %5d=rx in %7.1fms  %6.1fmbps  %6.1f ",
 			p.batch,
 			inet_ntoa2( config->txs_ip_address ),
 			inet_ntoa2( config->rxs_ip_address[0] ),
@@ -537,10 +726,56 @@ int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *histo
 			p.payloads_received,
 			( double )( ( double )( p.last_payload_timestamp - p.first_payload_timestamp ) ) / 1000.0,
 			throughput,
-			( p.batch > 0 )? ( *total/( temp ) ) : ( *total ) );
+			zap_window_mean( &config->windows[0] ) );
+		for ( i = 1; i < ( int )config->window_count; i++ ) {
+			printf( "%6.1f ", zap_window_mean( &config->windows[i] ) );
+		}
+		printf( "| " );
 
-		for ( i = 0; i < ( ( sizeof r ) / sizeof( double ) ); i++ ) {
-			printf( "%4.1f ", get_stats( history, r[i] ) / 1000000.0 );
+		for ( i = 0; i < ( ( sizeof zap_rate_r ) / sizeof( double ) ); i++ ) {
+			printf( "%4.1f ", get_stats( history, zap_rate_r[i] ) / 1000000.0 );
+		}
+		if ( p.owd_count ) {
+			// The receiver measured its clock less the transmitter's; take out their offset.
+			owd_min = ( __int64 )( ( ( unsigned __int64 )p.owd_min_high << 32 ) | p.owd_min_low );
+			owd_min -= zap_clock_offset( zap_station_clock( config, s ), now ) - zap_clock_offset( &config->txs_clock, now );
+			owd_above[0] = 0;
+			owd_above[1] = p.owd_p50;
+			owd_above[2] = p.owd_p90;
+			owd_above[3] = p.owd_p99;
+			owd_above[4] = p.owd_p999;
+			owd_above[5] = p.owd_max;
+			printf( "| " );
+			for ( i = 0; i < ( ( sizeof owd_r ) / sizeof( double ) ); i++ ) {
+				printf( "%7.3f ", ( double )( owd_min + owd_above[i] ) / 1000000.0 );
+			}
+			printf( "ms " );
+		}
+		if ( p.ipdv_count ) {
+			ipdv_min = ( __int32 )p.ipdv_min;
+			ipdv_max = ( __int32 )p.ipdv_max;
+			if ( !config->ipdv_count || ( ipdv_min < config->ipdv_min ) ) {
+				config->ipdv_min = ipdv_min;
+			}
+			if ( !config->ipdv_count || ( ipdv_max > config->ipdv_max ) ) {
+				config->ipdv_max = ipdv_max;
+			}
+			if ( !config->ipdv_count || ( ( __int32 )p.ipdv_p99 > config->ipdv_p99 ) ) {
+				config->ipdv_p99 = ( __int32 )p.ipdv_p99;
+			}
+			config->ipdv_sum += ( __int64 )( __int32 )p.ipdv_mean * p.ipdv_count;
+			config->ipdv_count += p.ipdv_count;
+			config->jitter = p.jitter;
+			printf( "| %7.3f %7.3f %7.3f %7.3f %7.3f ms",
+				p.jitter / 1000000.0,
+				ipdv_min / 1000000.0,
+				( __int32 )p.ipdv_mean / 1000000.0,
+				ipdv_max / 1000000.0,
+				( __int32 )p.ipdv_p99 / 1000000.0 );
+		}
+		if ( perf->payloads_dropped ) {
+			// Overflows of the receiving socket's queue, against losses in the network.
+			printf( " | %6d %6d", perf->payloads_dropped_host, perf->payloads_dropped - perf->payloads_dropped_host );
 		}
 		printf( "\n" );
 		//Check to make sure packages drop and user wants to log the file
@@ -568,14 +803,33 @@ int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *histo
 			for ( i=0; i < lendst - 3; i++ ) {
 				printf( " " );
 			}
-			printf( "dst        rx     dr     oo     rp       rx       b_time    b_thrput     avg | " );
-			for ( i = 0; i < ( ( sizeof r ) / sizeof( double ) ); i++ ) {
-				sprintf( buf, "%4.1f ", get_stats( history, r[i] ) / 1000000.0 );
+			printf( "dst        rx     dr     oo     rp       rx       b_time    b_thrput     avg " );
+			for ( i = 1; i < ( int )config->window_count; i++ ) {
+				sprintf( buf, "%s%g%s", ( config->windows[i].type == zap_window_ewma ) ? "e" : ( config->windows[i].type == zap_window_time ) ? "t" : "w",
+					config->windows[i].span, ( config->windows[i].type == zap_window_time ) ? "s" : "" );
+				printf( "%6.6s ", buf );
+			}
+			printf( "| " );
+			for ( i = 0; i < ( ( sizeof zap_rate_r ) / sizeof( double ) ); i++ ) {
+				sprintf( buf, "%4.1f ", get_stats( history, zap_rate_r[i] ) / 1000000.0 );
 				len = ( int )strlen( buf );
-				for ( j= 0; j < ( len - ( int )strlen( histarr[i] ) - 1 ); j++ ) {
+				for ( j= 0; j < ( len - ( int )strlen( zap_rate_histarr[i] ) - 1 ); j++ ) {
 					printf( " " );
 				}
-				printf( "%s ", histarr[i] );
+				printf( "%s ", zap_rate_histarr[i] );
+			}
+			if ( p.owd_count ) {
+				printf( "| " );
+				for ( i = 0; i < ( ( sizeof owd_r ) / sizeof( double ) ); i++ ) {
+					printf( "%7s ", owd_histarr[i] );
+				}
+				printf( "one-way delay " );
+			}
+			if ( p.ipdv_count ) {
+				printf( "|  jitter     min    mean     max     99%% delay variation" );
+			}
+			if ( perf->payloads_dropped ) {
+				printf( " |   host    net drops" );
 			}
 			printf( "\n" );
 
@@ -596,65 +850,243 @@ int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *histo
 }
 
 
+// The payload transmit delay, in usecs, with any sub-microsecond part as a fraction.
+void dump_delay( zap_config_t *config, char delimit )
+{
+	if ( config->station_config.payload_transmit_delay_nsec ) {
+		zap_writer_printf( &zap_results, "%d.%03d%c", config->station_config.payload_transmit_delay,
+			config->station_config.payload_transmit_delay_nsec, delimit );
+	} else {
+		zap_writer_printf( &zap_results, "%d%c", config->station_config.payload_transmit_delay, delimit );
+	}
+}
+
+
 void dump_stats( zap_history_t *history, FILE *fileio, char delimit )
 {
-    int					i;
-    unsigned __int32	mb;
-    int					total;
+	unsigned __int32	i;
+	unsigned __int64	mb;
+	unsigned __int64	total;
 
-	if ( !history || !history->data ){
+	if ( !history || !history->gather_count ){
 		return;
 	}
-	i = 0;
-	for ( mb = 0; mb < ( history->data[history->gather_count - 1] + 1 ); mb += 1000 ) {
-        total = 0;
-        while ( history->data[i] < mb ) {
-            i++;
-            total++;
-        }
-        fprintf( fileio, "%d%c", total, delimit );
-    }
+	i = history->lowest;
+	for ( mb = 0; mb < ( zap_history_value( history, history->highest ) + 1 ); mb += 1000 ) {
+		total = 0;
+		while ( ( i <= history->highest ) && ( zap_history_value( history, i ) < mb ) ) {
+			total += history->counts[i];
+			i++;
+		}
+		fprintf( fileio, "%llu%c", ( unsigned long long )total, delimit );
+	}
+}
+
+// Append history to fileio as one record: "sketch <tag> <name> <bits> <count>", then each
+// occupied bucket as <index>:<count>, then ";". tag and name must be free of white space.
+int zap_history_write( zap_history_t *history, FILE *fileio, const char *tag, const char *name )
+{
+	unsigned __int32	i;
+
+	fprintf( fileio, "sketch %s %s %u %llu", tag, name, history->bits, ( unsigned long long )history->gather_count );
+	for ( i = history->lowest; history->gather_count && ( i <= history->highest ); i++ ) {
+		if ( history->counts[i] ) {
+			fprintf( fileio, " %u:%llu", i, ( unsigned long long )history->counts[i] );
+		}
+	}
+	fprintf( fileio, " ;\n" );
+	return ferror( fileio );
 }
 
+// Read the next record zap_history_write(  ) left in fileio into history, which it sets up,
+// and its tag and name, of up to 255 and 63 characters. Returns non-zero at the end of the file
+// or on a malformed record.
+int zap_history_read( zap_history_t *history, FILE *fileio, char *tag, char *name )
+{
+	char				word[64];
+	unsigned __int32	bits, i;
+	unsigned long long	count, total;
 
-unsigned __int32 get_stats( zap_history_t *history, double percentile )
+	if ( ( fscanf( fileio, "%63s %255s %63s %u %llu", word, tag, name, &bits, &total ) != 5 ) ||
+		strcmp( word, "sketch" ) || ( bits < 2 ) || ( bits > 24 ) ) {
+		return 1;
+	}
+	if ( zap_history_alloc( history, bits ) ) {
+		return 1;
+	}
+	while ( fscanf( fileio, "%63s", word ) == 1 ) {
+		if ( !strcmp( word, ";" ) ) {
+			return ( history->gather_count != total );
+		}
+		if ( ( sscanf( word, "%u:%llu", &i, &count ) != 2 ) || ( i >= history->bucket_count ) ) {
+			break;
+		}
+		zap_history_add( history, zap_history_value( history, i ), count );
+	}
+	zap_history_free( history );
+	return 1;
+}
+
+// Print history's throughput percentiles, labelled.
+void zap_history_print( zap_history_t *history, const char *label )
 {
-    int			 offset;
-    
-    if ( !history->gather_max ) {
-        return 0;
-    }
+	unsigned __int32	i;
+
+	printf( "%s: %llu samples |", label, ( unsigned long long )history->gather_count );
+	for ( i = 0; i < ( ( sizeof zap_rate_r ) / sizeof( double ) ); i++ ) {
+		printf( " %s %.1f", zap_rate_histarr[i], get_stats( history, zap_rate_r[i] ) / 1000000.0 );
+	}
+	printf( " mbps\n" );
+}
+
 
-    offset = ( int )( ( double ) history->gather_count * percentile );
 
-	if ( offset >= ( history->gather_count - 1 ) ){
-		offset = history->gather_count - 1;
+// Append this test's throughput histories, whole and per receiver, to config->sketchfile
+// under its tag, then merge the whole-test histories of every run the file holds under that
+// tag and print their percentiles. Returns 0 on success.
+int zap_sketch_file( zap_config_t *config, zap_history_t *rate_history )
+{
+	FILE				*fileio;
+	zap_history_t		merged, run;
+	char				mytag[256], tag[256], name[64], label[300];
+	unsigned __int32	i, runs = 0;
+
+	// Records are white space separated.
+	strncpy( mytag, config->tag ? config->tag : "-", sizeof( mytag ) - 1 );
+	mytag[sizeof( mytag ) - 1] = 0;
+	for ( i = 0; mytag[i]; i++ ) {
+		if ( isspace( ( unsigned char )mytag[i] ) ) {
+			mytag[i] = '_';
+		}
 	}
 
-	if ( history->order ) {
-		return history->data[offset];
-	} else {
-		return history->data[history->gather_count - offset - 1];
+	fileio = fopen( config->sketchfile, "a" );
+	if ( !fileio ) {
+		fprintf( stderr, "Error, could not open %s.\n", config->sketchfile );
+		return 1;
+	}
+	zap_history_write( rate_history, fileio, mytag, "all" );
+	for ( i = 0; ( config->rxs_count > 1 ) && ( i < config->rxs_count ); i++ ) {
+		zap_history_write( &config->rxs_history[i], fileio, mytag, inet_ntoa2( config->rxs_ip_address[i] ) );
+	}
+	if ( fclose( fileio ) ) {
+		return 1;
 	}
 
+	fileio = fopen( config->sketchfile, "r" );
+	if ( !fileio ) {
+		return 1;
+	}
+	if ( zap_history_init( &merged, config->stats_error ) ) {
+		fclose( fileio );
+		return 1;
+	}
+	while ( !zap_history_read( &run, fileio, tag, name ) ) {
+		if ( !strcmp( tag, mytag ) && !strcmp( name, "all" ) ) {
+			zap_history_merge( &merged, &run );
+			runs++;
+		}
+		zap_history_free( &run );
+	}
+	fclose( fileio );
+
+	sprintf( label, "%s, %u runs", mytag, runs );
+	zap_history_print( &merged, label );
+	zap_history_free( &merged );
+	return 0;
+}
+
+
+// Keep sample p, from the station on control connection s, for the archive, appending the
+// samples kept so far as a block once there are ZAP_ARCHIVE_BLOCK_SAMPLES of them or the
+// first is ZAP_ARCHIVE_BLOCK_USEC old, so that little is lost if zap goes down. Returns 0 on
+// success.
+int zap_archive_add( zap_config_t *config, SOCKET s, zap_performance_frame_t *p )
+{
+	unsigned __int32	*row, i;
+	__int64				now;
+
+	if ( !config->archive_rows ) {
+		config->archive_rows = ( unsigned __int32 * )malloc( ( size_t )ZAP_ARCHIVE_BLOCK_SAMPLES * ZAP_ARCHIVE_COLUMNS * sizeof( *row ) );
+		if ( !config->archive_rows ) {
+			return 1;
+		}
+	}
+	now = get_current_usecs(  );
+	if ( !config->archive_count ) {
+		config->archive_block_usec = now;
+	}
+	row = &config->archive_rows[( size_t )config->archive_count * ZAP_ARCHIVE_COLUMNS];
+	memcpy( row, p, sizeof( *p ) );
+	row[ZAP_ARCHIVE_COLUMN_RX] = config->txs_ip_address;
+	for ( i = 0; i < config->rxs_count; i++ ) {
+		if ( config->rxs_socket_ctl[i] == s ) {
+			row[ZAP_ARCHIVE_COLUMN_RX] = config->rxs_ip_address[i];
+		}
+	}
+	row[ZAP_ARCHIVE_COLUMN_MSEC] = ( unsigned __int32 )( ( now - config->archive_usec ) / 1000 );
+	config->archive_count++;
+
+	if ( ( config->archive_count == ZAP_ARCHIVE_BLOCK_SAMPLES ) || ( now - config->archive_block_usec >= ZAP_ARCHIVE_BLOCK_USEC ) ) {
+		return zap_archive_block( config );
+	}
+	return 0;
 }
 
-void gather_stats( zap_history_t *history, unsigned __int32 value )
+static void zap_archive_string( char *dst, const char *src, size_t size )
 {
-    if ( history->gather_count == history->gather_max ) {
-        if ( !history->gather_max ) {
-            history->gather_max = 512;
-        } else {
-            history->gather_max *= 2;
-        }
-        history->data = ( unsigned int * )realloc( history->data, history->gather_max * sizeof( history->data[0] ) );
-    }
-	history->data[history->gather_count] = value;
-	history->gather_count++;
-    qsort( history->data, history->gather_count, sizeof( history->data[0] ), compare );
+	memset( dst, 0, size );
+	if ( src ) {
+		strncpy( dst, src, size - 1 );
+	}
 }
 
+// Hand the samples kept so far to the result writer as one block for config->archivefile,
+// their columns turned from the rows they were kept in. Returns 0 on success.
+int zap_archive_block( zap_config_t *config )
+{
+	zap_archive_header_t	header;
+	unsigned __int32		column[ZAP_ARCHIVE_BLOCK_SAMPLES];
+	size_t					length;
+	unsigned __int32		i, j;
+	int						file;
 
+	if ( !config->archive_count ) {
+		return 0;
+	}
+	length = sizeof( header ) + ( size_t )config->archive_count * ZAP_ARCHIVE_COLUMNS * sizeof( column[0] );
+	if ( config->archive_count > ZAP_ARCHIVE_BLOCK_SAMPLES ) {
+		config->archive_count = 0;
+		return 1;
+	}
+	memset( &header, 0, sizeof( header ) );
+	header.magic = ZAP_ARCHIVE_MAGIC;
+	header.version = ZAP_ARCHIVE_VERSION;
+	header.length = ( unsigned __int32 )length;
+	header.tid = config->tid;
+	header.start_high = ( unsigned __int32 )( ( unsigned __int64 )config->archive_wall >> 32 );
+	header.start_low = ( unsigned __int32 )config->archive_wall;
+	header.sample_count = config->archive_count;
+	header.column_count = ZAP_ARCHIVE_COLUMNS;
+	header.tx_ip = config->txs_ip_address;
+	header.rx_count = config->rxs_count;
+	zap_archive_string( header.tag, config->tag, sizeof( header.tag ) );
+	zap_archive_string( header.sub, config->sub, sizeof( header.sub ) );
+	zap_archive_string( header.note, config->note, sizeof( header.note ) );
+	zap_writer_append( &zap_results, &header, sizeof( header ) );
+
+	for ( j = 0; j < ZAP_ARCHIVE_COLUMNS; j++ ) {
+		for ( i = 0; i < config->archive_count; i++ ) {
+			column[i] = config->archive_rows[( size_t )i * ZAP_ARCHIVE_COLUMNS + j];
+		}
+		zap_writer_append( &zap_results, column, config->archive_count * sizeof( column[0] ) );
+	}
+	config->archive_count = 0;
+
+	file = zap_writer_file( &zap_results, config->archivefile );
+	zap_writer_raw( &zap_results, file );
+	return zap_writer_commit( &zap_results, file );
+}
 
 int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_performance_frame_t *perf )
 {
@@ -662,7 +1094,7 @@ int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_
 	int						n_fd = 0;
 	unsigned __int32		i;
 	struct timeval			tv;
-	SOCKET					s[ZAP_MAX_RECEIVERS + 1];
+	SOCKET					*s;
 	unsigned __int32		s_count;
 	int						retval = 0;
 	unsigned __int32		complete = 0;
@@ -671,12 +1103,21 @@ int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_
 	int						ttsk = 0;
 	double					total= 0;
 	unsigned __int32		count = 0;
-	double					*throughput_array = NULL;	//Store value of each throughput when Zap receives package.
 
     endtime = get_current_usecs( ) + 1000000*config->test_seconds;
 	memset( perf, 0, sizeof( perf ) );
 
 	s_count = config->rxs_count + 1;
+	s = ( SOCKET * )malloc( s_count * sizeof( *s ) );
+	if ( !s ) {
+		exit_error( "Can not allocate memory for socket array\n" );
+	}
+	// Each receiver's own percentiles, besides the test's, where there are several.
+	for ( i = 0; ( config->rxs_count > 1 ) && ( i < config->rxs_count ); i++ ) {
+		if ( zap_history_init( &config->rxs_history[i], config->stats_error ) ) {
+			exit_error( "Can not allocate memory for throughput history\n" );
+		}
+	}
 
 	// Get a nice array of sockets we're concerned with.
 	for ( i = 0; i < config->rxs_count; i++ ) {
@@ -684,15 +1125,29 @@ int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_
 	}
 	s[i] = config->txs_socket_ctl;
 
-	//Allocate memory for throughput array
-	if(config->average != 0) {
-		throughput_array = (double *)malloc(config->average * sizeof(double));
-		if(throughput_array == NULL) {
-			exit_error("Can not allocate memory for throughput array\n");
+	// Without -w, avg is the mean of every report.
+	if ( !config->window_count ) {
+		zap_window_parse( &config->windows[0], "0" );
+		config->window_count = 1;
+	}
+	for ( i = 0; i < config->window_count; i++ ) {
+		if ( zap_window_init( &config->windows[i] ) ) {
+			exit_error( "Can not allocate memory for throughput window\n" );
 		}
 	}
 
+	config->archive_usec = get_current_usecs(  );
+	config->archive_wall = get_wall_nsecs(  ) / 1000;
+	config->sync_usec = get_current_usecs(  ) + 1000000;
 	while ( !complete && ( get_current_usecs() - endtime < 0 ) ) {
+		// Keep the clock estimates fresh; the answers come back with the reports.
+		if ( get_current_usecs(  ) - config->sync_usec >= 0 ) {
+			for ( i = 0; i < s_count; i++ ) {
+				zap_send_time_sync( config->tid, s[i], 0, 0 );
+			}
+			config->sync_usec += 1000000;
+		}
+
 		// Setup select.
 		FD_ZERO( &fd );
 		n_fd = 0;
@@ -725,7 +1180,7 @@ int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_
 		} else {
 			for ( i = 0; i < s_count; i++ ) {
 				if ( FD_ISSET( s[i], &fd ) ) {
-					result = zap_control_process_rx( config, s[i], rate_history, perf, &total, throughput_array );
+					result = zap_control_process_rx( config, s[i], rate_history, perf, &total );
 					if ( result < 0 ) {
 						zap_exit( 1 );
 						cleanup_exit( 1 );
@@ -752,19 +1207,42 @@ int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_
 		}
 	}
 
-	// Dump results to file.
+	for ( i = 0; ( config->rxs_count > 1 ) && ( i < config->rxs_count ); i++ ) {
+		zap_history_print( &config->rxs_history[i], inet_ntoa2( config->rxs_ip_address[i] ) );
+	}
+	if ( config->rxs_count > 1 ) {
+		zap_history_print( rate_history, "all" );
+	}
+
+	// Dump results to file, and wait for them and any others to be written.
 	if ( config->filename ) {
 		if ( zap_control_dump_file( config, perf, rate_history, total ) ) {
 			exit_error( "Could not output results\n" );
 		}
 	}
-	// Deallocate memory of throughput_array
-	if(throughput_array != NULL) {
-		free(throughput_array);
+	if ( config->archivefile ) {
+		if ( zap_archive_block( config ) ) {
+			exit_error( "Could not output archive\n" );
+		}
+	}
+	if ( zap_writer_stop( &zap_results ) ) {
+		exit_error( "Could not output results\n" );
+	}
+	if ( config->sketchfile ) {
+		if ( zap_sketch_file( config, rate_history ) ) {
+			exit_error( "Could not output sketches\n" );
+		}
+	}
+	for ( i = 0; i < config->rxs_count; i++ ) {
+		zap_history_free( &config->rxs_history[i] );
+	}
+	for ( i = 0; i < config->window_count; i++ ) {
+		zap_window_free( &config->windows[i] );
 	}
 	if(config->debugfile != NULL){
 		free(config->debugfile);
 	}
+	free( s );
 
 	return retval;
 }
@@ -779,10 +1257,13 @@ int
 zap_controller( zap_config_t *config )
 {
 	unsigned __int32		i;
-	zap_history_t			rate_history = {NULL, 0, 0, 0};
+	zap_history_t			rate_history;
 	zap_performance_frame_t perf;
 
 	memset( &perf, 0, sizeof( perf ) );
+	if ( zap_history_init( &rate_history, config->stats_error ) ) {
+		exit_error( "Can not allocate memory for throughput history\n" );
+	}
 
 	// Select test ID
 	config->tid = zap_generate_tid(  );
@@ -846,6 +1327,18 @@ zap_controller( zap_config_t *config )
 		}
 	}
 
+	// Measure the stations' clocks against ours, for one-way delay.
+	if ( zap_time_sync( config->tid, config->txs_socket_ctl, &config->txs_clock, ZAP_CLOCK_SAMPLES ) ) {
+		zap_log_error(config, "Could not synchronize clock with tx station.", ERROR);
+		exit_error( "Could not synchronize clock with tx station\n" );
+	}
+	for ( i = 0; i < config->rxs_count; i++ ) {
+		if ( zap_time_sync( config->tid, config->rxs_socket_ctl[i], &config->rxs_clock[i], ZAP_CLOCK_SAMPLES ) ) {
+			zap_log_error(config, "Could not synchronize clock with rx station.", ERROR);
+			exit_error( "Could not synchronize clock with rx station\n" );
+		}
+	}
+
 	// Indicate the test should start.
 	if ( zap_test_start( config->tid, config->txs_socket_ctl ) ) {
 		zap_log_error(config, "Could not start test.", ERROR);
@@ -894,16 +1387,16 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 	int							i, j, k;
     int                         len;
     char						*found;
+	char						*arg;
 	unsigned __int32			number=0;
 	unsigned __int32			ip_d;
 	unsigned __int32			ip_c;
 	unsigned __int32			value;
 	unsigned __int32			stop_value;
-	unsigned __int32			bit_rate = 0;
+	double						bit_rate = 0;
 	unsigned __int32			frames = 0;
-	float						fl;
+	double						fl;
 	int							reverse = 0;
-	FILE			            *fileio;
 	int							payload_length_flag = 0;
 	int							batch_time_flag = 0;
 
@@ -946,6 +1439,7 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 
 	config->rxs_count = 0;
 	config->server = 0;
+	config->stats_error = 0.001;							// Throughput percentiles to within 0.1%.
     config->test_seconds = 30000; // big enough to not matter
 	config->debugfile = NULL;
 
@@ -980,7 +1474,6 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 				case 'X':
 				case 'n':
 				case 'p':
-				case 'w':
 					if ( sscanf( &argv[i][2], "%d", &value ) != 1 ) {
 						// Bad scan..
 						return 1;
@@ -1004,9 +1497,7 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 					/*Get the start point*/
 					for ( k = j+1; k < ( int )strlen( argv[i] ); k++ ) {
 						if ( argv[i][k] == ' ' ) {
-							char temp[10];
-							strncpy(temp, argv[i]+j, k-j);
-							value = atoi(temp);
+							value = atoi( &argv[i][j] );
 						}
 					}
 					/*Get end point*/
@@ -1030,7 +1521,7 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 			    break;
 
 				case 'r':
-					if ( sscanf( &argv[i][2], "%f", &fl ) != 1 ) {
+					if ( sscanf( &argv[i][2], "%lf", &fl ) != 1 ) {
 						// Bad scan..
 						return 1;
 					}
@@ -1038,7 +1529,11 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 						return 1; 
 					}
 					fl *= 1000000.0;
-					value = ( unsigned __int32 ) fl;
+					break;
+				case 'E':
+					if ( ( sscanf( &argv[i][2], "%lf", &fl ) != 1 ) || ( fl <= 0 ) ) {
+						return 1;
+					}
 					break;
 				default:
 					break;
@@ -1060,7 +1555,7 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 					}
 					break;
 				case 'd':			// Destionation IP address
-					if ( config->rxs_count >= ZAP_MAX_RECEIVERS ) {
+					if ( zap_config_add_rx( config ) ) {
 						return 1;
 					}
 					if ( ip_d ) {
@@ -1124,7 +1619,7 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 				case 'm':			// Multicast IP
 					break;
 				case 'r':			// Data rate.
-					bit_rate = value;
+					bit_rate = fl;
 					break;
 				case 'F':
 					config->filename = &argv[i][2];
@@ -1146,7 +1641,14 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 					config->end_point = stop_value;
 					break;
 				case 'w':
-					config->average = value;
+					// One or more horizons, comma separated.
+					for ( arg = strtok( &argv[i][2], "," ); arg; arg = strtok( NULL, "," ) ) {
+						if ( ( config->window_count >= ZAP_MAX_WINDOWS ) ||
+							zap_window_parse( &config->windows[config->window_count], arg ) ) {
+							return 1;
+						}
+						config->window_count++;
+					}
 					break;
 				case 'T':
 					config->tag = &argv[i][2];
@@ -1168,6 +1670,15 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 				case 'R':
 					reverse = 1;
 					break;
+				case 'E':
+					config->stats_error = fl / 100.0;
+					break;
+				case 'K':
+					config->sketchfile = &argv[i][2];
+					break;
+				case 'A':
+					config->archivefile = &argv[i][2];
+					break;
                 case '-':
                     if ( argv[i][2] == 0 ) {
                         fprintf( stderr, "Error: Expecting more than just --\n" );
@@ -1198,6 +1709,9 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 	}
 
 	if ( !config->rxs_count ) {
+		if ( zap_config_add_rx( config ) ) {
+			return 1;
+		}
 		config->rxs_count = 1;
 		config->rxs_ip_address_ctl[0] = inet_addr( "127.0.0.1" );
 		config->open_reverse = 1;
@@ -1233,16 +1747,21 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 
 	// Check if the bit rate must be set.
 	if ( bit_rate ) {
-		double bps, bpp, usecs_p;
+		double bpp, nsecs_p;
 
-		bps = ( double )bit_rate;
 		bpp = ( double )config->station_config.payload_length * 8;
 
-		usecs_p = ( 1000000.0 / bit_rate ) * bpp;
-		config->station_config.payload_transmit_delay = ( unsigned __int32 ) usecs_p;
-		if ( config->station_config.payload_transmit_delay == 0 ) {
-			config->station_config.payload_transmit_delay = 1;
+		// Carry the interval to the nanosecond, so rates between, and beyond, whole microsecond
+		// intervals hold.
+		nsecs_p = ( 1000000000.0 / bit_rate ) * bpp + 0.5;
+		if ( nsecs_p < 1.0 ) {
+			nsecs_p = 1.0;
+		}
+		if ( nsecs_p >= 4294967295.0 * 1000.0 ) {
+			nsecs_p = 4294967295.0 * 1000.0;
 		}
+		config->station_config.payload_transmit_delay = ( unsigned __int32 )( nsecs_p / 1000.0 );
+		config->station_config.payload_transmit_delay_nsec = ( unsigned __int32 )( ( unsigned __int64 ) nsecs_p % 1000 );
 
 		//bit_rate
 	}
@@ -1273,16 +1792,15 @@ int zap_parse_args( int argc, char *argv[], zap_config_t *config )
 
 	//Dump this information to log file in the case we set -D option
 	if(config->debugfile){
-		fileio = fopen( config->debugfile, "a+" );
-		fprintf(fileio, "Engaging default options -p%d -n%d -l%d -q0x%x\n", config->station_config.batch_time, 
+		zap_writer_printf( &zap_results, "Engaging default options -p%d -n%d -l%d -q0x%x\n", config->station_config.batch_time, 
 			config->station_config.batches, config->station_config.payload_length, config->ip_tos);
 #ifndef NO_MTUDISC
 		if (pmtudisc != -1) {
-			fprintf(fileio, "Engaging explicit option %s\n", ip_pmtudisc_str(pmtudisc));
+			zap_writer_printf( &zap_results, "Engaging explicit option %s\n", ip_pmtudisc_str(pmtudisc));
 		}
 #endif // NO_MTUDISC
-		fprintf(fileio, "\n");
-		fclose(fileio);
+		zap_writer_printf( &zap_results, "\n");
+		zap_writer_commit( &zap_results, zap_writer_file( &zap_results, config->debugfile ) );
 	}
 	return 0;
 }
@@ -1351,11 +1869,16 @@ int zap( int argc, char *argv[] )
 		fprintf( stderr, "                        - Dump result to file for debugging\n" );
 		fprintf( stderr, "                          Instruction: -Dfilename,start_point,stop_point.\n" );
 		fprintf( stderr, "                          In order to dump all log file, using -Dfilname,0,0\n" );
-		fprintf( stderr, "     -w<value>          - Get the average value of throughput\n");		
+		fprintf( stderr, "     -w<n>[,e<n>,t<s>]  - Average throughput over the last n reports ( 0 for all ), exponentially\n" );
+		fprintf( stderr, "                          over about n reports ( e ), or over the last s seconds ( t ); up to %d\n", ZAP_MAX_WINDOWS );
 		fprintf( stderr, "     -T<tag>            - Tag used to describe this test case within the dumped file, required with -F\n" );
 		fprintf( stderr, "     -S<sub>            - Sub tag used to describe this test case within the dumped file.\n" );
 		fprintf( stderr, "     -N<note>           - Note used to describe this test case within the dumped file.\n" );
 		fprintf( stderr, "     -X<sec>            - Test for specified number of seconds.\n" );
+		fprintf( stderr, "     -E<percent>        - Throughput percentiles are kept to within <percent>. Defaults to 0.1.\n" );
+		fprintf( stderr, "     -K<filename>       - Append this test's throughput histories to <filename>, and report the\n" );
+		fprintf( stderr, "                          percentiles of every test it holds with the same -T tag, merged.\n" );
+		fprintf( stderr, "     -A<filename>       - Append every sample of this test to the binary archive <filename>, for zapq.\n" );
 		fprintf( stderr, "     --server           - Runs zap in server mode. No other arguments required.\n" );
 
 		return 1;
@@ -1366,11 +1889,21 @@ int zap( int argc, char *argv[] )
 }
 
 
+// However zap leaves, write out the results still queued, and the samples not yet archived.
+static void zap_results_stop( void )
+{
+	if ( pcfg && pcfg->archivefile ) {
+		zap_archive_block( pcfg );
+	}
+	zap_writer_stop( &zap_results );
+}
+
 int main( int argc, char* argv[] )
 {
 	int			err;
 
 	pcfg = NULL;
+	atexit( zap_results_stop );
 	signal( SIGTERM, zap_exit );
 	signal( SIGINT, zap_exit );
 #ifndef WIN32
@@ -28,140 +28,406 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "../zaplib/zaplib.h"
 
 zap_server_t *pServer;
+__int64 pacer_spin_nsec = ZAP_PACER_SPIN_NSEC;	// select() sleeps to within this of a departure, zap_server_tx spins the rest.
+unsigned __int32 zapd_workers = 0;				// Data-plane worker threads. 0 transmits from the main loop.
+unsigned __int32 zapd_receivers = 0;			// UDP receive threads, one per worker where SO_REUSEPORT allows.
+const char *zapd_hw_ifname = NULL;			// NIC to take hardware receive stamps from, if any.
+
+#define ZAP_POLL_READY		64					// Ready sockets handled per zap_server_rx_poll.
+
+// The hybrid pacer. zap_server_rx sleeps in select() until pacer_spin_nsec before the earliest
+// departure on the transmit wheel; timer slack and scheduling make that wakeup late by tens of
+// usecs, so stop short and busy-wait the remainder here. Returns the current time once the
+// earliest due station may send.
+__int64 zap_server_pace( zap_server_t *server )
+{
+	__int64					current_nsec, next;
 
-void zap_server_tx( zap_server_t *server, fd_set *pfd)
+	current_nsec = get_current_nsecs(  );
+	next = zap_wheel_next( &server->tx_wheel );
+	if ( ( next > current_nsec ) && ( ( next - current_nsec ) <= pacer_spin_nsec ) ) {
+		while ( current_nsec < next ) {
+			current_nsec = get_current_nsecs(  );
+		}
+	}
+
+	return current_nsec;
+}
+
+// Transmit what one station is due, within its share of this scheduling pass. worker is the
+// data-plane worker running it, with its lock held, or NULL on the main loop.
+void zap_server_tx_station( zap_server_t *server, zap_worker_t *worker, zap_station_t *station, __int64 current_nsec, fd_set *pfd)
 {
-	unsigned __int32		i;
-	zap_station_t			*station;
-	unsigned __int64		current_usec = 0;
-	unsigned __int64		diff_usec = 0;
+	__int64					diff_nsec = 0;
+	__int64					delay_nsec;
+	__int64					lookahead_nsec;
+	__int64					next_nsec;
 	unsigned __int64		tx_packets = 0, tx_packets_valid = 0;
 	unsigned __int32		end_batch = 0;
-	unsigned __int32		clean_station = 0;
-	unsigned __int32		max_packets = 0x0fffffff;
-
-	current_usec = get_current_usecs(  );
-	for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-		if ( server->stations[i].state == zap_station_state_running_tx ) {
-			clean_station = 0;	// If this becomes non-zero, we encountered an unrecoverable error and should close the station.
-			// for each transmitting station...
-			station = &server->stations[i];
-			if ( !station->payload_usec ) {
-				station->payload_usec = current_usec;
-			}
+	unsigned __int32		clean_station = 0;	// If this becomes non-zero, we encountered an unrecoverable error and should close the station.
+	unsigned __int32		max_packets;
+	unsigned __int32		sent = 0;
+	unsigned __int32		backlogged;
+	unsigned __int32		burst;
+
+	// Deficit round robin: the station may spend its credit carried from earlier passes plus
+	// one quantum, so a fast station cannot starve the others however late we woke.
+	max_packets = ( station->tx_deficit + ZAP_TX_QUANTUM ) / ( station->tx_frame_length ? station->tx_frame_length : 1 );
+
+	delay_nsec = zap_payload_delay_nsec( station );
+	if ( !station->payload_nsec ) {
+		station->payload_nsec = current_nsec;
+	}
 
-			// Calculate the amount of time since we last addressed this station.
-			diff_usec = current_usec - station->payload_usec;
-			// Calculate the number of packets we can transmit, purely based on our rate.
-			tx_packets = diff_usec / station->config.payload_transmit_delay;
-			if(tx_packets < 0) {
-				printf("\n tx_packets has negative value!!!!!!!!! %llu\n", tx_packets);
+	lookahead_nsec = 0;
+	if ( zap_tx_pacing != zap_tx_pacing_user ) {
+		// The kernel holds each payload until it is due, so hand it payloads ahead of time. Not
+		// too many: the fq qdisc drops a flow's datagrams past its per-flow limit.
+		lookahead_nsec = delay_nsec * ZAP_TX_BURST_MAX;
+		if ( lookahead_nsec > ZAP_KPACE_HORIZON_NSEC ) {
+			lookahead_nsec = ZAP_KPACE_HORIZON_NSEC;
+		}
+	}
+
+	if ( station->complete_nsec && ( current_nsec >= station->complete_nsec ) ) {
+		// The last payload of the batch has left; its completion may follow.
+		station->complete_nsec = 0;
+		if ( zap_send_data_complete( station ) ) {
+			clean_station = 1;
+		}
+		station->payload_num = 0;
+		station->batch_num ++;
+	}
+
+	tx_packets = 0;
+	if ( !station->complete_nsec && !clean_station ) {
+		// Calculate the amount of time since we last addressed this station.
+		diff_nsec = current_nsec + lookahead_nsec - station->payload_nsec;
+		// Calculate the number of packets we can transmit, purely based on our rate.
+		tx_packets = ( diff_nsec > 0 ) ? ( unsigned __int64 )( diff_nsec / delay_nsec ) : 0;
+	}
+	if(tx_packets < 0) {
+		printf("\n tx_packets has negative value!!!!!!!!! %llu\n", tx_packets);
+	}
+	// So long as we have packets to transmit...
+	if ( (tx_packets > 0) &&																			// Payloads to transmit and...
+		( ( station->batch_num < station->config.batches ) || ( station->config.batch_time ) ) &&		// Batches to transmit or timed run and...
+		( ( station->batch_num - station->last_completed_batch ) <= station->config.asynchronous ) ) {	// We don't violate asynchronous count.
+		// We may have packets to transmit. Now we need to watch for batch boundaries, asynchronous
+		// packet transmission limits, and the like.
+		// Grow tx_packets_valid as we verify we can transmit frames.
+		
+		// Check how many we can still send in this batch...
+		tx_packets_valid = station->config.batch_size - station->payload_num;
+		if ( tx_packets_valid > tx_packets ) {
+			tx_packets_valid = tx_packets;
+			tx_packets = 0;
+			end_batch = station->batch_num;
+		} else {
+			end_batch = station->batch_num + 1;
+		}
+		// We are now at a batch boundary. Must see if we can do more than complete this batch.
+		while ( tx_packets ) {
+			if ( ( end_batch - station->last_completed_batch) > station->config.asynchronous ) {
+				// Transmitting into another batch would break asynchronous semantics.
+				break;
 			}
-			// So long as we have packets to transmit...
-			if ( (tx_packets > 0) &&																			// Payloads to transmit and...
-				( ( station->batch_num < station->config.batches ) || ( station->config.batch_time ) ) &&		// Batches to transmit or timed run and...
-				( ( station->batch_num - station->last_completed_batch ) <= station->config.asynchronous ) ) {	// We don't violate asynchronous count.
-				// We may have packets to transmit. Now we need to watch for batch boundaries, asynchronous
-				// packet transmission limits, and the like.
-				// Grow tx_packets_valid as we verify we can transmit frames.
-				
-				// Check how many we can still send in this batch...
-				tx_packets_valid = station->config.batch_size - station->payload_num;
-				if ( tx_packets_valid > tx_packets ) {
-					tx_packets_valid = tx_packets;
-					tx_packets = 0;
-					end_batch = station->batch_num;
+			if ( ( end_batch ) >= station->config.batches ) {
+				// Stop transmitting at last batch.
+				break;
+			}
+			if ( station->config.batch_size > tx_packets ) {
+				tx_packets_valid += tx_packets;
+				tx_packets = 0;
+			} else {
+				tx_packets_valid += station->config.batch_size;
+				tx_packets -= station->config.batch_size;
+			}
+			end_batch++;
+		}
+
+		// Now tx_packets_valid contains the number of payloads to transmit. Transmit them! ( Hope we don't block!! )				
+		while ( (tx_packets_valid > 0) && ( !clean_station ) && ( sent < max_packets ) ) {
+			burst = 1;
+			if ( station->config.tcp ) {
+				if ( station->s_tcp_count != 1 ) {
+					erk;
+					clean_station = 1;
 				} else {
-					end_batch = station->batch_num + 1;
-				}
-				// We are now at a batch boundary. Must see if we can do more than complete this batch.
-				while ( tx_packets ) {
-					if ( ( end_batch - station->last_completed_batch) > station->config.asynchronous ) {
-						// Transmitting into another batch would break asynchronous semantics.
-						break;
-					}
-					if ( ( end_batch ) >= station->config.batches ) {
-						// Stop transmitting at last batch.
-						break;
+					if ( zap_send_data( station, station->s_tcp[0] ) ) {
+						clean_station = 1;
 					}
-					if ( station->config.batch_size > tx_packets ) {
-						tx_packets_valid += tx_packets;
-						tx_packets = 0;
-					} else {
-						tx_packets_valid += station->config.batch_size;
-						tx_packets -= station->config.batch_size;
+				}
+			} else {
+				// UDP payloads go out in bursts that never cross a batch boundary, so the
+				// completion frame below still follows the last payload of its batch.
+				burst = station->config.batch_size - station->payload_num;
+				if ( burst > tx_packets_valid ) {
+					burst = ( unsigned __int32 ) tx_packets_valid;
+				}
+				if ( burst > max_packets - sent ) {
+					burst = max_packets - sent;
+				}
+				if ( server->uring ) {
+					if ( zap_uring_send_burst( server, station, burst ) ) {
+						clean_station = 1;
 					}
-					end_batch++;
+				} else if ( zap_send_data_burst( station, station->s_udp_tx, burst ) ) {
+					clean_station = 1;
 				}
+			}
 
-				// Now tx_packets_valid contains the number of payloads to transmit. Transmit them! ( Hope we don't block!! )				
-				while ( (tx_packets_valid > 0) && ( !clean_station ) ) {
-					if ( station->config.tcp ) {
-						if ( station->s_tcp_count > 1 ) {
-							erk;
-							clean_station = 1;
-						} else {
-							if ( zap_send_data( station->config.tcp, station->id, station->batch_num, station->payload_num, station->s_tcp[0], 0, station->config.payload_length ) ) {
-								clean_station = 1;
-							}
-						}
-					} else {
-						if ( zap_send_data( station->config.tcp, station->id, station->batch_num, station->payload_num, server->udp_socket_tx, station->config.tx_ip, station->config.payload_length ) ) {
-							clean_station = 1;
-						}
-					}
+			station->payload_nsec += burst * delay_nsec;	// Scheduled departure time, so lateness never accumulates.
 
-					station->payload_usec += station->config.payload_transmit_delay;	// Estimated departure time.
+			tx_packets_valid -= burst;
+			station->payload_num += burst;
+			if ( ( station->payload_num >= station->config.batch_size ) && ( zap_tx_pacing != zap_tx_pacing_user ) ) {
+				// Payloads of this batch may still sit in the qdisc. Sending the completion now would
+				// overtake them, so hold it, and the next batch, until the last one is due out.
+				station->complete_nsec = station->payload_nsec + delay_nsec;
+				break;
+			}
+			if ( station->payload_num >= station->config.batch_size ) {
+			// go to a new batch!!
+				if ( zap_send_data_complete( station ) ) {
+					clean_station = 1;
+				}
+					station->payload_num = 0;
+					station->batch_num ++;
+					//Sleep( 1000 );  XXX Can be useful for debugging.
+				//}
+			}
 
-					tx_packets_valid--;
-					station->payload_num ++;
-					if ( station->payload_num >= station->config.batch_size ) {
-					// go to a new batch!!
-						if ( zap_send_data_complete( station ) ) {
-							clean_station = 1;
-						}
-							station->payload_num = 0;
-							station->batch_num ++;
-							//Sleep( 1000 );  XXX Can be useful for debugging.
-						//}
-					}
+			sent += burst;
+		}
 
-					max_packets--;
-					if ( !max_packets ) {
-						break;
-					}
-				}
+	}
+
+	// Unspent credit only carries over while there is more to send.
+	backlogged = ( tx_packets_valid > 0 ) && ( sent >= max_packets ) && !station->complete_nsec;
+	if ( backlogged ) {
+		station->tx_deficit += ZAP_TX_QUANTUM - sent * station->tx_frame_length;
+	} else {
+		station->tx_deficit = 0;
+	}
+
+	// Figure out when this station next needs attention, and put it back on the wheel.
+	if ( station->complete_nsec ) {
+		station->blocked = 0;
+		next_nsec = station->complete_nsec;
+	} else if ( backlogged ) {
+		// Out of credit with payloads due. Come back on the next pass, behind the others.
+		station->blocked = 0;
+		next_nsec = current_nsec;
+	} else if ( tx_packets ) {
+		// something kept us from transmitting, thus we're blocked. A completion response re-arms us.
+		station->blocked = 1;
+		next_nsec = 0;
+	} else {
+		station->blocked = 0;				
+		next_nsec = delay_nsec - ( current_nsec + lookahead_nsec - station->payload_nsec );
+		if ( next_nsec < lookahead_nsec / 2 ) {
+			// Let the kernel's queue drain by half before topping it up.
+			next_nsec = lookahead_nsec / 2;
+		}
+		next_nsec += current_nsec;
+	}
+
+	// If some error occurred, close/reset station.
+	if ( clean_station ) {
+		if ( worker ) {
+			// Sockets belong to the main loop. Hanging up the control connection has it clean up.
+			shutdown( station->s_control, SHUT_RDWR );
+		} else {
+			zap_clean_station( station, pfd);
+		}
+	} else if ( next_nsec ) {
+		zap_timer_arm( worker ? &worker->wheel : &server->tx_wheel, &station->tx_timer, next_nsec );
+	}
+}
+
+void zap_server_tx( zap_server_t *server, fd_set *pfd)
+{
+	zap_timer_t				*timer, *next;
+	zap_station_t			*station;
+	__int64					current_nsec;
+
+	current_nsec = zap_server_pace( server );
+	// Only stations whose deadline has passed are visited. Timers due together come back in the
+	// order they were armed, so a backlogged station re-armed for now queues behind the others.
+	for ( timer = zap_wheel_expire( &server->tx_wheel, current_nsec ); timer; timer = next ) {
+		next = timer->next;
+		station = ( zap_station_t * )timer->data;
+		if ( station->state == zap_station_state_running_tx ) {
+			zap_server_tx_station( server, NULL, station, current_nsec, pfd );
+		}
+	}
+}
 
+// A data-plane worker. Runs the stations it owns as their deadlines come due, and before each
+// sleep looks for a station to take off a busier worker. Like the main loop it sleeps to within
+// pacer_spin_nsec of the next departure and spins the rest, with its lock dropped.
+void zap_server_worker( zap_worker_t *worker )
+{
+	zap_server_t			*server = worker->server;
+	zap_timer_t				*timer, *next;
+	zap_station_t			*station;
+	__int64					current_nsec, next_nsec;
+
+	zap_worker_lock( worker );
+	while ( 1 ) {
+		if ( worker->waiters ) {
+			// The main loop has control traffic for one of ours. Mutexes are not fair, so
+			// unlocking alone may not let it in.
+			zap_worker_unlock( worker );
+			while ( worker->waiters ) {
+				zap_relinquish(  );
 			}
+			zap_worker_lock( worker );
+		}
 
-			// Figure out how long we may need to wait for next transmission.
-			if ( tx_packets ) {
-				// something kept us from transmitting, thus we're blocked.
-				station->blocked = 1;
-			} else {
-				station->blocked = 0;				
-				station->next_event = station->config.payload_transmit_delay - ( ( unsigned __int32 )( current_usec - station->payload_usec ) );
+		current_nsec = get_current_nsecs(  );
+		for ( timer = zap_wheel_expire( &worker->wheel, current_nsec ); timer; timer = next ) {
+			next = timer->next;
+			station = ( zap_station_t * )timer->data;
+			if ( station->state == zap_station_state_running_tx ) {
+				zap_server_tx_station( server, worker, station, current_nsec, NULL );
 			}
+		}
 
-			// If some error occurred, close/reset station.
-			if ( clean_station ) {
-				zap_clean_station( station, pfd);
+		next_nsec = zap_wheel_next( &worker->wheel );
+		if ( next_nsec && ( next_nsec <= current_nsec + pacer_spin_nsec ) ) {
+			zap_worker_unlock( worker );
+			while ( get_current_nsecs(  ) < next_nsec ) {
 			}
+			zap_worker_lock( worker );
+		} else if ( !zap_worker_steal( server, worker ) ) {
+			zap_worker_wait( worker, next_nsec ? next_nsec - pacer_spin_nsec : 0 );
 		}
 	}
 }
 
+// A receiver. Blocks on its socket of the SO_REUSEPORT group and acts on each burst it reads,
+// taking locks frame by frame, so it holds none while it waits. data_completes handed to it
+// wait until it has read what is queued ahead of them.
+void zap_server_receiver( zap_worker_t *receiver )
+{
+#ifdef ZAP_HAVE_RECVMMSG
+	unsigned char			*space;
+	unsigned __int32		seen;
+
+	space = ( unsigned char * )malloc( ZAP_RX_BURST_MAX * MAX_PACKET_LEN );
+	if ( !space ) {
+		exit_error( "Could not allocate receive buffer\n" );
+	}
+	while ( 1 ) {
+		seen = zap_receiver_wait( receiver );
+		zap_rx_burst( receiver->server, receiver->rx_socket, space, 0 );
+		zap_receiver_complete( receiver->server, receiver, seen );
+	}
+#endif
+}
+
+// How long zapd may sleep: until the earliest transmit deadline, short of it by the spin window
+// zap_server_pace busy-waits. -1 if nothing is waiting to transmit, so only the sockets can wake us.
+__int64 zap_server_sleep_nsec( zap_server_t *server )
+{
+	__int64				next_nsec, sleep_nsec;
+
+	next_nsec = zap_wheel_next( &server->tx_wheel );
+	// While reports go out, wake to read the host's counters for them.
+	if ( ZAP_LOAD_ACQUIRE( server->snmp_wanted ) &&
+		( !next_nsec || ( server->snmp_nsec + ZAP_SNMP_PERIOD_NSEC + pacer_spin_nsec < next_nsec ) ) ) {
+		next_nsec = server->snmp_nsec + ZAP_SNMP_PERIOD_NSEC + pacer_spin_nsec;
+	}
+	if ( !next_nsec ) {
+		return -1;
+	}
+	sleep_nsec = next_nsec - pacer_spin_nsec - get_current_nsecs(  );
+	return ( sleep_nsec < 0 ) ? 0 : sleep_nsec;
+}
+
+// Read the host's counters for the stations' reports, every ZAP_SNMP_PERIOD_NSEC while they go
+// out, so no report opens /proc itself.
+void zap_server_snmp( zap_server_t *server )
+{
+	if ( ZAP_LOAD_ACQUIRE( server->snmp_wanted ) &&
+		( get_current_nsecs(  ) >= server->snmp_nsec + ZAP_SNMP_PERIOD_NSEC ) ) {
+		ZAP_STORE_RELEASE( server->snmp_wanted, 0 );
+		zap_snmp_sample( server );
+	}
+}
+
+// Wait on the epoll set, and read from just the sockets that are ready.
+void zap_server_rx_poll( zap_server_t *server, fd_set *pfd)
+{
+	zap_poll_event_t	ready[ZAP_POLL_READY];
+	zap_station_t		*station;
+	zap_worker_t		*worker;
+	SOCKET				sock;
+	int					n, k, owned, uring;
+	unsigned __int32	j;
+
+	zap_server_unlock( server );
+	n = zap_poll_wait( server, ready, ZAP_POLL_READY, zap_server_sleep_nsec( server ) );
+	zap_server_lock( server );
+	// The server's own sockets first, as zap_server_rx has them: UDP data read ahead of the
+	// stations' TCP sockets, so no data_complete closes a batch before its data is read.
+	// The io_uring is reaped on any station event as well, whether or not its descriptor was
+	// ready: receives it completes while epoll_wait returns would otherwise wait a pass.
+	uring = 0;
+	for ( k = 0; k < n; k++ ) {
+		if ( ready[k].station ) {
+			uring |= ( server->uring != NULL );
+			continue;
+		}
+		if ( ready[k].sock == server->tcp_socket ) {
+			zap_accept( server, server->tcp_socket, NULL );
+		} else if ( server->uring ) {
+			uring = 1;
+		} else {
+			zap_rx_data( server, server->udp_socket_rx, 0, pfd, NULL );
+		}
+	}
+	if ( uring ) {
+		zap_uring_poll( server );
+	}
+	for ( k = 0; k < n; k++ ) {
+		station = ready[k].station;
+		sock = ready[k].sock;
+		if ( !station ) {
+			continue;
+		}
+
+		// An earlier event this pass may have cleaned the station, and the descriptor since been reused.
+		owned = ( station->s_control == sock );
+		for ( j = 0; j < station->s_tcp_count; j++ ) {
+			owned |= ( station->s_tcp[j] == sock );
+		}
+		if ( !owned ) {
+			continue;
+		}
+		// Hold off the station's worker while its control and completion traffic is handled.
+		worker = zap_station_lock( station );
+		if ( zap_rx_data( server, sock, 1, pfd, station ) ) {
+			zap_clean_station( station, pfd );
+		}
+		zap_worker_unlock( worker );
+	}
+}
+
 void zap_server_rx( zap_server_t *server, fd_set *pfd)
 {
 	int					fd_count;
 	struct timeval		tv;
 	int					result;
-	__int64				current_usec;
-	__int64				usec_delay = 100000;
-	__int64				delta;
+	__int64				sleep_nsec;
+	__int64				usec_delay;
 	unsigned __int32	i, j;
 	zap_station_t		*station, 
 						*stationcleaned= NULL;
+	zap_worker_t		*worker;
+	int					ready;
 	int                 rv;
 
 	FD_ZERO( pfd );
@@ -169,40 +435,17 @@ void zap_server_rx( zap_server_t *server, fd_set *pfd)
 
 	FD_SET( server->tcp_socket, pfd );
 	N_UPDATE( fd_count, server->tcp_socket );
-	FD_SET( server->udp_socket_rx, pfd );
-	N_UPDATE( fd_count, server->udp_socket_rx );
-
-	current_usec = get_current_usecs(  );
-
-	for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-		station = &( server->stations[i] );
+	if ( server->uring ) {
+		// UDP receives complete on the io_uring; its descriptor polls readable when they do.
+		FD_SET( zap_uring_fd( server ), pfd );
+		N_UPDATE( fd_count, zap_uring_fd( server ) );
+	} else if ( !server->receiver_count ) {
+		FD_SET( server->udp_socket_rx, pfd );
+		N_UPDATE( fd_count, server->udp_socket_rx );
+	}
 
-		// Find the next transmit event...
-		switch( station->state ) {
-			case zap_station_state_running_tx:
-				if ( !station->blocked ) {
-					if ( station->next_event < usec_delay ) {
-						usec_delay = station->next_event;
-					}
-				}
-				//usec_delay = 0;
-				break;
-			case zap_station_state_running_rx:
-				delta = current_usec - station->payload_usec;
-				if ( station->payload_usec ) {
-					if ( delta > station->config.payload_timeout )  {
-						fprintf( stderr, "Station payload timeout\n" );
-						zap_clean_station( station, pfd);
-					} else {
-						if ( ( station->config.payload_timeout - delta ) < usec_delay ) {
-							usec_delay = station->config.payload_timeout - delta;
-						}
-					}
-				}
-				break;
-			default:
-				break;
-		}
+	for ( i = 0; i < server->station_count; i++ ) {
+		station = ZAP_STATION( server, i );
 
 		// Add sockets...
 		if ( station->s_control != INVALID_SOCKET ) {
@@ -217,9 +460,15 @@ void zap_server_rx( zap_server_t *server, fd_set *pfd)
 		}
 	}
 
-	tv.tv_sec = ( long )( usec_delay / 1000000 );
-	tv.tv_usec = ( long )( usec_delay % 1000000 );
-	result = select( fd_count+1, pfd, NULL, NULL, &tv );
+	sleep_nsec = zap_server_sleep_nsec( server );
+	if ( sleep_nsec >= 0 ) {
+		usec_delay = sleep_nsec / 1000;
+		tv.tv_sec = ( long )( usec_delay / 1000000 );
+		tv.tv_usec = ( long )( usec_delay % 1000000 );
+	}
+	zap_server_unlock( server );
+	result = select( fd_count+1, pfd, NULL, NULL, ( sleep_nsec >= 0 ) ? &tv : NULL );
+	zap_server_lock( server );
 	if(result) {
 		// receive data...
 		if ( FD_ISSET( server->tcp_socket, pfd ) ) {
@@ -229,7 +478,11 @@ void zap_server_rx( zap_server_t *server, fd_set *pfd)
 				zap_clean_station( stationcleaned, pfd );
 			}
 		}
-		if ( FD_ISSET( server->udp_socket_rx, pfd ) ) {
+		if ( server->uring ) {
+			if ( FD_ISSET( zap_uring_fd( server ), pfd ) ) {
+				zap_uring_poll( server );
+			}
+		} else if ( !server->receiver_count && FD_ISSET( server->udp_socket_rx, pfd ) ) {
 			stationcleaned = NULL;
 			rv = zap_rx_data( server, server->udp_socket_rx, 0, pfd, stationcleaned );
 			if ( ( stationcleaned != NULL ) && rv ) {
@@ -237,10 +490,21 @@ void zap_server_rx( zap_server_t *server, fd_set *pfd)
 			}
 		}
 
-		for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-			station = &( server->stations[i] );
+		for ( i = 0; i < server->station_count; i++ ) {
+			station = ZAP_STATION( server, i );
 			stationcleaned = station;
 
+			// Hold off the station's worker while its control and completion traffic is handled.
+			ready = ( station->s_control != INVALID_SOCKET ) && FD_ISSET( station->s_control, pfd );
+			for ( j = 0; j < station->s_tcp_count; j++ ) {
+				if ( station->s_tcp[j] != INVALID_SOCKET ) {
+					ready |= FD_ISSET( station->s_tcp[j], pfd );
+				}
+			}
+			if ( !ready ) {
+				continue;
+			}
+			worker = zap_station_lock( station );
 			if ( station->s_control != INVALID_SOCKET ) {
 				if ( FD_ISSET( station->s_control, pfd ) ) {
 					if ( zap_rx_data( server, station->s_control, 1, pfd, stationcleaned ) ) {
@@ -257,6 +521,7 @@ void zap_server_rx( zap_server_t *server, fd_set *pfd)
 					}
 				}
 			}
+			zap_worker_unlock( worker );
 		}
 	}
 }
@@ -265,27 +530,57 @@ void ParseCommandLine( int argc, const char **argv)
 {
 	int			i;
 
-#ifndef NO_MTUDISC
 	for ( i = 1; i < argc; i++ ) {
 		if ( argv[i][0] == '-' ) {
 			switch ( argv[i][1] ) {
+#ifndef NO_MTUDISC
 				case 'M':			// Path MTU Discovery
 					pmtudisc = !strcmp(&argv[i][2], "dont") ? IP_PMTUDISC_DONT :
 					           !strcmp(&argv[i][2], "want") ? IP_PMTUDISC_WANT :
 					           !strcmp(&argv[i][2], "do") ? IP_PMTUDISC_DO : -1;
 					break;
+#endif // NO_MTUDISC
+#ifdef ZAP_HAVE_UDP_GSO
+				case 'G':			// UDP segmentation offload transmit.
+					if ( zap_tx_mode != zap_tx_mode_burst ) {
+						printf( "-G overrides -U: one transmit engine at a time\n" );
+					}
+					zap_tx_mode = zap_tx_mode_gso;
+					break;
+#endif // ZAP_HAVE_UDP_GSO
+#ifdef ZAP_HAVE_URING
+				case 'U':			// io_uring data plane.
+					if ( zap_tx_mode != zap_tx_mode_burst ) {
+						printf( "-U overrides -G: one transmit engine at a time\n" );
+					}
+					zap_tx_mode = zap_tx_mode_uring;
+					break;
+#endif // ZAP_HAVE_URING
+#ifdef ZAP_HAVE_TXTIME
+				case 'P':			// Kernel pacing.
+					zap_tx_pacing = !strcmp( &argv[i][2], "txtime" ) ? zap_tx_pacing_txtime :
+					                !strcmp( &argv[i][2], "rate" ) ? zap_tx_pacing_rate : zap_tx_pacing_user;
+					break;
+#endif // ZAP_HAVE_TXTIME
+				case 'W':			// Data-plane worker threads.
+					zapd_workers = strtoul( &argv[i][2], NULL, 0 );
+					if ( zapd_workers > ZAP_MAX_WORKERS ) {
+						zapd_workers = ZAP_MAX_WORKERS;
+					}
+					break;
+#ifdef ZAP_HAVE_TIMESTAMPING
+				case 'H':			// Hardware receive timestamps from this NIC.
+					zapd_hw_ifname = &argv[i][2];
+					break;
+#endif // ZAP_HAVE_TIMESTAMPING
+				case 'S':			// Pacer spin window, usecs. 0 sleeps the whole wait.
+					pacer_spin_nsec = ( __int64 ) strtoul( &argv[i][2], NULL, 0 ) * 1000;
+					break;
 				default:
 					break;
 			}
 		}
 	}
-#else
-	char		 buf[LOG_MESSAGE_OUTPUT_BUFFER_SIZE];
-
-	for ( i= argc - 1; i >= 1; i-- ) {
-        strcpy( buf, argv[i] );
-	}
-#endif // NO_MTUDISC
 }
 
 /* -------------------------------------------------------------------
@@ -302,10 +597,10 @@ void zapd_exit( int inSigno )
 	char		buf[1000];
 	
 	memset(buf, 'a', sizeof(buf));
-	for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-		zap_station_t *pStation = &( pServer->stations[i] );
+	for ( i = 0; i < ( int )pServer->station_count; i++ ) {
+		zap_station_t *pStation = ZAP_STATION( pServer, i );
 
-		for ( j = 0; j < ZAP_MAX_RECEIVERS; j++ ) {
+		for ( j = 0; j < ( int )pStation->s_tcp_max; j++ ) {
 			if ( pStation->s_tcp[j] != INVALID_SOCKET ) {
 				shutdown( pStation->s_tcp[j], SHUT_RDWR );
 #ifdef WIN32
@@ -326,6 +621,10 @@ void zapd_exit( int inSigno )
 #endif
 			closesocket( pStation->s_control );
 		}
+
+		if ( pStation->s_udp_tx != INVALID_SOCKET ) {
+			closesocket( pStation->s_udp_tx );
+		}
 	}
 	if ( num++ == 0 ) {
 		fflush( 0 );
@@ -338,7 +637,6 @@ int main( int argc, const char* argv[] )
 {
 	zap_server_t		server;
 	fd_set				fd;
-	int					i, j;
 	extern char         currPath;
 	int					bOptVal;
 	int					bOptLen = sizeof( int );
@@ -370,15 +668,11 @@ int main( int argc, const char* argv[] )
 
 	net_init(  );
 
+	// Stations are allocated as tests arrive, by zap_find_station(  ).
 	memset( &server, 0, sizeof( server ) );
-	for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-		server.stations[i].s_control = INVALID_SOCKET;
-		for ( j= 0; j < ZAP_MAX_RECEIVERS; j++ ) {
-			server.stations[i].s_tcp[j]= INVALID_SOCKET;
-		}
-		server.stations[i].s_tcp_count = 0;
-		server.stations[i].state = zap_station_state_off;
-	}
+	server.poll_fd = INVALID_SOCKET;
+	FD_ZERO( &fd );
+	zap_wheel_init( &server.tx_wheel, get_current_nsecs(  ) );
 
 	// Create/Listen on TCP + UDP socket for Data/Control connections.
 
@@ -390,14 +684,19 @@ int main( int argc, const char* argv[] )
 	if ( zap_socket( 0, 0, &( server.udp_socket_rx ) ) )	{
 		exit_error( "Could not create UDP rx socket\n" );
 	} 
-#ifndef WIN32
-    else {
-        int val=1;
-        if (setsockopt( server.udp_socket_rx, SOL_SOCKET, SO_TIMESTAMP, ( const char * )&val, sizeof( val ) )) {
-            exit_error( "Could not set UDP rx opt\n" );
-        }
+    else if ( zap_rx_timestamp_enable( server.udp_socket_rx ) ) {
+        exit_error( "Could not set UDP rx opt\n" );
     }
-#endif
+	if ( zap_rx_overflow_enable( server.udp_socket_rx ) ) {
+		printf( "Socket overflow counts unavailable; host drops will show as network drops\n" );
+	}
+	if ( zapd_hw_ifname ) {
+		if ( zap_rx_timestamp_hw( server.udp_socket_rx, zapd_hw_ifname ) ) {
+			printf( "Hardware timestamps unavailable on %s, using the kernel's\n", zapd_hw_ifname );
+		} else {
+			printf( "Engaging hardware receive timestamps on %s\n", zapd_hw_ifname );
+		}
+	}
 	if ( zap_socket( 0, 0, &( server.udp_socket_tx ) ) )	{
 		exit_error( "Could not create UDP tx socket\n" );
 	}
@@ -411,16 +710,80 @@ int main( int argc, const char* argv[] )
 		exit_error( "Could not listen on TCP server socket\n" );
 	}
 
+#ifdef ZAP_HAVE_REUSEPORT
+	if ( zapd_workers && ( zap_tx_mode != zap_tx_mode_uring ) ) {
+		int val = 1;
+
+		// Each worker gets a receiver, on a socket of its own bound to the same port.
+		if ( setsockopt( server.udp_socket_rx, SOL_SOCKET, SO_REUSEPORT, ( const char * )&val, sizeof( val ) ) ) {
+			printf( "SO_REUSEPORT unavailable, receiving on one socket\n" );
+			zapd_receivers = 0;
+		} else {
+			zapd_receivers = zapd_workers;
+		}
+	}
+#endif
+
 	// Bind UDP rx socket.
 	if ( zap_bind( server.udp_socket_rx ) ) {
 		exit_error( "Could not bind UDP rx socket\n" );
 	}
 
+	if ( zap_tx_pacing != zap_tx_pacing_user ) {
+		// Probe with the shared socket; each station readies its own as it is made.
+		if ( zap_tx_pacing_init( server.udp_socket_tx ) ) {
+			printf( "Kernel pacing unavailable, pacing in zapd\n" );
+			zap_tx_pacing = zap_tx_pacing_user;
+		} else {
+			// The qdisc spaces whole messages, and only the burst engine stamps departure times.
+			if ( zap_tx_mode != zap_tx_mode_burst ) {
+				printf( "Kernel pacing uses burst transmit\n" );
+				zap_tx_mode = zap_tx_mode_burst;
+			}
+			printf( "Engaging kernel pacing ( %s ); egress needs the fq qdisc\n",
+				( zap_tx_pacing == zap_tx_pacing_txtime ) ? "SO_TXTIME" : "SO_MAX_PACING_RATE" );
+			// No waking up for single departures.
+			pacer_spin_nsec = 0;
+		}
+	}
+	if ( zap_tx_mode == zap_tx_mode_gso ) {
+		printf( "Engaging UDP segmentation offload transmit\n" );
+	}
+	if ( zap_tx_mode == zap_tx_mode_uring ) {
+		if ( zap_uring_init( &server ) ) {
+			printf( "io_uring unavailable, using burst transmit\n" );
+			zap_tx_mode = zap_tx_mode_burst;
+		} else {
+			printf( "Engaging io_uring data plane\n" );
+		}
+	}
+	if ( zapd_workers ) {
+		if ( server.uring ) {
+			// One ring, one submitter.
+			printf( "io_uring data plane transmits from the main loop, ignoring -W\n" );
+		} else if ( zap_workers_start( &server, zapd_workers, zap_server_worker ) ) {
+			exit_error( "Could not start data-plane workers\n" );
+		} else {
+			printf( "Engaging %d data-plane workers\n", zapd_workers );
+		}
+	}
+	if ( zapd_receivers && !server.uring ) {
+		if ( zap_receivers_start( &server, zapd_receivers, zap_server_receiver ) ) {
+			exit_error( "Could not start receivers\n" );
+		}
+		printf( "Engaging %d SO_REUSEPORT receivers\n", zapd_receivers );
+	}
+	// Falls back to select, quietly, where there is no epoll.
+	zap_poll_init( &server );
 	printf("Zapd service started\n" );
 	while ( 1 ) {
+		zap_server_snmp( &server );
 		zap_server_tx( &server, &fd );
-		// Bind UDP rx socket.
-		zap_server_rx( &server, &fd );
+		if ( server.poll_fd != INVALID_SOCKET ) {
+			zap_server_rx_poll( &server, &fd );
+		} else {
+			zap_server_rx( &server, &fd );
+		}
 	}
 
 	// Never reached
@@ -151,6 +151,7 @@ char* winsock_strerror( unsigned long inErrno ) {
 #else
 #include <sys/socket.h>
 #include <errno.h>
+#include <string.h>
 #endif /* WIN32 */
 
 /* -------------------------------------------------------------------
@@ -66,6 +66,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <io.h>
 #include <tchar.h>
 #else
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -114,6 +117,10 @@ static char zap_frame_str[11][30] =
 
 char        currPath[_MAX_PATH];
 
+zap_tx_mode_enum zap_tx_mode = zap_tx_mode_burst;
+zap_tx_pacing_enum zap_tx_pacing = zap_tx_pacing_user;
+int zap_rx_stamp_hw = 0;
+
 
 #ifndef WIN32
 void closesocket( SOCKET s )
@@ -333,6 +340,60 @@ __int64 get_current_usecs( void )
 	return ticks;
 }
 
+// As get_current_usecs, in nanoseconds, from a clock that never steps.
+// Used to pace transmission.
+__int64 get_current_nsecs( void )
+{
+#ifdef WIN32
+	static LARGE_INTEGER	time_divisor;
+	static int				initialized = 0;
+	__int64					ticks;
+
+	if ( !initialized ) {
+		QueryPerformanceFrequency( ( LARGE_INTEGER * ) &time_divisor );
+		initialized = 1;
+	}
+
+	QueryPerformanceCounter( ( LARGE_INTEGER * ) &ticks );
+	// Split the scaling so ticks * 10^9 cannot overflow.
+	return ( ticks / time_divisor.QuadPart ) * 1000000000LL +
+		( ( ticks % time_divisor.QuadPart ) * 1000000000LL ) / time_divisor.QuadPart;
+
+#elif defined( CLOCK_MONOTONIC )
+
+	struct timespec	ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ( __int64 )ts.tv_sec * 1000000000LL + ( __int64 )ts.tv_nsec;
+
+#else // !CLOCK_MONOTONIC
+
+	return get_current_usecs(  ) * 1000;
+#endif // !CLOCK_MONOTONIC
+}
+
+// Wall-clock time in nanoseconds since 1970, as the kernel stamps received datagrams with.
+// Used for one-way delay, which compares two hosts' clocks.
+__int64 get_wall_nsecs( void )
+{
+#ifdef WIN32
+	FILETIME		ft;
+	__int64			ticks;
+
+	GetSystemTimePreciseAsFileTime( &ft );
+	ticks = ( ( __int64 )ft.dwHighDateTime << 32 ) | ft.dwLowDateTime;
+	// 100 nsec ticks since 1601.
+	return ( ticks - 116444736000000000LL ) * 100;
+#else
+	struct timespec	ts;
+
+	clock_gettime( CLOCK_REALTIME, &ts );
+
+	return ( __int64 )ts.tv_sec * 1000000000LL + ( __int64 )ts.tv_nsec;
+#endif
+}
+
 
 /*
  * Relinquish processor so other tasks can run.
@@ -347,15 +408,224 @@ void zap_relinquish( void )
 }
 
 
+// Histories are HDR style log-linear histograms. Values below 2^bits are counted exactly;
+// above, each power of two is split into 2^( bits - 1 ) equal buckets, so every value is
+// kept to within 2^-( bits - 1 ) of itself. Recording costs the same however long the test,
+// and the memory is set by bits alone.
+
+// Set history up with 2^bits exact values. Returns 0 on success.
+int zap_history_alloc( zap_history_t *history, unsigned __int32 bits )
+{
+	memset( history, 0, sizeof( *history ) );
+	history->bits = bits;
+	history->bucket_count = ( 66 - history->bits ) << ( history->bits - 1 );
+	history->counts = ( unsigned __int64 * )calloc( history->bucket_count, sizeof( history->counts[0] ) );
+	return !history->counts;
+}
+
+// Set history up to keep values to within relative error ( 0.001 is 0.1% ). Returns 0 on success.
+int zap_history_init( zap_history_t *history, double error )
+{
+	unsigned __int32	bits = 2;
+
+	while ( ( bits < 24 ) && ( 1.0 / ( 1 << ( bits - 1 ) ) > error ) ) {
+		bits++;
+	}
+	return zap_history_alloc( history, bits );
+}
+
+// The bucket value falls in.
+static unsigned __int32 zap_history_index( zap_history_t *history, unsigned __int64 value )
+{
+	unsigned __int32	msb, step;
+
+	if ( value < ( ( unsigned __int64 )1 << history->bits ) ) {
+		return ( unsigned __int32 )value;
+	}
+	msb = 0;
+	for ( step = 32; step; step >>= 1 ) {
+		if ( value >> ( msb + step ) ) {
+			msb += step;
+		}
+	}
+	step = msb - history->bits + 1;
+	return ( step << ( history->bits - 1 ) ) + ( unsigned __int32 )( value >> step );
+}
+
+// The middle of the values bucket index holds.
+unsigned __int64 zap_history_value( zap_history_t *history, unsigned __int32 index )
+{
+	unsigned __int32	half = 1 << ( history->bits - 1 );
+	unsigned __int32	shift;
+
+	if ( index < 2 * half ) {
+		return index;
+	}
+	shift = index / half - 1;
+	return ( ( unsigned __int64 )( index - shift * half ) << shift ) + ( ( ( unsigned __int64 )1 << shift ) >> 1 );
+}
+
+// The value rank places above the least gathered, 0 being the least.
+static unsigned __int64 zap_history_rank( zap_history_t *history, unsigned __int64 rank )
+{
+	unsigned __int64	seen;
+	unsigned __int32	i;
+
+	seen = 0;
+	for ( i = history->lowest; i < history->highest; i++ ) {
+		seen += history->counts[i];
+		if ( seen > rank ) {
+			break;
+		}
+	}
+	return zap_history_value( history, i );
+}
+
+unsigned __int64 get_stats( zap_history_t *history, double percentile )
+{
+	unsigned __int64	offset;
+
+	if ( !history->gather_count ) {
+		return 0;
+	}
+
+	offset = ( unsigned __int64 )( ( double ) history->gather_count * percentile );
+
+	if ( offset >= ( history->gather_count - 1 ) ){
+		offset = history->gather_count - 1;
+	}
+
+	// Counting up from the least.
+	if ( !history->order ) {
+		offset = history->gather_count - offset - 1;
+	}
+	return zap_history_rank( history, offset );
+}
+
+// Count value count times.
+void zap_history_add( zap_history_t *history, unsigned __int64 value, unsigned __int64 count )
+{
+	unsigned __int32	i;
+
+	i = zap_history_index( history, value );
+	history->counts[i] += count;
+	if ( !history->gather_count || ( i < history->lowest ) ) {
+		history->lowest = i;
+	}
+	if ( !history->gather_count || ( i > history->highest ) ) {
+		history->highest = i;
+	}
+	history->gather_count += count;
+}
+
+void gather_stats( zap_history_t *history, unsigned __int64 value )
+{
+	zap_history_add( history, value, 1 );
+}
+
+// Fold from's values into history. Where their precision differs, from's values go in at the
+// middle of their buckets.
+void zap_history_merge( zap_history_t *history, zap_history_t *from )
+{
+	unsigned __int32	i;
+
+	if ( !from->gather_count ) {
+		return;
+	}
+	for ( i = from->lowest; i <= from->highest; i++ ) {
+		if ( from->counts[i] ) {
+			zap_history_add( history, zap_history_value( from, i ), from->counts[i] );
+		}
+	}
+}
+
+void zap_history_free( zap_history_t *history )
+{
+	free( history->counts );
+	history->counts = NULL;
+	history->gather_count = 0;
+}
+
+// Empty history, keeping its buckets. Only those between the least and greatest are cleared.
+static void zap_history_clear( zap_history_t *history )
+{
+	if ( history->gather_count ) {
+		memset( &history->counts[history->lowest], 0, ( history->highest - history->lowest + 1 ) * sizeof( history->counts[0] ) );
+	}
+	history->gather_count = 0;
+}
+
+
+// Set delay up, or empty it if it already is. Returns 0 on success.
+static int zap_delay_init( zap_delay_t *delay )
+{
+	if ( delay->above.counts ) {
+		zap_history_clear( &delay->below );
+		zap_history_clear( &delay->above );
+		return 0;
+	}
+	if ( zap_history_alloc( &delay->below, ZAP_DELAY_BITS ) || zap_history_alloc( &delay->above, ZAP_DELAY_BITS ) ) {
+		zap_history_free( &delay->below );
+		zap_history_free( &delay->above );
+		return 1;
+	}
+	return 0;
+}
+
+static void zap_delay_add( zap_delay_t *delay, __int64 nsec )
+{
+	if ( nsec < 0 ) {
+		zap_history_add( &delay->below, 0 - ( unsigned __int64 )nsec, 1 );
+	} else {
+		zap_history_add( &delay->above, ( unsigned __int64 )nsec, 1 );
+	}
+}
+
+static unsigned __int64 zap_delay_count( zap_delay_t *delay )
+{
+	return delay->below.gather_count + delay->above.gather_count;
+}
+
+// Percentile p of delay's nsecs.
+static __int64 zap_delay_percentile( zap_delay_t *delay, double p )
+{
+	unsigned __int64	count, offset;
+
+	count = zap_delay_count( delay );
+	if ( !count ) {
+		return 0;
+	}
+	offset = ( unsigned __int64 )( ( double )count * p );
+	if ( offset >= count ) {
+		offset = count - 1;
+	}
+	if ( offset < delay->below.gather_count ) {
+		return -( __int64 )zap_history_rank( &delay->below, delay->below.gather_count - offset - 1 );
+	}
+	return ( __int64 )zap_history_rank( &delay->above, offset - delay->below.gather_count );
+}
+
+
+// The station_hash bucket of test ID tid.
+static unsigned __int32 zap_station_bucket( unsigned __int32 tid )
+{
+	return ( tid * 2654435761u ) >> ( 32 - ZAP_STATION_HASH_BITS );
+}
+
+// Close station's sockets, taking them out of pfd if it is given, and free its slot.
 void zap_clean_station( zap_station_t *station, fd_set *pfd)
 {
-	int			i;
+	zap_station_t	**link;
+	int				i;
 
 	if ( station->state != zap_station_state_off ) {
 	}
-	for ( i = 0; i < ZAP_MAX_RECEIVERS; i++ ) {
+	// Stop transmitting first, so no worker is still using what follows.
+	zap_station_disown( station );
+
+	for ( i = 0; i < ( int )station->s_tcp_max; i++ ) {
 		if ( station->s_tcp[i] != INVALID_SOCKET ) {
-			if ( FD_ISSET( station->s_tcp[i], pfd ) ){
+			if ( pfd && FD_ISSET( station->s_tcp[i], pfd ) ){
 				FD_CLR( station->s_tcp[i], pfd );
 			}
 			shutdown( station->s_tcp[i], SHUT_WR );
@@ -370,7 +640,7 @@ void zap_clean_station( zap_station_t *station, fd_set *pfd)
 	}
 
 	if ( station->s_control != INVALID_SOCKET ) {
-		if ( FD_ISSET( station->s_control, pfd ) ){
+		if ( pfd && FD_ISSET( station->s_control, pfd ) ){
 			FD_CLR( station->s_control, pfd );
 		}
 		shutdown( station->s_control, SHUT_WR );
@@ -383,36 +653,129 @@ void zap_clean_station( zap_station_t *station, fd_set *pfd)
 		station->s_control = INVALID_SOCKET;
 	}
 
+	free( station->s_tcp );
+	station->s_tcp = NULL;
 	station->s_tcp_count = 0;
+	station->s_tcp_max = 0;
+
+	zap_station_tx_release( station );
 
 	station->state = zap_station_state_off;
 
 	memset( &station->sample, 0, sizeof( station->sample ) );
-
+	zap_history_free( &station->owd.below );
+	zap_history_free( &station->owd.above );
+	zap_history_free( &station->ipdv.below );
+	zap_history_free( &station->ipdv.above );
+
+	if ( station->server ) {
+		zap_hash_lock( station->server, 1 );
+		for ( link = &station->server->station_hash[zap_station_bucket( station->id )]; *link; link = &( *link )->hash_next ) {
+			if ( *link == station ) {
+				*link = station->hash_next;
+				break;
+			}
+		}
+		zap_hash_unlock( station->server, 1 );
+		station->free_next = station->server->station_free;
+		station->server->station_free = station;
+		station->server = NULL;
+	}
 	station->id = 0;
 }
 
-int zap_find_station( unsigned __int32 tid, zap_server_t *server, zap_station_t **station, unsigned __int32 add)
+// A free station slot of server's, from those freed or else a new one, allocating its
+// block if need be. NULL once ZAP_MAX_STATIONS are in use.
+static zap_station_t *zap_station_alloc( zap_server_t *server )
 {
+	zap_station_t			*station;
+	zap_station_t			*block;
 	unsigned __int32		i;
-	unsigned __int32		useme = 0xffffffff;
 
-	for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-		if ( server->stations[i].id == tid ) {
-			*station = &( server->stations[i] );
-			return 0;
+	// A receiver may still be holding a freed slot it looked up before the clean; it checks
+	// the test id again under the station's lock, so the slot may be reused at once.
+	if ( server->station_free ) {
+		station = server->station_free;
+		server->station_free = station->free_next;
+		return station;
+	}
+	if ( server->station_count >= ZAP_MAX_STATIONS ) {
+		return NULL;
+	}
+	if ( !( server->station_count % ZAP_STATION_BLOCK ) ) {
+		block = ( zap_station_t * )calloc( ZAP_STATION_BLOCK, sizeof( *block ) );
+		if ( !block ) {
+			return NULL;
+		}
+		for ( i = 0; i < ZAP_STATION_BLOCK; i++ ) {
+			block[i].index = server->station_count + i;
+			block[i].s_control = INVALID_SOCKET;
+			block[i].s_udp_tx = INVALID_SOCKET;
+			block[i].state = zap_station_state_off;
+			block[i].tx_timer.data = &block[i];
 		}
-		if ( ( useme > ZAP_MAX_STATIONS ) &&
-			( server->stations[i].state == zap_station_state_off ) ) {
-			useme = i;
+		server->station_blocks[server->station_count / ZAP_STATION_BLOCK] = block;
+	}
+	// Published with the count, for workers walking the blocks unlocked.
+	station = ZAP_STATION( server, server->station_count );
+	ZAP_STORE_RELEASE( server->station_count, server->station_count + 1 );
+	return station;
+}
+
+// Make room in station's s_tcp for one more data socket. Returns 0 on success.
+static int zap_station_tcp_room( zap_station_t *station )
+{
+	SOCKET					*s_tcp;
+	unsigned __int32		i, max;
+
+	if ( station->s_tcp_count < station->s_tcp_max ) {
+		return 0;
+	}
+	max = station->s_tcp_max ? station->s_tcp_max * 2 : 4;
+	s_tcp = ( SOCKET * )realloc( station->s_tcp, max * sizeof( *s_tcp ) );
+	if ( !s_tcp ) {
+		return 1;
+	}
+	for ( i = station->s_tcp_max; i < max; i++ ) {
+		s_tcp[i] = INVALID_SOCKET;
+	}
+	station->s_tcp = s_tcp;
+	station->s_tcp_max = max;
+	return 0;
+}
+
+// Find the station for test ID tid, or with add, take a free one for it. Only the main loop
+// adds. Receivers look up without the server lock, under the hash lock alone, so what they
+// find may be cleaned before they lock it; see zap_rx_frame_locked(  ).
+int zap_find_station( unsigned __int32 tid, zap_server_t *server, zap_station_t **station, unsigned __int32 add)
+{
+	zap_station_t			**bucket;
+	zap_station_t			*found;
+
+	bucket = &server->station_hash[zap_station_bucket( tid )];
+	zap_hash_lock( server, 0 );
+	for ( found = *bucket; found; found = found->hash_next ) {
+		if ( found->id == tid ) {
+			break;
 		}
 	}
+	zap_hash_unlock( server, 0 );
+	if ( found ) {
+		*station = found;
+		return 0;
+	}
 
 	if ( add ) {
-		if ( useme < ZAP_MAX_STATIONS ) {
-			*station = &( server->stations[useme] );
-			( *station )->id = tid;
-			( *station )->state = zap_station_state_init;
+		found = zap_station_alloc( server );
+		if ( found ) {
+			found->id = tid;
+			found->state = zap_station_state_init;
+			found->server = server;
+			zap_hash_lock( server, 1 );
+			found->hash_next = *bucket;
+			*bucket = found;
+			zap_hash_unlock( server, 1 );
+			*station = found;
 
 			return 0;
 		}
@@ -420,7 +783,7 @@ int zap_find_station( unsigned __int32 tid, zap_server_t *server, zap_station_t
 	return 1;
 }
 
-int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsigned __int32 *remote_ip, struct timeval *tv)
+int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsigned __int32 *remote_ip, __int64 *rx_nsec)
 {
 	static unsigned char	frame_space[65536];
 	zap_frame_t				*frame;
@@ -452,8 +815,7 @@ int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsi
 #else
         struct msghdr   msg;
         struct iovec    iov;
-        char            ctrl[CMSG_SPACE(sizeof(struct timeval))];
-        struct cmsghdr  *cmsg = (struct cmsghdr *) &ctrl;
+        unsigned __int64 ctrl[ZAP_RX_CTRL_LEN / sizeof( unsigned __int64 )];
 
         addr.sin_addr.s_addr    = INADDR_ANY;
         addr.sin_port           = htons(ZAP_SERVICE_PORT);
@@ -470,11 +832,8 @@ int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsi
         iov.iov_len          = sizeof(frame_space);
 
         len = recvmsg(s, &msg, 0);
-        if (cmsg->cmsg_level == SOL_SOCKET &&
-            cmsg->cmsg_type  == SCM_TIMESTAMP &&
-            cmsg->cmsg_len   == CMSG_LEN(sizeof(struct timeval))) {
-            if (tv)
-                memcpy(tv, CMSG_DATA(cmsg), sizeof(struct timeval));
+        if ( ( len >= 0 ) && rx_nsec && zap_rx_timestamp( &msg, rx_nsec, NULL ) ) {
+            *rx_nsec = 0;
         }
 #endif
 		if ( len < 0 ) {
@@ -482,21 +841,207 @@ int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsi
 			errOut( "Received socket error on read.\n");
 #endif
 			return 1;
-		} else {
-			if ( len < sizeof( zap_header_t ) ) {
-				erk; 
-				return 1; 
-			}
-			if ( len != ntohl( frame->header.length ) ) { 
-				erk; 
-				return 1; 
-			}
+		}
+		if ( zap_check_datagram( frame, len ) ) {
+			return 1;
 		}
 		if ( remote_ip ) {
 			*remote_ip = addr.sin_addr.s_addr;
 		}
 	}
 
+	if ( zap_check_version( frame ) ) {
+		return 1;
+	}
+
+	*rx_frame = frame;
+	return 0;
+}
+
+
+#ifndef WIN32
+// Pull the kernel receive timestamp out of a received message, in nanoseconds: the hardware
+// stamp if zap_rx_stamp_hw, else the software one, and ZAP_RX_UNSTAMPED if that one is
+// missing. Returns non-zero if the message carried none. The socket's SO_RXQ_OVFL drop count goes to rx_drops, if it came
+// and rx_drops is non-NULL; the kernel sends none until the socket has dropped something.
+int zap_rx_timestamp( struct msghdr *msg, __int64 *rx_nsec, unsigned __int32 *rx_drops )
+{
+	struct cmsghdr	*cmsg;
+	struct timespec	ts[3];
+	struct timeval	tv;
+	int				rv = 1;
+
+	for ( cmsg = CMSG_FIRSTHDR( msg ); cmsg; cmsg = CMSG_NXTHDR( msg, cmsg ) ) {
+		if ( cmsg->cmsg_level != SOL_SOCKET ) {
+			continue;
+		}
+		if ( ( cmsg->cmsg_type == SCM_TIMESTAMPING ) &&
+			( cmsg->cmsg_len >= CMSG_LEN( sizeof( ts ) ) ) ) {
+			// ts[0] is software, ts[2] raw hardware; ts[1] is unused.
+			memcpy( ts, CMSG_DATA( cmsg ), sizeof( ts ) );
+			if ( zap_rx_stamp_hw ) {
+				ts[0] = ts[2];
+			}
+			if ( rx_nsec ) {
+				*rx_nsec = ( !ts[0].tv_sec && !ts[0].tv_nsec ) ? ZAP_RX_UNSTAMPED :
+					( __int64 )ts[0].tv_sec * 1000000000 + ts[0].tv_nsec;
+			}
+			rv = 0;
+		}
+		if ( ( cmsg->cmsg_type == SCM_TIMESTAMP ) &&
+			( cmsg->cmsg_len == CMSG_LEN( sizeof( struct timeval ) ) ) ) {
+			memcpy( &tv, CMSG_DATA( cmsg ), sizeof( tv ) );
+			if ( rx_nsec ) {
+				*rx_nsec = ( ( __int64 )tv.tv_sec * 1000000 + tv.tv_usec ) * 1000;
+			}
+			rv = 0;
+		}
+		if ( ( cmsg->cmsg_type == SO_RXQ_OVFL ) &&
+			( cmsg->cmsg_len == CMSG_LEN( sizeof( unsigned __int32 ) ) ) && rx_drops ) {
+			memcpy( rx_drops, CMSG_DATA( cmsg ), sizeof( *rx_drops ) );
+		}
+	}
+	return rv;
+}
+#endif // !WIN32
+
+// Have sock stamp every datagram it receives, to the nanosecond where the kernel can, and with
+// the NIC's clock where that is enabled. Falls back to microsecond SO_TIMESTAMP.
+int zap_rx_timestamp_enable( SOCKET sock )
+{
+#ifdef ZAP_HAVE_TIMESTAMPING
+	int			flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+						SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+	if ( !setsockopt( sock, SOL_SOCKET, SO_TIMESTAMPING, ( const char * )&flags, sizeof( flags ) ) ) {
+		return 0;
+	}
+#endif
+#ifndef WIN32
+	{
+		int			val = 1;
+
+		if ( setsockopt( sock, SOL_SOCKET, SO_TIMESTAMP, ( const char * )&val, sizeof( val ) ) ) {
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+// Have sock report, with each datagram, how many it has had to drop for want of queue space.
+// Returns non-zero if the kernel cannot.
+int zap_rx_overflow_enable( SOCKET sock )
+{
+#ifndef WIN32
+	int			val = 1;
+
+	if ( !setsockopt( sock, SOL_SOCKET, SO_RXQ_OVFL, ( const char * )&val, sizeof( val ) ) ) {
+		return 0;
+	}
+#endif
+	return 1;
+}
+
+// Read the host's counters of datagrams it could not deliver. Returns non-zero, leaving snmp
+// alone, where there is no /proc/net/snmp. The kernel keeps 64 bits; the low 32 serve for
+// differences.
+int zap_snmp_read( zap_snmp_t *snmp )
+{
+#ifdef WIN32
+	return 1;
+#else
+	FILE			*file;
+	char			names[2048], values[2048];
+	char			*name, *value, *name_save, *value_save;
+
+	file = fopen( "/proc/net/snmp", "r" );
+	if ( !file ) {
+		return 1;
+	}
+	// Each protocol has a line of counter names, then a line of their values.
+	while ( fgets( names, sizeof( names ), file ) && fgets( values, sizeof( values ), file ) ) {
+		name = strtok_r( names, " \n", &name_save );
+		value = strtok_r( values, " \n", &value_save );
+		while ( name && value ) {
+			if ( !strcmp( names, "Udp:" ) && !strcmp( name, "RcvbufErrors" ) ) {
+				snmp->udp_rcvbuf_errors = ( unsigned __int32 )strtoull( value, NULL, 10 );
+			} else if ( !strcmp( names, "Udp:" ) && !strcmp( name, "InErrors" ) ) {
+				snmp->udp_in_errors = ( unsigned __int32 )strtoull( value, NULL, 10 );
+			} else if ( !strcmp( names, "Ip:" ) && !strcmp( name, "ReasmFails" ) ) {
+				snmp->ip_reasm_fails = ( unsigned __int32 )strtoull( value, NULL, 10 );
+			}
+			name = strtok_r( NULL, " \n", &name_save );
+			value = strtok_r( NULL, " \n", &value_save );
+		}
+	}
+	fclose( file );
+	return 0;
+#endif
+}
+
+// Read the host's counters into server->snmp, for reports on any thread to take their
+// differences from. Each is stored whole; the three need not be read at one instant.
+void zap_snmp_sample( zap_server_t *server )
+{
+	zap_snmp_t		snmp;
+
+	server->snmp_nsec = get_current_nsecs(  );
+	if ( zap_snmp_read( &snmp ) ) {
+		return;
+	}
+	ZAP_STORE_RELEASE( server->snmp.udp_rcvbuf_errors, snmp.udp_rcvbuf_errors );
+	ZAP_STORE_RELEASE( server->snmp.udp_in_errors, snmp.udp_in_errors );
+	ZAP_STORE_RELEASE( server->snmp.ip_reasm_fails, snmp.ip_reasm_fails );
+}
+
+// Turn on hardware receive stamping of every packet at the NIC ifname. The sockets asked for
+// hardware stamps already; this makes the device supply them. Returns non-zero if it cannot.
+int zap_rx_timestamp_hw( SOCKET sock, const char *ifname )
+{
+#ifdef ZAP_HAVE_TIMESTAMPING
+	struct hwtstamp_config	config;
+	struct ifreq			ifr;
+
+	memset( &config, 0, sizeof( config ) );
+	config.tx_type = HWTSTAMP_TX_OFF;
+	config.rx_filter = HWTSTAMP_FILTER_ALL;
+	memset( &ifr, 0, sizeof( ifr ) );
+	strncpy( ifr.ifr_name, ifname, sizeof( ifr.ifr_name ) - 1 );
+	ifr.ifr_data = ( char * )&config;
+	if ( ioctl( sock, SIOCSHWTSTAMP, &ifr ) ) {
+		WARN_errno( 1, "zap_rx_timestamp_hw - SIOCSHWTSTAMP" );
+		return 1;
+	}
+	// Some devices can only stamp a wider class of packet than asked.
+	if ( config.rx_filter == HWTSTAMP_FILTER_NONE ) {
+		return 1;
+	}
+	zap_rx_stamp_hw = 1;
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+
+// Sanity check a datagram of len bytes before it is parsed.
+int zap_check_datagram( zap_frame_t *frame, int len )
+{
+	if ( len < ( int )sizeof( zap_header_t ) ) {
+		erk; 
+		return 1; 
+	}
+	if ( len != ( int )ntohl( frame->header.length ) ) { 
+		erk; 
+		return 1; 
+	}
+	return 0;
+}
+
+
+int zap_check_version( zap_frame_t *frame )
+{
 	if ( ( ntohl( frame->header.zap_minor_vers ) != ZAP_MINOR_VERSION ) ||
 		( ntohl( frame->header.zap_major_vers ) != ZAP_MAJOR_VERSION ) ) {
 		errOut( "Zap version incompatibility, Version %d.%d vs %d.%d\n", 
@@ -506,8 +1051,6 @@ int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsi
 			ntohl( frame->header.zap_minor_vers ) );
 		return 1;
 	}
-
-	*rx_frame = frame;
 	return 0;
 }
 
@@ -623,6 +1166,57 @@ static void zap_set_tos( SOCKET sock, unsigned __int32 *tos)
 	}
 }
 
+// Ready the tx socket for kernel pacing. Returns 1 if the kernel lacks the socket option.
+int zap_tx_pacing_init( SOCKET s )
+{
+#ifdef ZAP_HAVE_TXTIME
+	struct {
+		__int32				clockid;
+		unsigned __int32	flags;
+	} txtime;
+	unsigned __int32		rate = 0xffffffff;
+
+	switch ( zap_tx_pacing ) {
+		case zap_tx_pacing_txtime:
+			// Departure times are get_current_nsecs(  ) values.
+			txtime.clockid = CLOCK_MONOTONIC;
+			txtime.flags = 0;
+			if ( setsockopt( s, SOL_SOCKET, SO_TXTIME, ( const char * )&txtime, sizeof( txtime ) ) ) {
+				return 1;
+			}
+			break;
+		case zap_tx_pacing_rate:
+			// Unlimited, until a station says otherwise.
+			if ( setsockopt( s, SOL_SOCKET, SO_MAX_PACING_RATE, ( const char * )&rate, sizeof( rate ) ) ) {
+				return 1;
+			}
+			break;
+		default:
+			break;
+	}
+
+	return 0;
+#else
+	return ( zap_tx_pacing != zap_tx_pacing_user );
+#endif // ZAP_HAVE_TXTIME
+}
+
+// Pace the socket at the station's rate, in bytes per second of IP datagrams.
+static void zap_set_pacing_rate( SOCKET sock, zap_station_t *station )
+{
+#ifdef ZAP_HAVE_TXTIME
+	unsigned __int64	rate;
+	unsigned __int32	rate32;
+
+	rate = ( ( unsigned __int64 ) station->tx_frame_length + 28 ) * 1000000000ULL;
+	rate /= ( unsigned __int64 ) zap_payload_delay_nsec( station );
+	rate32 = ( rate > 0xfffffffe ) ? 0xfffffffe : ( unsigned __int32 ) rate;
+	if ( setsockopt( sock, SOL_SOCKET, SO_MAX_PACING_RATE, ( const char * )&rate32, sizeof( rate32 ) ) ) {
+		fprintf( stdout, "err: Could not set SO_MAX_PACING_RATE socket option. err = %d\n", errno );
+	}
+#endif // ZAP_HAVE_TXTIME
+}
+
 int zap_accept( zap_server_t *server, SOCKET sock, zap_station_t *station_cleaned)
 {
     struct sockaddr_in  addr;
@@ -678,61 +1272,101 @@ int zap_accept( zap_server_t *server, SOCKET sock, zap_station_t *station_cleane
 				src++;
 			}
 
+			// From here a failure leaves the station half set up; clean it, socket and all.
 			station->s_control = new_sock;
+			if ( zap_poll_watch( server, station, new_sock ) ) {
+				zap_clean_station( station, NULL );
+				return 1;
+			}
 			station->state = zap_station_state_rx_config;
 			if ( !station->config.tx ) {
 				station->state = zap_station_state_running_rx;
 			}
 
 			station->blocked = 0;
-			station->next_event = 0;
 			station->batch_num = 0;
 			station->sample_num = 0;
 			station->last_completed_batch = 0xffffffff;
 			station->batch_start_usec = 0;
 			station->payload_usec = 0;
+			station->payload_nsec = 0;
+			station->complete_nsec = 0;
+			station->tx_deficit = 0;
 			station->payload_num = 0;
+			station->tx_refused = 0;
+			station->tx_gso_off = 0;
+
+			if ( station->config.tx ) {
+				if ( zap_station_tx_prepare( station ) ) {
+					zap_clean_station( station, NULL );
+					return 1;
+				}
+				if ( !station->config.tcp && zap_station_tx_socket( station ) ) {
+					zap_clean_station( station, NULL );
+					return 1;
+				}
+			}
 
 			max_payload_outstanding = station->config.batch_size * station->config.asynchronous;
 			max_batch_outstanding = station->config.asynchronous;
 
 			memset( &station->sample, 0, sizeof( station->sample ) );
+			if ( !station->config.tx && ( zap_delay_init( &station->owd ) || zap_delay_init( &station->ipdv ) ) ) {
+				erk;
+				zap_clean_station( station, NULL );
+				return 1;
+			}
+			station->last_transit = 0;
+			station->transit_seen = 0;
+			station->jitter = 0;
+			station->seq_next = 0;
+			station->seq_owed = 0;
+			memset( station->seq_window, 0, sizeof( station->seq_window ) );
+			station->rx_socket = INVALID_SOCKET;
+			station->rx_complete = NULL;
+			zap_snmp_sample( server );
+			station->snmp_base = server->snmp;
+			if ( !station->config.tx ) {
+				// Set up; its receiver may have it now.
+				zap_station_own( server, station );
+			}
 
-			// Resize UDP socket to max of all active stations.
+			// Resize UDP rx socket(s) to max of all active stations. Each transmitter sizes its own.
 			sockbuf_size = 64*1024;
-			for ( i = 0; i < ZAP_MAX_STATIONS; i++ ) {
-				if ( server->stations[i].state != zap_station_state_off ) {
-					if ( !server->stations[i].config.tcp ) {
-						new_size = server->stations[i].config.batch_size * server->stations[i].config.payload_length;
+			for ( i = 0; i < server->station_count; i++ ) {
+				if ( ZAP_STATION( server, i )->state != zap_station_state_off ) {
+					if ( !ZAP_STATION( server, i )->config.tcp ) {
+						new_size = ZAP_STATION( server, i )->config.batch_size * ZAP_STATION( server, i )->config.payload_length;
 						if ( new_size > sockbuf_size ) {
 							sockbuf_size = new_size;
 						}
 					}
 				}
 			}
-			if ( setsockopt( server->udp_socket_tx, SOL_SOCKET, SO_SNDBUF, ( const char * )&sockbuf_size, sizeof( sockbuf_size ) ) ) { 
-				erk;
-			}
 			if ( setsockopt( server->udp_socket_rx, SOL_SOCKET, SO_RCVBUF, ( const char * )&sockbuf_size, sizeof( sockbuf_size ) ) ) {
 				erk;
 			}
-			// Set Tos Bit.  FIXME:  Because different stations use the same TX socket, we need
-			// to resolve conflicts if the stations specifies different TOS values.  There is no
-			// easy way to do this.
-			zap_set_tos( server->udp_socket_tx, &station->config.ip_tos );
+			for ( i = 1; i < server->receiver_count; i++ ) {
+				if ( setsockopt( server->receivers[i].rx_socket, SOL_SOCKET, SO_RCVBUF, ( const char * )&sockbuf_size, sizeof( sockbuf_size ) ) ) {
+					erk;
+				}
+			}
 			if ( zap_send_ready( station->id, new_sock ) ) {
 				erk;
-				//zap_clean_station( station );
+				zap_clean_station( station, NULL );
 				return 1;
 			}
 			break;
 		case zap_type_open_data_conn:
 			// A new data connection! Whee!!!
 			station_cleaned = station;
-			if ( station->s_tcp_count < ZAP_MAX_RECEIVERS ) {
+			if ( !zap_station_tcp_room( station ) ) {
 				if ( station->s_tcp[station->s_tcp_count] == INVALID_SOCKET ) {
 					station->s_tcp[station->s_tcp_count] = new_sock;
 					station->s_tcp_count++;
+					if ( zap_poll_watch( server, station, new_sock ) ) {
+						return 1;
+					}
 					zap_set_tos( new_sock, &station->config.ip_tos );
 					if ( zap_send_ready( station->id, new_sock ) ) {
 						erk;
@@ -870,10 +1504,12 @@ int zap_get_ready( SOCKET s, unsigned __int32 tcp, unsigned __int32 usecs)
 {
 	zap_frame_t			*rx_frame;
 
-	// Read response.
-	if ( zap_read_frame( s, 1, &rx_frame, NULL, NULL ) ) {
-		return 1;
-	}
+	// Read response, past any clock exchange still in flight.
+	do {
+		if ( zap_read_frame( s, 1, &rx_frame, NULL, NULL ) ) {
+			return 1;
+		}
+	} while ( ntohl( rx_frame->header.zap_frame_type ) == zap_type_time_sync );
 
 	if ( ntohl( rx_frame->header.zap_frame_type ) != zap_type_ready ) {
 		return 1;
@@ -956,23 +1592,157 @@ int zap_send_performance_report( zap_station_t *station, zap_performance_frame_t
 	return 0;
 }
 
-int zap_send_data(unsigned __int32 tcp,  
-				  unsigned __int32 tid, 
-				  unsigned __int32 batch, 
-				  unsigned __int32 payload, 
-				  SOCKET s, 
-				  unsigned __int32 remote_ip, 
-				  unsigned __int32 payload_length)
+// Interval between payloads of a transmitting station, in nsecs.
+__int64 zap_payload_delay_nsec( zap_station_t *station )
+{
+	__int64		delay;
+
+	delay = ( __int64 ) station->config.payload_transmit_delay * 1000 + station->config.payload_transmit_delay_nsec;
+	if ( !delay ) {
+		delay = 1;
+	}
+
+	return delay;
+}
+
+// Build the station's data frame template and cached destination. Called once the
+// station has its configuration; the per-payload work is then patching two numbers.
+int zap_station_tx_prepare( zap_station_t *station )
 {
-	static char		frame_bytes[65536];
-	zap_frame_t		*frame = ( zap_frame_t * )&frame_bytes[0];
+	zap_frame_t			*frame;
+	unsigned __int32	length;
+
+	zap_station_tx_release( station );
+
+	length = station->config.payload_length;
+	if ( length < ZAP_DATA_HEADER_LEN ) {
+		length = ZAP_DATA_HEADER_LEN;
+	}
+	if ( length > MAX_PACKET_LEN ) {
+		erk;
+		return 1;
+	}
+
+	station->tx_frame = ( unsigned char * )calloc( 1, length );
+	if ( !station->tx_frame ) {
+		erk;
+		return 1;
+	}
+	station->tx_frame_length = length;
+
+	frame = ( zap_frame_t * )station->tx_frame;
+	frame->header.length = htonl( length );
+	frame->header.zap_frame_type = htonl( zap_type_data );
+	frame->header.zap_major_vers = htonl( ZAP_MAJOR_VERSION );
+	frame->header.zap_minor_vers = htonl( ZAP_MINOR_VERSION );
+	frame->header.zap_test_id = htonl( station->id );
+
+	return zap_station_tx_addr( station );
+}
+
+// Refresh the cached UDP destination after config.tx_ip is set or learned, and
+// connect the station's socket to it.
+int zap_station_tx_addr( zap_station_t *station )
+{
+	int		rv;
+
+	memset( &station->tx_addr, 0, sizeof( station->tx_addr ) );
+	station->tx_addr.sin_addr.s_addr = station->config.tx_ip;
+	station->tx_addr.sin_family		 = AF_INET;
+	station->tx_addr.sin_port		 = htons( ZAP_SERVICE_PORT );
+
+	if ( ( station->s_udp_tx != INVALID_SOCKET ) && station->config.tx_ip ) {
+		rv = connect( station->s_udp_tx, ( struct sockaddr * )&station->tx_addr, sizeof( station->tx_addr ) );
+		if ( rv ) {
+			WARN_errno( rv == SOCKET_ERROR, "zap_station_tx_addr - connect" );
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Give a transmitting station a UDP socket of its own, so its TOS, send buffer and
+// pacing apply to its traffic alone.
+int zap_station_tx_socket( zap_station_t *station )
+{
+	unsigned __int32	sockbuf_size;
+
+	sockbuf_size = station->config.batch_size * station->config.payload_length;
+	if ( sockbuf_size < 64*1024 ) {
+		sockbuf_size = 64*1024;
+	}
+	if ( zap_socket( sockbuf_size, 0, &station->s_udp_tx ) ) {
+		station->s_udp_tx = INVALID_SOCKET;
+		erk;
+		return 1;
+	}
+	zap_set_tos( station->s_udp_tx, &station->config.ip_tos );
+	if ( zap_tx_pacing != zap_tx_pacing_user ) {
+		if ( zap_tx_pacing_init( station->s_udp_tx ) ) {
+			erk;
+			return 1;
+		}
+		if ( zap_tx_pacing == zap_tx_pacing_rate ) {
+			zap_set_pacing_rate( station->s_udp_tx, station );
+		}
+	}
+
+	return zap_station_tx_addr( station );
+}
+
+void zap_station_tx_release( zap_station_t *station )
+{
+	if ( station->tx_frame ) {
+		free( station->tx_frame );
+		station->tx_frame = NULL;
+	}
+	if ( station->tx_gso ) {
+		free( station->tx_gso );
+		station->tx_gso = NULL;
+	}
+	station->tx_frame_length = 0;
+	station->tx_gso_count = 0;
+	if ( station->s_udp_tx != INVALID_SOCKET ) {
+		closesocket( station->s_udp_tx );
+		station->s_udp_tx = INVALID_SOCKET;
+	}
+}
+
+// Transmit the station's next payload ( batch_num, payload_num ) from its template.
+// An ICMP port unreachable from the peer fails the next send on a connected UDP socket,
+// and that datagram does not go out. The peer may only have been slow to open its socket,
+// so the refusal is counted and the send tried again, rather than ending the test.
+static int zap_send_refused( zap_station_t *station )
+{
+	int		refused;
+
+#ifdef WIN32
+	refused = ( WSAGetLastError(  ) == WSAECONNRESET );
+#else
+	refused = ( errno == ECONNREFUSED );
+#endif
+	if ( refused && !station->tx_refused++ ) {
+		fprintf( stderr, "Data for test %u refused by its peer ( port unreachable ), sending on\n", station->id );
+	}
+	return refused;
+}
+
+int zap_send_data( zap_station_t *station, SOCKET s )
+{
+	zap_frame_t		*frame = ( zap_frame_t * )station->tx_frame;
 	int				rv;
 	int						ttsk = 0;
 	fd_set					write_fds;
 	int						n_fd = 0;
 	struct timeval			tv;
 
-	if( tcp ) {
+	if ( !frame ) {
+		erk;
+		return 1;
+	}
+
+	if( station->config.tcp ) {
 		FD_ZERO( &write_fds );
 		FD_SET( s, &write_fds );
 		N_UPDATE( n_fd, s );
@@ -990,35 +1760,228 @@ int zap_send_data(unsigned __int32 tcp,
 		}
 	}
 
-	if ( payload_length < ( sizeof( zap_header_t ) + sizeof( zap_data_frame_t ) ) ) {
-		payload_length = sizeof( zap_header_t ) + sizeof( zap_data_frame_t );
+	frame->payload.data.batch_number = htonl( station->batch_num );
+	frame->payload.data.payload_number = htonl( station->payload_num );
+	zap_stamp_data( frame, get_wall_nsecs(  ) );
+
+	// UDP goes out on the station's own socket, already connected to tx_ip.
+	while ( ( rv = send( s, ( const char * )frame, station->tx_frame_length, 0 ) ) != ( int )station->tx_frame_length ){
+		if ( station->config.tcp || ( rv != SOCKET_ERROR ) || !zap_send_refused( station ) ) {
+			return 1;
+		}
 	}
 
-	frame->header.length = htonl( payload_length );
-	frame->header.zap_frame_type = htonl( zap_type_data );
-	frame->header.zap_major_vers = htonl( ZAP_MAJOR_VERSION );
-	frame->header.zap_minor_vers = htonl( ZAP_MINOR_VERSION );
-	frame->header.zap_test_id = htonl( tid );
-	frame->payload.data.batch_number = htonl( batch );
-	frame->payload.data.payload_number = htonl( payload );
+	return 0;
+}
 
-	if ( remote_ip ) {
-		struct sockaddr_in		addr;
 
-		addr.sin_addr.s_addr = remote_ip;
-		addr.sin_family		 = AF_INET;
-		addr.sin_port		 = htons( ZAP_SERVICE_PORT );
-		if ( ( rv = sendto( s, ( const char * )frame, payload_length, 0, ( struct sockaddr * )&addr, sizeof( addr ) ) ) != payload_length ){
-			return 1;
+#ifdef ZAP_HAVE_SENDMMSG
+// Transmit count UDP data payloads ( payload, payload+1, ... ) of one batch. Each
+// datagram is a private copy of the template header followed by the template's fill,
+// and up to ZAP_TX_BURST_MAX of them go down in one sendmmsg call.
+static int zap_send_data_mmsg(zap_station_t *station, 
+							  SOCKET s, 
+							  unsigned __int32 batch, 
+							  unsigned __int32 payload, 
+							  unsigned __int32 count)
+{
+	zap_frame_t				hdr[ZAP_TX_BURST_MAX];
+	struct mmsghdr			msgs[ZAP_TX_BURST_MAX];
+	struct iovec			iov[ZAP_TX_BURST_MAX][2];
+	unsigned __int32		i, n, sent;
+	int						rv;
+#ifdef ZAP_HAVE_TXTIME
+	unsigned __int64		ctrl[ZAP_TX_BURST_MAX][CMSG_SPACE( sizeof( unsigned __int64 ) ) / sizeof( unsigned __int64 )];
+	struct cmsghdr			*cmsg;
+	__int64					depart, delay, wall;
+
+	// Payload k of the burst leaves one interval after payload k - 1; payload_nsec is the last to leave.
+	depart = station->payload_nsec;
+	delay = zap_payload_delay_nsec( station );
+	// The same departures, on the wall clock the frames are stamped with.
+	wall = get_wall_nsecs(  ) - get_current_nsecs(  );
+#endif // ZAP_HAVE_TXTIME
+
+	while ( count ) {
+		n = ( count > ZAP_TX_BURST_MAX ) ? ZAP_TX_BURST_MAX : count;
+		memset( msgs, 0, n * sizeof( msgs[0] ) );
+		for ( i = 0; i < n; i++ ) {
+			memcpy( &hdr[i], station->tx_frame, ZAP_DATA_HEADER_LEN );
+			hdr[i].payload.data.batch_number = htonl( batch );
+			hdr[i].payload.data.payload_number = htonl( payload + i );
+			zap_stamp_data( &hdr[i], get_wall_nsecs(  ) );
+
+			iov[i][0].iov_base = &hdr[i];
+			iov[i][0].iov_len = ZAP_DATA_HEADER_LEN;
+			iov[i][1].iov_base = station->tx_frame + ZAP_DATA_HEADER_LEN;
+			iov[i][1].iov_len = station->tx_frame_length - ZAP_DATA_HEADER_LEN;
+
+			msgs[i].msg_hdr.msg_iov = iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 2;
+#ifdef ZAP_HAVE_TXTIME
+			if ( zap_tx_pacing == zap_tx_pacing_txtime ) {
+				depart += delay;
+				msgs[i].msg_hdr.msg_control = ctrl[i];
+				msgs[i].msg_hdr.msg_controllen = sizeof( ctrl[i] );
+				cmsg = CMSG_FIRSTHDR( &msgs[i].msg_hdr );
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_TXTIME;
+				cmsg->cmsg_len = CMSG_LEN( sizeof( unsigned __int64 ) );
+				memcpy( CMSG_DATA( cmsg ), &depart, sizeof( depart ) );
+				// The qdisc holds it until then.
+				zap_stamp_data( &hdr[i], depart + wall );
+			}
+#endif // ZAP_HAVE_TXTIME
 		}
-	} else {
-		if ( ( rv = send( s, ( const char * )frame, payload_length, 0 ) ) != payload_length ){
+
+		// A blocking socket may still accept only part of the vector; push the rest.
+		sent = 0;
+		while ( sent < n ) {
+			rv = sendmmsg( s, &msgs[sent], n - sent, 0 );
+			if ( rv <= 0 ) {
+				if ( ( rv < 0 ) && ( ( errno == EINTR ) || zap_send_refused( station ) ) ) {
+					continue;
+				}
+				WARN_errno( rv == SOCKET_ERROR, "zap_send_data_mmsg - sendmmsg" );
+				return 1;
+			}
+			sent += rv;
+		}
+
+		payload += n;
+		count -= n;
+	}
+
+	return 0;
+}
+#endif // ZAP_HAVE_SENDMMSG
+
+
+#ifdef ZAP_HAVE_UDP_GSO
+// Lay the station's template out back-to-back in one segmentation offload buffer, so
+// every segment the kernel cuts out carries a complete header of its own. This is
+// done once per test; afterwards only the batch and payload numbers are patched.
+static int zap_gso_layout( zap_station_t *station )
+{
+	unsigned __int32	i, n;
+
+	n = ZAP_GSO_MAX_BYTES / station->tx_frame_length;
+	if ( n > ZAP_TX_BURST_MAX ) {
+		n = ZAP_TX_BURST_MAX;
+	}
+
+	station->tx_gso = ( unsigned char * )malloc( n * station->tx_frame_length );
+	if ( !station->tx_gso ) {
+		return 1;
+	}
+	for ( i = 0; i < n; i++ ) {
+		memcpy( &station->tx_gso[i * station->tx_frame_length], station->tx_frame, station->tx_frame_length );
+	}
+	station->tx_gso_count = n;
+
+	return 0;
+}
+
+
+// Transmit count UDP data payloads as segmentation offload super-packets. If the kernel
+// or route refuses UDP_SEGMENT, the station drops back to burst transmit for the test.
+static int zap_send_data_gso(zap_station_t *station, 
+							 SOCKET s, 
+							 unsigned __int32 batch, 
+							 unsigned __int32 payload, 
+							 unsigned __int32 count)
+{
+	char					ctrl[CMSG_SPACE( sizeof( unsigned short ) )];
+	struct cmsghdr			*cmsg;
+	struct msghdr			msg;
+	struct iovec			iov;
+	zap_frame_t				*frame;
+	unsigned __int32		i, n;
+	int						rv;
+
+	if ( !station->tx_gso && zap_gso_layout( station ) ) {
+		erk;
+		return 1;
+	}
+
+	while ( count ) {
+		n = ( count > station->tx_gso_count ) ? station->tx_gso_count : count;
+		for ( i = 0; i < n; i++ ) {
+			frame = ( zap_frame_t * )&station->tx_gso[i * station->tx_frame_length];
+			frame->payload.data.batch_number = htonl( batch );
+			frame->payload.data.payload_number = htonl( payload + i );
+			zap_stamp_data( frame, get_wall_nsecs(  ) );
+		}
+
+		memset( &msg, 0, sizeof( msg ) );
+		iov.iov_base = station->tx_gso;
+		iov.iov_len = n * station->tx_frame_length;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if ( n > 1 ) {
+			msg.msg_control = ctrl;
+			msg.msg_controllen = sizeof( ctrl );
+			cmsg = CMSG_FIRSTHDR( &msg );
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN( sizeof( unsigned short ) );
+			*( unsigned short * )CMSG_DATA( cmsg ) = ( unsigned short )station->tx_frame_length;
+		}
+
+		rv = sendmsg( s, &msg, 0 );
+		if ( rv < 0 ) {
+			if ( ( errno == EINTR ) || zap_send_refused( station ) ) {
+				continue;
+			}
+			if ( ( n > 1 ) && ( ( errno == EINVAL ) || ( errno == EIO ) || ( errno == ENOPROTOOPT ) ) ) {
+				fprintf( stderr, "UDP segmentation offload unavailable ( errno %d ), using burst transmit\n", errno );
+				station->tx_gso_off = 1;
+				return zap_send_data_mmsg( station, s, batch, payload, count );
+			}
+			WARN_errno( 1, "zap_send_data_gso - sendmsg" );
 			return 1;
 		}
+
+		payload += n;
+		count -= n;
 	}
 
 	return 0;
 }
+#endif // ZAP_HAVE_UDP_GSO
+
+
+// Transmit the station's next count UDP payloads, starting at ( batch_num, payload_num ).
+// The caller keeps count within the current batch and advances payload_num afterwards.
+int zap_send_data_burst( zap_station_t *station, SOCKET s, unsigned __int32 count)
+{
+	if ( !station->tx_frame ) {
+		erk;
+		return 1;
+	}
+
+#ifdef ZAP_HAVE_UDP_GSO
+	if ( ( zap_tx_mode == zap_tx_mode_gso ) && !station->tx_gso_off && ( count > 1 ) ) {
+		return zap_send_data_gso( station, s, station->batch_num, station->payload_num, count );
+	}
+#endif
+#ifdef ZAP_HAVE_SENDMMSG
+	return zap_send_data_mmsg( station, s, station->batch_num, station->payload_num, count );
+#else
+	{
+		unsigned __int32	first = station->payload_num;
+		int					err = 0;
+
+		while ( count && !err ) {
+			err = zap_send_data( station, s );
+			station->payload_num++;
+			count--;
+		}
+		station->payload_num = first;
+		return err;
+	}
+#endif // ZAP_HAVE_SENDMMSG
+}
 
 int zap_send_null_frame( unsigned __int32 tid, SOCKET s, unsigned __int32 remote_ip)
 {
@@ -1051,7 +2014,7 @@ int zap_send_data_complete( zap_station_t *station)
 	zap_frame_t				frame;
 	int						frame_length, rv;
 
-	if ( station->s_tcp[0] == INVALID_SOCKET) {
+	if ( !station->s_tcp_count || ( station->s_tcp[0] == INVALID_SOCKET ) ) {
 		return 1;
 	}
 
@@ -1077,7 +2040,7 @@ int zap_send_data_complete_response( zap_station_t *station, unsigned __int32 ba
 	zap_frame_t			frame;
 	int					frame_length, rv;
 
-	if ( station->s_tcp[0] == INVALID_SOCKET) {
+	if ( !station->s_tcp_count || ( station->s_tcp[0] == INVALID_SOCKET ) ) {
 		return 1;
 	}
 
@@ -1221,10 +2184,192 @@ int zap_test_complete( unsigned __int32 tid, SOCKET s)
 }
 
 
+// Put a wall-clock departure time in a data frame.
+void zap_stamp_data( zap_frame_t *frame, __int64 nsec )
+{
+	frame->payload.data.tx_nsec_high = htonl( ( unsigned __int32 )( ( unsigned __int64 )nsec >> 32 ) );
+	frame->payload.data.tx_nsec_low = htonl( ( unsigned __int32 )nsec );
+}
+
+// A nanosecond time or delay, from the network-order halves it travels in.
+__int64 zap_get_nsec( unsigned __int32 high, unsigned __int32 low )
+{
+	return ( __int64 )( ( ( unsigned __int64 )ntohl( high ) << 32 ) | ntohl( low ) );
+}
+
+// Send a clock exchange. From the controller t2 is 0, and t1 is stamped now. From a station,
+// t1 and t2 are the request's departure and arrival, and t3 is stamped now.
+int zap_send_time_sync( unsigned __int32 tid, SOCKET s, __int64 t1, __int64 t2 )
+{
+	zap_frame_t				frame;
+	int						frame_length, rv;
+	__int64					t3 = 0;
+
+	frame_length = sizeof( zap_header_t ) + sizeof( zap_time_sync_frame_t );
+	frame.header.length = htonl( frame_length );
+	frame.header.zap_frame_type = htonl( zap_type_time_sync );
+	frame.header.zap_major_vers = htonl( ZAP_MAJOR_VERSION );
+	frame.header.zap_minor_vers = htonl( ZAP_MINOR_VERSION );
+	frame.header.zap_test_id = htonl( tid );
+
+	if ( t2 ) {
+		t3 = get_wall_nsecs(  );
+	} else {
+		t1 = get_wall_nsecs(  );
+	}
+	frame.payload.time_sync.t1_high = htonl( ( unsigned __int32 )( ( unsigned __int64 )t1 >> 32 ) );
+	frame.payload.time_sync.t1_low = htonl( ( unsigned __int32 )t1 );
+	frame.payload.time_sync.t2_high = htonl( ( unsigned __int32 )( ( unsigned __int64 )t2 >> 32 ) );
+	frame.payload.time_sync.t2_low = htonl( ( unsigned __int32 )t2 );
+	frame.payload.time_sync.t3_high = htonl( ( unsigned __int32 )( ( unsigned __int64 )t3 >> 32 ) );
+	frame.payload.time_sync.t3_low = htonl( ( unsigned __int32 )t3 );
+
+	if ( ( rv = send( s, ( const char * ) &frame, frame_length, 0 ) ) != frame_length ){
+		WARN_errno( rv == SOCKET_ERROR, "zap_send_time_sync - send" );
+		return 1;
+	}
+
+	return 0;
+}
+
+// Take the station's answer to a clock exchange, received at t4 by our wall clock.
+void zap_clock_sample( zap_clock_t *clock, zap_frame_t *frame, __int64 t4 )
+{
+	__int64				t1, t2, t3;
+	unsigned __int32	i, slot, best;
+
+	t1 = zap_get_nsec( frame->payload.time_sync.t1_high, frame->payload.time_sync.t1_low );
+	t2 = zap_get_nsec( frame->payload.time_sync.t2_high, frame->payload.time_sync.t2_low );
+	t3 = zap_get_nsec( frame->payload.time_sync.t3_high, frame->payload.time_sync.t3_low );
+
+	slot = clock->count % ZAP_CLOCK_SAMPLES;
+	clock->offset[slot] = ( ( t2 - t1 ) + ( t3 - t4 ) ) / 2;
+	clock->delay[slot] = ( t4 - t1 ) - ( t3 - t2 );
+	clock->at[slot] = t1 + ( t4 - t1 ) / 2;
+	clock->count++;
+
+	// The least delayed exchange is the least skewed by queueing on either path.
+	best = 0;
+	for ( i = 1; ( i < clock->count ) && ( i < ZAP_CLOCK_SAMPLES ); i++ ) {
+		if ( clock->delay[i] < clock->delay[best] ) {
+			best = i;
+		}
+	}
+	clock->last_offset = clock->offset[best];
+	clock->last_at = clock->at[best];
+	if ( clock->count <= ZAP_CLOCK_SAMPLES ) {
+		clock->base_offset = clock->last_offset;
+		clock->base_at = clock->last_at;
+	} else if ( clock->last_at - clock->base_at > 1000000000 ) {
+		clock->drift = ( double )( clock->last_offset - clock->base_offset ) / ( double )( clock->last_at - clock->base_at );
+	}
+}
+
+// The station's clock less ours, at our wall-clock time at. 0 before any exchange.
+__int64 zap_clock_offset( zap_clock_t *clock, __int64 at )
+{
+	return clock->last_offset + ( __int64 )( clock->drift * ( double )( at - clock->last_at ) );
+}
+
+// Run count clock exchanges with the station on control connection s, one at a time.
+int zap_time_sync( unsigned __int32 tid, SOCKET s, zap_clock_t *clock, unsigned __int32 count )
+{
+	zap_frame_t			*frame;
+
+	while ( count-- ) {
+		if ( zap_send_time_sync( tid, s, 0, 0 ) ) {
+			return 1;
+		}
+		if ( zap_read_frame( s, 1, &frame, NULL, NULL ) ) {
+			return 1;
+		}
+		if ( ntohl( frame->header.zap_frame_type ) != zap_type_time_sync ) {
+			erk;
+			return 1;
+		}
+		zap_clock_sample( clock, frame, get_wall_nsecs(  ) );
+	}
+
+	return 0;
+}
+
+
+// Move the station's window up to seq, counting the payloads it passes over lost. Their
+// slots are reused for them, not yet seen.
+static void zap_seq_advance( zap_station_t *station, unsigned __int64 seq )
+{
+	unsigned __int64	next;
+
+	if ( seq <= station->seq_next ) {
+		return;
+	}
+	if ( seq - station->seq_next >= ZAP_SEQ_WINDOW ) {
+		memset( station->seq_window, 0, sizeof( station->seq_window ) );
+	} else {
+		for ( next = station->seq_next; next < seq; next++ ) {
+			station->seq_window[( next % ZAP_SEQ_WINDOW ) / 64] &= ~( ( unsigned __int64 )1 << ( next % 64 ) );
+		}
+	}
+	station->sample.frames_skipped += ( unsigned __int32 )( seq - station->seq_next );
+	station->seq_next = seq;
+}
+
+// Place payload seq in the station's window of the ZAP_SEQ_WINDOW sequence numbers below
+// seq_next, and count it into the sample. Payloads passed over are counted lost as the
+// window moves past them, and taken back off if they turn up late. Returns 1 for a repeat.
+static int zap_seq_track( zap_station_t *station, unsigned __int64 seq )
+{
+	if ( seq >= station->seq_next ) {
+		// New high.
+		zap_seq_advance( station, seq );
+		station->seq_window[( seq % ZAP_SEQ_WINDOW ) / 64] |= ( unsigned __int64 )1 << ( seq % 64 );
+		station->seq_next = seq + 1;
+		return 0;
+	}
+
+	if ( station->seq_next - seq <= ZAP_SEQ_WINDOW ) {
+		if ( station->seq_window[( seq % ZAP_SEQ_WINDOW ) / 64] & ( ( unsigned __int64 )1 << ( seq % 64 ) ) ) {
+			station->sample.frames_repeated++;
+			return 1;
+		}
+		station->seq_window[( seq % ZAP_SEQ_WINDOW ) / 64] |= ( unsigned __int64 )1 << ( seq % 64 );
+	}
+	// Late. Older than the window, it is taken for late rather than a repeat.
+	station->sample.frames_out_of_order++;
+	if ( station->sample.frames_skipped ) {
+		station->sample.frames_skipped--;
+	} else {
+		station->seq_owed++;
+	}
+	return 0;
+}
+
+// Batch numbers are 32 bits on the wire, and wrap on long runs of small batches. Take
+// rx_batch for the one nearest the highest batch seen, as serial numbers are ( RFC 1982 ).
+static unsigned __int64 zap_seq_batch( zap_station_t *station, unsigned __int32 rx_batch )
+{
+	unsigned __int64	high;
+	__int32				delta;
+
+	high = station->seq_next ? ( station->seq_next - 1 ) / station->config.batch_size : 0;
+	delta = ( __int32 )( rx_batch - ( unsigned __int32 )high );
+	if ( ( delta < 0 ) && ( ( unsigned __int64 )( -( __int64 )delta ) > high ) ) {
+		return rx_batch;
+	}
+	return ( unsigned __int64 )( ( __int64 )high + delta );
+}
+
+// The station's current batch is over: payloads of it not yet seen are counted lost, so loss
+// at the end of the last batch is reported too. zap_seq_track takes back any turning up late.
+static void zap_seq_close( zap_station_t *station )
+{
+	zap_seq_advance( station, ( zap_seq_batch( station, station->batch_num ) + 1 ) * station->config.batch_size );
+}
+
 // Gather statistics, etc, for this batch, and report them if necessary.
 int zap_batch_done( zap_station_t *station )
 {
-	station->sample.frames_skipped += station->config.batch_size - station->payload_num;
+	zap_seq_close( station );
 	station->sample.first_frame_arrival_time = 0;
 	station->sample.last_frame_arrival_time = 0;
 
@@ -1235,37 +2380,119 @@ int zap_batch_done( zap_station_t *station )
 }
 
 
+// The sample's one-way delay percentile p, in nsecs above its least.
+static unsigned __int32 zap_owd_percentile( zap_station_t *station, double p )
+{
+	__int64				above;
+
+	above = station->sample.owd_base + zap_delay_percentile( &station->owd, p ) - station->sample.owd_min;
+	if ( above < 0 ) {
+		above = 0;							// The middle of the least's bucket may fall below it.
+	}
+	return ( above > 0xffffffff ) ? 0xffffffff : ( unsigned __int32 )above;
+}
+
+// An nsec interval as a signed 32 bit report field, clamped.
+static unsigned __int32 zap_nsec_field( __int64 nsec )
+{
+	if ( nsec > 0x7fffffff ) {
+		nsec = 0x7fffffff;
+	}
+	if ( nsec < -0x7fffffff ) {
+		nsec = -0x7fffffff;
+	}
+	return ( unsigned __int32 )( __int32 )nsec;
+}
+
+// Charge up to lost of the socket's drops to a station's report. Drops may show as losses only
+// in a later sample, or be those of another station sharing the socket; each is charged once,
+// and one still unplaced after the next report on the socket is written off.
+static unsigned __int32 zap_drops_charge( zap_drops_t *drops, unsigned __int32 lost )
+{
+	unsigned __int32	charge;
+
+	charge = drops->count - drops->given;
+	if ( charge > lost ) {
+		charge = lost;
+	}
+	drops->given += charge;
+	if ( drops->held > charge ) {
+		drops->given += drops->held - charge;
+	}
+	drops->held = drops->count - drops->given;
+	return charge;
+}
+
 int zap_batch_report( zap_station_t *station)
 {
 	zap_performance_frame_t		perf;
 	unsigned __int64			bps;
-	unsigned __int64			diff_usecs;
+	unsigned __int64			diff_nsecs;
 	unsigned __int64			temp;
+	zap_drops_t					*drops;
+	zap_snmp_t					snmp;
 
 	bps = 0;
-	bps = station->sample.frames_received * station->config.payload_length * 8;   // Bits
-	bps *= 1000000;  // Compensate for dividing by microseconds instead of seconds...
-	diff_usecs = station->sample.total_time;
-	if ( diff_usecs ) {
-		bps /= diff_usecs;
+	bps = ( unsigned __int64 )station->sample.frames_received * station->config.payload_length * 8;   // Bits
+	diff_nsecs = station->sample.total_time;
+	if ( diff_nsecs ) {
+		// Bits times 10^9 outgrows 64 bits on long samples.
+		bps = ( unsigned __int64 )( ( double )bps * 1000000000.0 / ( double )diff_nsecs );
 	} else {
 		bps = 0;
 	}
 	temp = 0;
 	temp =  bps;
 	perf.bits_per_second = ( unsigned __int32 ) bps;
+	perf.bits_per_second_high = ( unsigned __int32 )( bps >> 32 );
 	perf.first_payload_timestamp = 0;
-	perf.last_payload_timestamp = ( unsigned __int32 )station->sample.total_time;
-	perf.payloads_received = station->sample.frames_received;
-	if ( station->config.batch_time ) {
-		perf.payloads_dropped = station->sample.frames_skipped;
-	} else {
-		perf.payloads_dropped = station->sample.frames_skipped;
-	}
+	perf.last_payload_timestamp = ( unsigned __int32 )( station->sample.total_time / 1000 );	// usecs on the wire.
+	perf.payloads_received = station->sample.frames_arrived;
+	// Late arrivals whose loss went out in an earlier report come off this one's.
+	temp = ( station->seq_owed < station->sample.frames_skipped ) ? station->seq_owed : station->sample.frames_skipped;
+	station->seq_owed -= ( unsigned __int32 )temp;
+	station->sample.frames_skipped -= ( unsigned __int32 )temp;
+	perf.payloads_dropped = station->sample.frames_skipped;
 	perf.payloads_outoforder = station->sample.frames_out_of_order;
 	perf.payloads_repeated = station->sample.frames_repeated;
+	drops = ( station->server->receiver_count && station->worker ) ? &station->worker->rx_drops : &station->server->rx_drops;
+	perf.payloads_dropped_host = zap_drops_charge( drops, perf.payloads_dropped );
+	// The main loop keeps the host's counters fresh while reports want them.
+	snmp.udp_rcvbuf_errors = ZAP_LOAD_ACQUIRE( station->server->snmp.udp_rcvbuf_errors );
+	snmp.udp_in_errors = ZAP_LOAD_ACQUIRE( station->server->snmp.udp_in_errors );
+	snmp.ip_reasm_fails = ZAP_LOAD_ACQUIRE( station->server->snmp.ip_reasm_fails );
+	perf.udp_rcvbuf_errors = snmp.udp_rcvbuf_errors - station->snmp_base.udp_rcvbuf_errors;
+	perf.udp_in_errors = snmp.udp_in_errors - station->snmp_base.udp_in_errors;
+	perf.ip_reasm_fails = snmp.ip_reasm_fails - station->snmp_base.ip_reasm_fails;
+	station->snmp_base = snmp;
+	ZAP_STORE_RELEASE( station->server->snmp_wanted, 1 );
 	perf.batch = station->sample_num;
+	perf.owd_count = ( unsigned __int32 )zap_delay_count( &station->owd );
+	perf.owd_min_high = perf.owd_min_low = 0;
+	perf.owd_p50 = perf.owd_p90 = perf.owd_p99 = perf.owd_p999 = perf.owd_max = 0;
+	if ( perf.owd_count ) {
+		perf.owd_min_high = ( unsigned __int32 )( ( unsigned __int64 )station->sample.owd_min >> 32 );
+		perf.owd_min_low = ( unsigned __int32 )station->sample.owd_min;
+		perf.owd_p50 = zap_owd_percentile( station, 0.5 );
+		perf.owd_p90 = zap_owd_percentile( station, 0.9 );
+		perf.owd_p99 = zap_owd_percentile( station, 0.99 );
+		perf.owd_p999 = zap_owd_percentile( station, 0.999 );
+		temp = ( unsigned __int64 )( station->sample.owd_max - station->sample.owd_min );
+		perf.owd_max = ( temp > 0xffffffff ) ? 0xffffffff : ( unsigned __int32 )temp;
+	}
+	// The jitter runs on across samples, as RFC 3550 has it.
+	perf.jitter = ( unsigned __int32 )( station->jitter >> 4 );
+	perf.ipdv_count = ( unsigned __int32 )zap_delay_count( &station->ipdv );
+	perf.ipdv_min = perf.ipdv_mean = perf.ipdv_max = perf.ipdv_p99 = 0;
+	if ( perf.ipdv_count ) {
+		perf.ipdv_min = zap_nsec_field( station->sample.ipdv_min );
+		perf.ipdv_mean = zap_nsec_field( station->sample.ipdv_sum / perf.ipdv_count );
+		perf.ipdv_max = zap_nsec_field( station->sample.ipdv_max );
+		perf.ipdv_p99 = zap_nsec_field( zap_delay_percentile( &station->ipdv, 0.99 ) );
+	}
 	memset( &station->sample, 0, sizeof( station->sample ) );
+	zap_delay_init( &station->owd );
+	zap_delay_init( &station->ipdv );
 
 	station->sample_num ++;
 
@@ -1278,13 +2505,15 @@ int zap_batch_skip( zap_station_t *station, unsigned __int32 new_batch)
 	zap_performance_frame_t	perf;
 
 	fprintf( stdout, "zap_batch_skip\n" );
-	while ( station->batch_num < new_batch ) {
+	memset( &perf, 0, sizeof( perf ) );
+	while ( ( __int32 )( new_batch - station->batch_num ) > 0 ) {
 		if ( !station->config.batch_time ) {
 			perf.bits_per_second = 0;
+			perf.bits_per_second_high = 0;
 			perf.first_payload_timestamp = 0;
 			perf.last_payload_timestamp = 0;
 			perf.batch = station->batch_num;
-			perf.payloads_dropped = station->config.batch_size;
+			perf.payloads_dropped = 0;					// Already counted lost, by zap_seq_track.
 			perf.payloads_outoforder = 0;
 			perf.payloads_repeated = 0;
 			perf.payloads_received = 0;
@@ -1297,11 +2526,12 @@ int zap_batch_skip( zap_station_t *station, unsigned __int32 new_batch)
 	return 0;
 }
 
-int zap_process_data_complete(zap_station_t *station, zap_frame_t *f)
+// The transmitter is done with batch: close it if it is still the current one, and answer if
+// the transmitter waits on that.
+int zap_batch_complete( zap_station_t *station, unsigned __int32 batch )
 {
-	unsigned __int32	remote_ip;
-
-	if (station->batch_num == ntohl( f->payload.data_complete.batch_number )) {
+	if ( station->batch_num == batch ) {
+		zap_seq_close( station );
 		station->sample.first_frame_arrival_time = 0;
 		station->sample.last_frame_arrival_time = 0;
 
@@ -1317,25 +2547,31 @@ int zap_process_data_complete(zap_station_t *station, zap_frame_t *f)
 	}
 	// This is just an indication we're done with our current batch.
 	if ( station->config.batch_completion ) {
-		return zap_send_data_complete_response( station, ntohl( f->payload.data_complete.batch_number ) );
+		return zap_send_data_complete_response( station, batch );
 	}
 
 	return 0;
 }
 
+int zap_process_data_complete(zap_station_t *station, zap_frame_t *f)
+{
+	return zap_batch_complete( station, ntohl( f->payload.data_complete.batch_number ) );
+}
+
 
-int zap_process_data( zap_station_t *station, zap_frame_t *frame, struct timeval *tv)
+int zap_process_data( zap_station_t *station, zap_frame_t *frame, __int64 *rx_nsec)
 {
 	unsigned __int32		rx_batch;
 	unsigned __int32		rx_payload;
-	__int64					usecs = get_current_usecs(  );
+	__int64					nsecs, transit, ipdv;
 
-#ifndef WIN32
-    if (tv) {
-        usecs = tv->tv_usec;
-        usecs += tv->tv_sec * 1000000;
-    }
-#endif
+	// Unstamped frames ( TCP, or no kernel support ) are timed on arrival here. One the socket's
+	// clock missed stays ZAP_RX_UNSTAMPED, and is counted but not timed.
+	if ( rx_nsec && *rx_nsec ) {
+		nsecs = *rx_nsec;
+	} else {
+		nsecs = get_wall_nsecs(  );
+	}
 #if 0
 	fprintf( stdout, " Rx batch = %3d, pay = %3d\n", 
 		ntohl( frame->payload.data.batch_number ), 
@@ -1350,8 +2586,14 @@ int zap_process_data( zap_station_t *station, zap_frame_t *frame, struct timeval
 		return 1; 
 	}
 
-	// Something get mussed?
-	if ( station->batch_num < rx_batch ) {
+	// Payloads are numbered through the whole test, batch by batch, in 64 bits.
+	if ( zap_seq_track( station, zap_seq_batch( station, rx_batch ) * station->config.batch_size + rx_payload ) ) {
+		return 0;
+	}
+	station->sample.frames_arrived++;
+
+	// Something get mussed? Batch numbers compare as serial numbers, to ride over the wrap.
+	if ( ( __int32 )( rx_batch - station->batch_num ) > 0 ) {
 		if ( zap_batch_done( station ) ) {
 			erk;
 			return 1; 
@@ -1369,34 +2611,57 @@ int zap_process_data( zap_station_t *station, zap_frame_t *frame, struct timeval
 		// return 0;  XXX ?
 	}
 
-	if ( station->batch_num > rx_batch ) {
-		// Seriously out-of-order frame... Toss it
+	if ( ( __int32 )( station->batch_num - rx_batch ) > 0 ) {
+		// Seriously out-of-order frame... Toss it, counted in as it was by zap_seq_track.
 		return 0;
 	}
 	// We should be on the correct batch number now.
 
-	if ( !station->sample.first_frame_arrival_time ) {
-		station->sample.first_frame_arrival_time = usecs;
-		station->payload_num = rx_payload + 1;
-		return 0;
-	}
-	if ( !station->sample.last_frame_arrival_time ) {
-		station->sample.last_frame_arrival_time = usecs;
-		station->payload_num = rx_payload + 1;
-		return 0;
-	}
-	station->sample.total_time += ( usecs - station->sample.last_frame_arrival_time );
-	station->sample.last_frame_arrival_time = usecs;
-	station->sample.payload_bytes += ntohl( frame->header.length );
-	station->sample.frames_received++;
-
-	// Check for various error conditions.
-	if ( ( rx_payload < station->payload_num ) || ( station->batch_num > rx_batch ) ) {
-		station->sample.frames_out_of_order++;
+	if ( ( nsecs != ZAP_RX_UNSTAMPED ) && ( frame->payload.data.tx_nsec_high || frame->payload.data.tx_nsec_low ) ) {
+		transit = nsecs - zap_get_nsec( frame->payload.data.tx_nsec_high, frame->payload.data.tx_nsec_low );
+		// Kept relative to the sample's first, so the clocks' offset costs no precision.
+		if ( !zap_delay_count( &station->owd ) ) {
+			station->sample.owd_base = station->sample.owd_min = station->sample.owd_max = transit;
+		}
+		if ( transit < station->sample.owd_min ) {
+			station->sample.owd_min = transit;
+		}
+		if ( transit > station->sample.owd_max ) {
+			station->sample.owd_max = transit;
+		}
+		zap_delay_add( &station->owd, transit - station->sample.owd_base );
+		if ( station->transit_seen ) {
+			// RFC 3550 A.8: J += ( |D| - J ) / 16, with J kept times 16.
+			ipdv = transit - station->last_transit;
+			station->jitter += ( ( ipdv < 0 ) ? -ipdv : ipdv ) - ( ( station->jitter + 8 ) >> 4 );
+			if ( !zap_delay_count( &station->ipdv ) || ( ipdv < station->sample.ipdv_min ) ) {
+				station->sample.ipdv_min = ipdv;
+			}
+			if ( !zap_delay_count( &station->ipdv ) || ( ipdv > station->sample.ipdv_max ) ) {
+				station->sample.ipdv_max = ipdv;
+			}
+			station->sample.ipdv_sum += ipdv;
+			zap_delay_add( &station->ipdv, ipdv );
+		}
+		station->last_transit = transit;
+		station->transit_seen = 1;
 	}
 
-	if ( rx_payload > station->payload_num ) {
-		station->sample.frames_skipped += ( rx_payload - station->payload_num );
+	if ( nsecs != ZAP_RX_UNSTAMPED ) {
+		if ( !station->sample.first_frame_arrival_time ) {
+			station->sample.first_frame_arrival_time = nsecs;
+			station->payload_num = rx_payload + 1;
+			return 0;
+		}
+		if ( !station->sample.last_frame_arrival_time ) {
+			station->sample.last_frame_arrival_time = nsecs;
+			station->payload_num = rx_payload + 1;
+			return 0;
+		}
+		station->sample.total_time += ( nsecs - station->sample.last_frame_arrival_time );
+		station->sample.last_frame_arrival_time = nsecs;
+		station->sample.payload_bytes += ntohl( frame->header.length );
+		station->sample.frames_received++;
 	}
 
 	if ( rx_payload >= station->payload_num ) {
@@ -1415,7 +2680,7 @@ int zap_process_data( zap_station_t *station, zap_frame_t *frame, struct timeval
 
 	}
 	if ( station->config.batch_time &&
-		( ( unsigned __int32 )station->sample.total_time >= station->config.batch_time ) ) {
+		( ( station->sample.total_time / 1000 ) >= station->config.batch_time ) ) {
 		// Sample done!		
 		if ( zap_batch_report( station ) ) { 
 			erk; 
@@ -1426,156 +2691,283 @@ int zap_process_data( zap_station_t *station, zap_frame_t *frame, struct timeval
 	return 0;
 }
 
-int zap_rx_data( zap_server_t *server, SOCKET sock, int tcp, fd_set *fd, zap_station_t *station_cleaned)
+// Act on one frame received on sock ( the UDP rx socket, or a station's TCP socket ).
+// tv is the kernel receive timestamp for UDP frames, or NULL.
+int zap_rx_frame( zap_server_t *server, SOCKET sock, zap_frame_t *frame, unsigned __int32 remote_ip, __int64 *rx_nsec)
 {
-	zap_frame_t			*frame;
 	zap_station_t		*station;
+
+	if ( zap_find_station( ntohl( frame->header.zap_test_id ), server, &station, 0 ) ) {
+		return 1;
+	}
+	return zap_rx_station_frame( server, station, sock, frame, remote_ip, rx_nsec );
+}
+
+// zap_rx_frame(  ) for frame's station, already found.
+int zap_rx_station_frame( zap_server_t *server, zap_station_t *station, SOCKET sock, zap_frame_t *frame, unsigned __int32 remote_ip, __int64 *rx_nsec )
+{
 	__int64				usecs;
-	unsigned __int32	remote_ip;
-	unsigned __int32	read_frame = 1;
-	struct timeval      tv;
 
-	while ( read_frame ) {
-		// Read a frame...
-		if ( zap_read_frame( sock, tcp, &frame, &remote_ip, (tcp)?NULL:(&tv) ) ) {
-			return 1;
-		}
-		if ( zap_find_station( ntohl( frame->header.zap_test_id ), server, &station, 0 ) ) {
+	switch( station->state ) {
+		case zap_station_state_rx_config:
+		case zap_station_state_running_tx:
+		case zap_station_state_running_rx:
+			break;
+		case zap_station_state_complete:
+			erk;
+		case zap_station_state_init:
+			erk;
+		case zap_station_state_off:
+			erk;
+		default:
+			erk;
 			return 1;
-		}
-		station_cleaned = station;
-		
-		switch( station->state ) {
-			case zap_station_state_rx_config:
-			case zap_station_state_running_tx:
-			case zap_station_state_running_rx:
-				break;
-			case zap_station_state_complete:
-				erk;
-			case zap_station_state_init:
+	}
+
+	switch ( ntohl( frame->header.zap_frame_type ) ) {
+		case zap_type_null:
+			// If we are the transmitter, and if we don't know who to transmit to, remember this remote IP.
+			if ( ( station->config.tx_ip == 0 ) && ( station->config.tx ) ) {
+				station->config.tx_ip = remote_ip;
+				if ( zap_station_tx_addr( station ) ) {
+					erk;
+					return 1;
+				}
+			}
+			break;
+
+		case zap_type_data:
+			if ( station->state != zap_station_state_running_rx ) {
 				erk;
-			case zap_station_state_off:
+				return 1;
+			}
+			if ( zap_process_data( station, frame, rx_nsec ) ) {	
+				return 1; 
+			}
+			break;
+
+		case zap_type_data_complete:
+			if ( station->state != zap_station_state_running_rx ) {
 				erk;
-			default:
+				return 1;
+			}
+			// Receivers reading the data act on it once they have read what was sent ahead of it.
+			if ( zap_station_complete( server, station, sock, ntohl( frame->payload.data_complete.batch_number ) ) ) {
+				break;
+			}
+			if ( zap_process_data_complete(station, frame ) ) { 
 				erk;
+				return 1; 
+			}
+			break;
+
+		case zap_type_time_sync:
+			// Answer at once, so the turnaround the controller must discount is short.
+			if ( zap_send_time_sync( station->id, sock,
+				zap_get_nsec( frame->payload.time_sync.t1_high, frame->payload.time_sync.t1_low ), get_wall_nsecs(  ) ) ) {
 				return 1;
-		}
+			}
+			break;
 
-		switch ( ntohl( frame->header.zap_frame_type ) ) {
-			case zap_type_null:
-				// If we are the transmitter, and if we don't know who to transmit to, remember this remote IP.
-				if ( ( station->config.tx_ip == 0 ) && ( station->config.tx ) ) {
-					station->config.tx_ip = remote_ip;
-				}
-				break;
+		case zap_type_data_complete_response:
+			if ( station->state != zap_station_state_running_tx ) {
+				erk;
+				return 1;
+			}
+			station->last_completed_batch = ntohl( frame->payload.data_complete.batch_number );
+			if ( station->blocked ) {
+				// The asynchronous window may have opened.
+				zap_station_arm( server, station, 0 );
+			}
+			break;
 
-			case zap_type_data:
-				if ( station->state != zap_station_state_running_rx ) {
+		case zap_type_connect:
+			if ( !zap_station_tcp_room( station ) ) {
+				// Create socket.
+				if ( zap_socket( station->config.buf_required, 1, &( station->s_tcp[station->s_tcp_count] ) ) ) { 
 					erk;
-					return 1;
-				}
-				if ( zap_process_data( station, frame, (tcp)?(NULL):(&tv) ) ) {	
 					return 1; 
 				}
-				break;
-
-			case zap_type_data_complete:
-				if ( station->state != zap_station_state_running_rx ) {
-					erk;
-					return 1;
+				if( station->config.ip_tos ) {
+				    zap_set_tos( station->s_tcp[station->s_tcp_count], &station->config.ip_tos );
 				}
-				if ( zap_process_data_complete(station, frame ) ) { 
-					erk;
+
+				// Connect socket.
+				if ( zap_connect( frame->payload.connect.remote_ip, 1, station->s_tcp[station->s_tcp_count], ZAP_TYPICAL_TIMEOUT_USEC ) ) { 
 					return 1; 
 				}
-				break;
 
-			case zap_type_data_complete_response:
-				if ( station->state != zap_station_state_running_tx ) {
-					erk;
-					return 1;
+				// Send a "open data connection" message so the other side has a clue.
+			if ( zap_send_open_data_connection( station->id, station->s_tcp[station->s_tcp_count] ) ) { 
+					//erk; 
+					printf("\n[%s-%d]: Can not open data connection\n", __FUNCTION__, __LINE__);			
+					return 1; 
 				}
-				station->last_completed_batch = ntohl( frame->payload.data_complete.batch_number );
-				break;
-
-			case zap_type_connect:
-				if ( station->s_tcp_count < ZAP_MAX_RECEIVERS ) {
-					// Create socket.
-					if ( zap_socket( station->config.buf_required, 1, &( station->s_tcp[station->s_tcp_count] ) ) ) { 
+				// Send a null UDP frame to "open" the UDP connection.
+				if ( zap_send_null_frame( station->id, server->udp_socket_tx, frame->payload.connect.remote_ip ) ) { 
+					erk; 
+					return 1; 
+				}
+				// If we are the transmitter, and if we don't know who to transmit to, remember this remote IP.
+				if ( ( station->config.tx_ip == 0 ) && ( station->config.tx ) ) {
+					station->config.tx_ip = frame->payload.connect.remote_ip;
+					if ( zap_station_tx_addr( station ) ) {
 						erk;
-						return 1; 
-					}
-					if( station->config.ip_tos ) {
-					    zap_set_tos( station->s_tcp[station->s_tcp_count], &station->config.ip_tos );
-					}
-
-					// Connect socket.
-					if ( zap_connect( frame->payload.connect.remote_ip, 1, station->s_tcp[station->s_tcp_count], ZAP_TYPICAL_TIMEOUT_USEC ) ) { 
-						return 1; 
-					}
-
-					// Send a "open data connection" message so the other side has a clue.
-				if ( zap_send_open_data_connection( station->id, station->s_tcp[station->s_tcp_count] ) ) { 
-						//erk; 
-						printf("\n[%s-%d]: Can not open data connection\n", __FUNCTION__, __LINE__);			
-						return 1; 
-					}
-					// Send a null UDP frame to "open" the UDP connection.
-					if ( zap_send_null_frame( station->id, server->udp_socket_tx, frame->payload.connect.remote_ip ) ) { 
-						erk; 
-						return 1; 
-					}
-					// If we are the transmitter, and if we don't know who to transmit to, remember this remote IP.
-					if ( ( station->config.tx_ip == 0 ) && ( station->config.tx ) ) {
-						station->config.tx_ip = frame->payload.connect.remote_ip;
-					}
-
-					station->s_tcp_count++;
-					if ( zap_send_ready( station->id, sock ) ) {
-						erk; 
-						return 1; 
+						return 1;
 					}
-					return 0;
 				}
-				return 1;
-			case zap_type_test_start:
 
-				if ( ( station->config.tx ) &&
-					( station->state == zap_station_state_rx_config ) ) {
-					if ( zap_send_ready( station->id, sock ) ) {
-						erk; 
-						return 1; 
-					}
-					usecs = get_current_usecs(  );
-					station->state = zap_station_state_running_tx;
-					station->batch_start_usec = 0;
-					station->payload_usec = 0;
-					station->blocked = 0;
-					return 0;
-				} else {
-					erk;
+				station->s_tcp_count++;
+				if ( zap_poll_watch( server, station, station->s_tcp[station->s_tcp_count - 1] ) ) {
 					return 1;
 				}
-				break;
-			case zap_type_test_complete:
-				if ( zap_send_ready( station->id, sock) ) {
+				if ( zap_send_ready( station->id, sock ) ) {
 					erk; 
 					return 1; 
 				}
-				return 1;
+				return 0;
+			}
+			return 1;
+		case zap_type_test_start:
 
-			case zap_type_open_data_conn:
-				erk;
-			case zap_type_open_control_conn:
-				erk;
-			case zap_type_performance_result:
-				erk;
-			case zap_type_ready:
-				erk;
-			default:
+			if ( ( station->config.tx ) &&
+				( station->state == zap_station_state_rx_config ) ) {
+				if ( zap_send_ready( station->id, sock ) ) {
+					erk; 
+					return 1; 
+				}
+				usecs = get_current_usecs(  );
+				station->state = zap_station_state_running_tx;
+				station->batch_start_usec = 0;
+				station->payload_usec = 0;
+				station->payload_nsec = 0;
+				station->complete_nsec = 0;
+				station->tx_deficit = 0;
+				station->blocked = 0;
+				// Due straight away.
+				zap_station_arm( server, station, 0 );
+				return 0;
+			} else {
 				erk;
 				return 1;
-				break; /*code unreachable*/
+			}
+			break;
+		case zap_type_test_complete:
+			if ( zap_send_ready( station->id, sock) ) {
+				erk; 
+				return 1; 
+			}
+			return 1;
+
+		case zap_type_open_data_conn:
+			erk;
+		case zap_type_open_control_conn:
+			erk;
+		case zap_type_performance_result:
+			erk;
+		case zap_type_ready:
+			erk;
+		default:
+			erk;
+			return 1;
+			break; /*code unreachable*/
+	}
+
+	return 0;
+}
+
+
+#ifdef ZAP_HAVE_RECVMMSG
+// Drain a UDP rx socket up to ZAP_RX_BURST_MAX datagrams per recvmmsg call, each with its own
+// kernel receive timestamp, and act on every frame of a burst before reading the next. A bad
+// frame is skipped rather than left stranded behind the rest; returns non-zero if there was one.
+// space holds ZAP_RX_BURST_MAX frames. With wait, blocks until there is at least one datagram.
+int zap_rx_burst( zap_server_t *server, SOCKET sock, unsigned char *space, int wait )
+{
+	struct mmsghdr			msgs[ZAP_RX_BURST_MAX];
+	struct iovec			iov[ZAP_RX_BURST_MAX];
+	struct sockaddr_in		addr[ZAP_RX_BURST_MAX];
+	unsigned __int64		ctrl[ZAP_RX_BURST_MAX][ZAP_RX_CTRL_LEN / sizeof( unsigned __int64 )];
+	zap_frame_t				*frame;
+	__int64					nsec, *pnsec;
+	unsigned __int32		*drops;
+	int						i, n, rv = 0;
+
+	// Whose SO_RXQ_OVFL count sock's are: its receiver's, or the server's.
+	drops = &server->rx_drops.count;
+	for ( i = 0; i < ( int )server->receiver_count; i++ ) {
+		if ( server->receivers[i].rx_socket == sock ) {
+			drops = &server->receivers[i].rx_drops.count;
+		}
+	}
+
+	do {
+		for ( i = 0; i < ZAP_RX_BURST_MAX; i++ ) {
+			iov[i].iov_base = space + i * MAX_PACKET_LEN;
+			iov[i].iov_len = MAX_PACKET_LEN;
+			msgs[i].msg_hdr.msg_name = &addr[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof( addr[i] );
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof( ctrl[i] );
+			msgs[i].msg_hdr.msg_flags = 0;
+		}
+
+		// Otherwise select(  ) said there is at least one; take what is queued, without waiting for more.
+		n = recvmmsg( sock, msgs, ZAP_RX_BURST_MAX, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL );
+		if ( n < 0 ) {
+			if ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) || ( errno == EINTR ) ) {
+				break;
+			}
+			WARN_errno( 1, "zap_rx_burst - recvmmsg" );
+			return 1;
+		}
+		wait = 0;
+
+		for ( i = 0; i < n; i++ ) {
+			frame = ( zap_frame_t * )( space + i * MAX_PACKET_LEN );
+			if ( zap_check_datagram( frame, ( int )msgs[i].msg_len ) || zap_check_version( frame ) ) {
+				rv = 1;
+				continue;
+			}
+			pnsec = zap_rx_timestamp( &msgs[i].msg_hdr, &nsec, drops ) ? NULL : &nsec;
+			// Receivers, and the workers sending for tx stations, run alongside the main loop.
+			if ( zap_rx_frame_locked( server, sock, frame, addr[i].sin_addr.s_addr, pnsec ) ) {
+				rv = 1;
+			}
+		}
+	} while ( n == ZAP_RX_BURST_MAX );
+
+	return rv;
+}
+#endif // ZAP_HAVE_RECVMMSG
+
+int zap_rx_data( zap_server_t *server, SOCKET sock, int tcp, fd_set *fd, zap_station_t *station_cleaned)
+{
+	zap_frame_t			*frame;
+	unsigned __int32	remote_ip;
+	unsigned __int32	read_frame = 1;
+	__int64				nsec;
+
+#ifdef ZAP_HAVE_RECVMMSG
+	if ( !tcp ) {
+		static unsigned char	frame_space[ZAP_RX_BURST_MAX * MAX_PACKET_LEN];
+
+		return zap_rx_burst( server, sock, frame_space, 0 );
+	}
+#endif // ZAP_HAVE_RECVMMSG
+
+	while ( read_frame ) {
+		// Read a frame...
+		nsec = 0;
+		if ( zap_read_frame( sock, tcp, &frame, &remote_ip, (tcp)?NULL:(&nsec) ) ) {
+			return 1;
+		}
+		// The main loop already holds a TCP frame's station; a UDP frame's is locked for it.
+		if ( tcp ? zap_rx_frame( server, sock, frame, remote_ip, NULL ) :
+			zap_rx_frame_locked( server, sock, frame, remote_ip, &nsec ) ) {
+			return 1;
 		}
 
 		read_frame = 0;
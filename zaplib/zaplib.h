@@ -42,9 +42,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #else
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -52,11 +56,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <time.h>
 #include <netinet/tcp.h>
 #include <sys/ioctl.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <pthread.h>
 
 
 #define		N_UPDATE( i, sock ) if ( sock >= i ) i = sock + 1;
@@ -69,6 +75,51 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define		INVALID_SOCKET		-1 
 #define		SOCKET_ERROR		-1
 
+#if defined(__linux__)
+#include <netinet/udp.h>
+#define		ZAP_HAVE_SENDMMSG					// sendmmsg(2) available for batched UDP transmit.
+#define		ZAP_HAVE_RECVMMSG					// recvmmsg(2) available for batched UDP receive.
+#define		ZAP_HAVE_UDP_GSO					// UDP_SEGMENT generic segmentation offload.
+#define		ZAP_HAVE_URING						// io_uring data-plane engine.
+#define		ZAP_HAVE_EPOLL						// epoll event loop.
+#define		ZAP_HAVE_REUSEPORT					// SO_REUSEPORT receive fan-out, steered by classic BPF.
+#define		ZAP_HAVE_TXTIME						// SO_TXTIME and SO_MAX_PACING_RATE kernel pacing.
+#define		ZAP_HAVE_TIMESTAMPING				// SO_TIMESTAMPING nanosecond and hardware receive stamps.
+#include <net/if.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#ifndef UDP_SEGMENT
+#define		UDP_SEGMENT			103
+#endif
+#ifndef SOL_UDP
+#define		SOL_UDP				17
+#endif
+#ifndef SO_MAX_PACING_RATE
+#define		SO_MAX_PACING_RATE	47
+#endif
+#ifndef SO_TXTIME
+#define		SO_TXTIME			61
+#define		SCM_TXTIME			SO_TXTIME
+#endif
+#ifndef SO_REUSEPORT
+#define		SO_REUSEPORT		15
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define		SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+#ifndef SO_TIMESTAMPING
+#define		SO_TIMESTAMPING		37
+#define		SCM_TIMESTAMPING	SO_TIMESTAMPING
+#endif
+#ifndef SO_RXQ_OVFL
+#define		SO_RXQ_OVFL			40
+#endif
+#endif
+
+// Room for the largest receive timestamp: SCM_TIMESTAMPING's software, legacy and hardware stamps,
+// and for SO_RXQ_OVFL's count of datagrams the socket has dropped.
+#define		ZAP_RX_CTRL_LEN		( CMSG_SPACE( 3 * sizeof( struct timespec ) ) + CMSG_SPACE( sizeof( unsigned __int32 ) ) )
+
 #endif // !WIN32
 
 #define SLEEP_TIME 500
@@ -78,13 +129,24 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define errOut	printf( "%s( %d ) : ", __FILE__, __LINE__ ); printf
 
 #define ZAP_MAJOR_VERSION					1
-#define ZAP_MINOR_VERSION					83
+#define ZAP_MINOR_VERSION					87
 
 #define MAX_PACKET_LEN						65536
 #define ZAP_SERVICE_PORT					18301
 
-#define ZAP_MAX_RECEIVERS					20
-#define ZAP_MAX_STATIONS					20		// Each server can operate as 20 simultaneous stations, max.
+#define ZAP_TX_BURST_MAX					64		// Max datagrams handed to the kernel in one transmit call.
+#define ZAP_RX_BURST_MAX					32		// Max datagrams taken from the kernel in one receive call.
+#define ZAP_DATA_HEADER_LEN					( sizeof( zap_header_t ) + sizeof( zap_data_frame_t ) )	// Smallest data frame.
+#define ZAP_GSO_MAX_BYTES					65507	// Max UDP payload of one segmentation offload super-packet.
+#define ZAP_PACER_SPIN_NSEC					50000	// Default window zapd busy-waits, rather than sleeps, before a departure.
+#define ZAP_TX_QUANTUM						65536	// Bytes a transmitting station may send per zapd scheduling pass.
+#define ZAP_KPACE_HORIZON_NSEC				2000000	// How far ahead of departure payloads are queued under kernel pacing.
+#define ZAP_MAX_WORKERS						64		// Most data-plane worker threads zapd will run.
+
+#define ZAP_SEQ_WINDOW						1024		// Payloads, a multiple of 64, over which late and repeated ones are told apart.
+#define ZAP_MAX_STATIONS					16384	// Each server can operate as 16384 simultaneous stations, max.
+#define ZAP_STATION_BLOCK					64		// Stations are allocated 64 at a time, as tests need them.
+#define ZAP_STATION_HASH_BITS				10		// Stations are found by test ID in 2^10 hash buckets.
 #define ZAPD_LOGFILE_NAME					"ZapdDbg.log"
 #define LOG_MESSAGE_OUTPUT_BUFFER_SIZE		256
 
@@ -113,12 +175,58 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 extern int pmtudisc;  // Path MTU discovery: System default (-1), DONT (0), WANT (1) or DO (2)
 #endif // NO_MTUDISC
 
+// How zapd hands UDP data payloads to the kernel.
+typedef enum {
+	zap_tx_mode_burst,					// One datagram per message, batched with sendmmsg where available.
+	zap_tx_mode_gso,					// Many datagrams per message, split by UDP segmentation offload.
+	zap_tx_mode_uring,					// Queued to an io_uring, which also carries UDP receives.
+} zap_tx_mode_enum;
+extern zap_tx_mode_enum zap_tx_mode;
+
+typedef enum {
+	zap_tx_pacing_user,					// zapd wakes for each departure.
+	zap_tx_pacing_txtime,				// Each datagram carries its departure time ( SO_TXTIME ) for the fq/etf qdisc.
+	zap_tx_pacing_rate,					// The socket carries the station's rate ( SO_MAX_PACING_RATE ) for the fq qdisc.
+} zap_tx_pacing_enum;
+extern zap_tx_pacing_enum zap_tx_pacing;
+
+// Receive stamps come from one clock: the NIC's, once zap_rx_timestamp_hw(  ) has it stamping,
+// else the kernel's. A frame the chosen clock missed is stamped ZAP_RX_UNSTAMPED, and is counted
+// but not timed, rather than timed on the other clock.
+extern int zap_rx_stamp_hw;
+#define ZAP_RX_UNSTAMPED		( -1 )
+
 typedef struct {
-	unsigned __int32 *data;
-	int gather_count, gather_max;
+	unsigned __int64 *counts;		// Values gathered, per log-linear bucket. See zap_history_init(  ).
+	unsigned __int32 bits, bucket_count;
+	unsigned __int32 lowest, highest;	// Buckets of the least and greatest values gathered.
+	unsigned __int64 gather_count;
 	int order;						// If 0, then big #s are good, else big #s are bad.
 } zap_history_t;
 
+// Signed nsec delays, as a pair of histories: the negative ones by their size, and the rest.
+#define ZAP_DELAY_BITS			8			// Kept to within 2^-7, 0.8%.
+typedef struct {
+	zap_history_t			below, above;
+} zap_delay_t;
+
+#define ZAP_MAX_WINDOWS		4			// Smoothing horizons the controller reports at once ( -w ).
+
+typedef enum {
+	zap_window_count,					// Mean of the last span reports, or of them all if span is 0.
+	zap_window_ewma,					// Exponentially weighted, reports age out over about span of them.
+	zap_window_time,					// Mean of the reports in the last span seconds.
+} zap_window_enum;
+
+typedef struct {
+	zap_window_enum		type;
+	double				span;
+	double				*values;		// Ring of the reports in the window, from first; count and time only.
+	__int64				*usecs;			// When each arrived; time only.
+	unsigned __int32	first, count, max;
+	double				sum, carry;		// Compensated sum of the ring, or the EWMA itself.
+} zap_window_t;
+
 
 //
 // Rx/Tx payload state. An array of this state of approximately batch_size will be needed to successfully run.
@@ -135,7 +243,7 @@ typedef struct {
 // Rx/Tx batch state. An array of this state will be used for tracking stats/etc associated with batches.
 //
 typedef struct {
-	unsigned __int64		total_time;
+	unsigned __int64		total_time;							// Times in nanoseconds, from the kernel's receive stamps.
 	unsigned __int64		first_frame_arrival_time;
 	unsigned __int64		second_frame_arrival_time;
 	unsigned __int64		last_frame_arrival_time;
@@ -143,11 +251,35 @@ typedef struct {
 	unsigned __int32		frames_out_of_order;
 	unsigned __int32		frames_repeated;
 	unsigned __int32		frames_skipped;
-	unsigned __int32		frames_received;
+	unsigned __int32		frames_received;					// Timed payloads, for the rate: not each batch's first two.
+	unsigned __int32		frames_arrived;						// Every payload taken in, late and untimed ones too.
 	unsigned __int32		success;
+	__int64					owd_base;							// One-way delays, nsecs: the first, which the rest are kept
+	__int64					owd_min;							// relative to, and the least and greatest.
+	__int64					owd_max;
+	__int64					ipdv_min;							// Delay variation between consecutive payloads, nsecs.
+	__int64					ipdv_max;
+	__int64					ipdv_sum;
 } zap_sample_track_t;
 
 
+// The host's kernel counters of datagrams it could not deliver, from /proc/net/snmp.
+typedef struct {
+	unsigned __int32		udp_rcvbuf_errors;					// Udp RcvbufErrors: socket receive queues full.
+	unsigned __int32		udp_in_errors;						// Udp InErrors: all undeliverable, those included.
+	unsigned __int32		ip_reasm_fails;						// Ip ReasmFails: fragments never reassembled.
+} zap_snmp_t;
+
+#define ZAP_SNMP_PERIOD_NSEC	100000000		// How often zapd's main loop reads them, while reports go out.
+
+// A receive socket's SO_RXQ_OVFL drops, and how many of them its stations' reports have placed.
+typedef struct {
+	unsigned __int32		count;								// Datagrams the socket has dropped.
+	unsigned __int32		given;								// Charged to a report, or written off.
+	unsigned __int32		held;								// Unplaced at the last report; written off at the next.
+} zap_drops_t;
+
+
 //
 // Station configuration.
 //
@@ -184,6 +316,8 @@ typedef struct
 
 	unsigned __int32		buf_required;						// Buffer space required to hold all outstanding frames.
         unsigned __int32		ip_tos;						// IP ToS
+	unsigned __int32		payload_transmit_delay_nsec;		// nsecs added to payload_transmit_delay, 0-999. Lets the
+																// interval fall between, or below, whole microseconds.
 } zap_station_config_t;
 
 
@@ -197,19 +331,48 @@ typedef enum {
 } zap_station_state_enum;
 
 
+// Timer wheel, zaptimer.c
+#define ZAP_WHEEL_TICK_SHIFT				10		// Level 0 slots are 2^10 nsecs wide.
+#define ZAP_WHEEL_BITS						6
+#define ZAP_WHEEL_SLOTS						( 1 << ZAP_WHEEL_BITS )
+#define ZAP_WHEEL_LEVELS					4		// Reaches 2^34 nsecs ( ~17 s ) ahead; later deadlines are refiled.
+
+typedef struct zap_wheel_s zap_wheel_t;
+typedef struct zap_timer_s {
+	struct zap_timer_s		*next, *prev;
+	__int64					expires;				// get_current_nsecs(  ) deadline.
+	zap_wheel_t				*wheel;					// Wheel this timer is armed on, NULL when not armed.
+	unsigned __int32		level, slot;
+	void					*data;					// Owner.
+} zap_timer_t;
+
+struct zap_wheel_s {
+	zap_timer_t				slots[ZAP_WHEEL_LEVELS][ZAP_WHEEL_SLOTS];	// List heads.
+	unsigned __int64		map[ZAP_WHEEL_LEVELS];						// Occupied slots.
+	__int64					tick;										// First tick not yet fully expired.
+	unsigned __int32		count;										// Timers armed.
+};
+
+
 // All the state associated with a station.
-typedef struct
+typedef struct zap_station_s
 {
 	unsigned __int32		id;							// Unique test ID.
+	struct zap_station_s	*hash_next;					// Next station in id's bucket of server->station_hash.
+	struct zap_station_s	*free_next;					// Next in server->station_free, while off.
+	struct zap_server_s		*server;					// The server whose station_hash holds it, NULL while off.
+	unsigned __int32		index;						// Its slot, for ZAP_STATION(  ).
 	zap_station_state_enum	state;						// State of this station. ( active, testing, waiting for config, etc )
 
 	zap_station_config_t	config;
 	unsigned __int32		blocked;					// ( tx ) If non-zero, this station is blocked waiting for someone else to do something.
-	unsigned __int32		next_event;					// ( tx ) How long before the next tx event for this station.
+	zap_timer_t				tx_timer;					// ( tx ) When this station next has something to send.
+	struct zap_worker_s		*worker;					// ( tx ) Data-plane worker that owns this station, NULL on zapd's main loop.
 
 	SOCKET					s_control;					// TCP Control socket.
-	SOCKET					s_tcp[ZAP_MAX_RECEIVERS];	// TCP data socket, in-band.
-	unsigned __int32		s_tcp_count;
+	SOCKET					*s_tcp;						// TCP data sockets, in-band. s_tcp_max slots, the first s_tcp_count connected.
+	unsigned __int32		s_tcp_count, s_tcp_max;
+	SOCKET					s_udp_tx;					// ( tx ) UDP data socket of its own, connected to config.tx_ip.
 
 	unsigned __int32		batch_num;					// The current batch we are working on.
 	unsigned __int32		sample_num;					// The current sample we are working on.
@@ -217,23 +380,158 @@ typedef struct
 	__int64					batch_start_usec;			// The time the current batch started.
 	unsigned __int32		payload_num;				// The next payload to be received, OR the next payload to transmit.
 	__int64					payload_usec;				// The timestamp of said payload.
+	__int64					payload_nsec;				// ( tx ) get_current_nsecs(  ) departure time of the last payload sent.
+	unsigned __int32		tx_deficit;					// ( tx ) Transmit credit, in bytes, carried between scheduling passes.
+	__int64					complete_nsec;				// ( tx ) Kernel pacing: batch completion waits until its last payload has left.
 
 	zap_payload_track_t		*payload_xx_deprecated;		// Array of payload tracking state.
 	zap_sample_track_t		sample;						// The sample we are currently tracking.
+	zap_delay_t				owd;						// ( rx ) One-way delays, nsecs, of the sample's payloads.
+	zap_delay_t				ipdv;						// ( rx ) Their delay variations, payload to payload.
+	__int64					last_transit;				// ( rx ) One-way delay of the previous payload, which may be 0 or
+	int						transit_seen;				// less, and whether there has been one.
+	__int64					jitter;						// ( rx ) RFC 3550 jitter, nsecs, times 16.
+	unsigned __int64		seq_next;					// ( rx ) One past the highest payload sequence number seen.
+	unsigned __int64		seq_window[ZAP_SEQ_WINDOW / 64];	// ( rx ) Which of the ZAP_SEQ_WINDOW below seq_next have arrived.
+	unsigned __int32		seq_owed;					// ( rx ) Late arrivals not yet taken back off a sample's losses.
+	SOCKET					rx_socket;					// ( rx ) UDP socket its data last came in on, INVALID_SOCKET before any.
+	struct zap_worker_s		*rx_complete;				// ( rx ) Receiver its data_complete was handed to, NULL if none waits.
+	unsigned __int32		rx_complete_batch;			// ( rx ) That data_complete's batch, and the receiver's
+	unsigned __int32		rx_complete_seq;			// rx_completes once it was handed over.
+	zap_snmp_t				snmp_base;					// ( rx ) The host's counters, as of the last report.
+
+	unsigned char			*tx_frame;					// ( tx ) Ready-to-send data frame template, tx_frame_length bytes.
+	unsigned __int32		tx_frame_length;			// ( tx ) Length of each data frame sent.
+	unsigned char			*tx_gso;					// ( tx ) tx_gso_count templates laid out for segmentation offload.
+	unsigned __int32		tx_gso_count;
+	int						tx_gso_off;					// ( tx ) Segmentation offload refused on its socket; burst instead.
+	struct sockaddr_in		tx_addr;					// ( tx ) Cached UDP destination, from config.tx_ip.
+	unsigned __int32		tx_refused;					// ( tx ) UDP sends failed by the peer's port unreachables, and retried.
 
 } zap_station_t;
 
 
+typedef struct zap_uring_s zap_uring_t;
+
+// Data-plane worker threads, zapworker.c
+#ifdef WIN32
+typedef HANDLE						zap_thread_t;
+typedef CRITICAL_SECTION			zap_mutex_t;
+typedef CONDITION_VARIABLE			zap_cond_t;
+typedef SRWLOCK						zap_rwlock_t;
+#else
+typedef pthread_t					zap_thread_t;
+typedef pthread_mutex_t				zap_mutex_t;
+typedef pthread_cond_t				zap_cond_t;
+typedef pthread_rwlock_t			zap_rwlock_t;
+#endif
+#ifdef WIN32
+#define ZAP_ATOMIC_INC( x )					InterlockedIncrement( ( LONG volatile * )&( x ) )
+#define ZAP_ATOMIC_DEC( x )					InterlockedDecrement( ( LONG volatile * )&( x ) )
+#else
+#define ZAP_ATOMIC_INC( x )					__sync_fetch_and_add( &( x ), 1 )
+#define ZAP_ATOMIC_DEC( x )					__sync_fetch_and_sub( &( x ), 1 )
+#endif
+#ifdef WIN32
+#define ZAP_LOAD_ACQUIRE( x )				( x )							// Volatile accesses acquire and release under MSVC.
+#define ZAP_STORE_RELEASE( x, v )			( ( x ) = ( v ) )
+#else
+#define ZAP_LOAD_ACQUIRE( x )				__atomic_load_n( &( x ), __ATOMIC_ACQUIRE )
+#define ZAP_STORE_RELEASE( x, v )			__atomic_store_n( &( x ), ( v ), __ATOMIC_RELEASE )
+#endif
+
+// Result writer, zapwriter.c
+#define ZAP_WRITER_SLOTS			256				// Records queued for the writer thread, a power of 2.
+#define ZAP_WRITER_FILES			4				// Files written at once.
+#define ZAP_WRITER_FLUSH_BYTES		65536			// A file is flushed once this much is written to it,
+#define ZAP_WRITER_FLUSH_USEC		1000000			// or this long after the first of it.
+#define ZAP_WRITER_NAP_MSEC			10				// The writer's sleep while its queue is empty.
+
+// Text for one file, formatted on the controller's thread and written on the writer's.
+typedef struct {
+	char					*text;
+	unsigned __int32		length;
+	unsigned __int32		header;					// Leading bytes of text only written to an empty file.
+	unsigned __int32		max;					// Bytes allocated to text.
+	int						file;					// Index into the writer's files.
+} zap_record_t;
+
+typedef struct {
+	char					*name;
+	FILE					*fileio;				// Open from the first record to the writer's stop.
+	unsigned __int32		pending;				// Bytes written and not yet flushed.
+	__int64					flush_usec;				// When they must be, by get_current_usecs(  ).
+	int						failed;
+	int						raw;					// Binary, unbuffered: each record goes down in one write.
+} zap_writer_file_t;
+
+// One producer, the controller's thread, hands records to the writer thread through a ring
+// of slots, without locks. head and tail run free; the ring is full when they are
+// ZAP_WRITER_SLOTS apart.
+typedef struct {
+	zap_record_t			slots[ZAP_WRITER_SLOTS];
+	volatile unsigned __int32	head;					// Next slot filled, by the producer.
+	volatile unsigned __int32	tail;					// Next slot written out, by the writer.
+	volatile int			stop;
+	volatile int			failed;					// A file could not be opened or written.
+	int						running;
+	zap_thread_t			thread;
+	zap_writer_file_t		files[ZAP_WRITER_FILES];
+	int						file_count;
+	zap_record_t			staged;					// Record the producer is formatting.
+} zap_writer_t;
+
+// A worker owns transmitting stations and runs them off its own wheel. Its lock guards the
+// wheel and every station it owns, and is held except while the worker sleeps or spins.
+// A receiver is the same structure, owning receiving stations and reading one socket.
+typedef struct zap_worker_s {
+	zap_mutex_t				lock;							// Recursive.
+	zap_cond_t				wake;							// Signalled when a deadline is armed here.
+	zap_wheel_t				wheel;							// Owned stations' next transmit deadlines.
+	zap_thread_t			thread;
+	struct zap_server_s		*server;
+	void					( *run )( struct zap_worker_s *worker );
+	unsigned __int32		index;
+	volatile unsigned __int32	load;						// Sum of owned stations' rates, kbps. Read unlocked as a hint.
+	volatile unsigned __int32	stations;					// Stations owned. Read unlocked as a hint.
+	volatile unsigned __int32	waiters;					// Threads blocked in zap_station_lock on this worker.
+	SOCKET					rx_socket;						// ( receiver ) Its socket of the SO_REUSEPORT group.
+	zap_drops_t				rx_drops;						// ( receiver ) Datagrams rx_socket has dropped, per SO_RXQ_OVFL.
+	int						rx_wake[2];						// ( receiver ) Pipe the main loop wakes it through.
+	volatile unsigned __int32	rx_completes;				// ( receiver ) data_completes handed to it so far,
+	unsigned __int32		rx_completed;					// and how many of those it has acted on.
+} zap_worker_t;
+
 // All the state local to a server.
-typedef struct 
+typedef struct zap_server_s
 {
-	zap_station_t			stations[ZAP_MAX_STATIONS];		// Station state.
+	zap_station_t			*station_blocks[ZAP_MAX_STATIONS / ZAP_STATION_BLOCK];	// Station state, ZAP_STATION_BLOCK to a block.
+	volatile unsigned __int32	station_count;				// Slots in use or freed. Blocks stay put, so threads may walk them unlocked,
+																// having read this with ZAP_LOAD_ACQUIRE(  ).
+	zap_station_t			*station_free;					// Slots freed by zap_clean_station(  ), reused first.
+	zap_station_t			*station_hash[1 << ZAP_STATION_HASH_BITS];	// Active stations, by test ID.
 
 	SOCKET					tcp_socket;						// TCP socket for accepting connections.
 	SOCKET					udp_socket_rx;					// UDP socket for receiving all UDP data.
-	SOCKET					udp_socket_tx;					// UDP socket for transmitting all UDP data.
+	zap_drops_t				rx_drops;						// Datagrams udp_socket_rx has dropped, per SO_RXQ_OVFL, without receivers.
+	zap_snmp_t				snmp;							// The host's counters, read by the main loop for any thread's reports.
+	__int64					snmp_nsec;						// When they were read.
+	volatile unsigned __int32	snmp_wanted;				// Set by each report, cleared as the counters are read.
+	SOCKET					udp_socket_tx;					// UDP socket for null frames. Data goes out on each station's own.
+	zap_uring_t				*uring;							// io_uring engine, if zap_tx_mode_uring is running.
+	SOCKET					poll_fd;						// epoll set, or INVALID_SOCKET while zapd waits in select.
+	zap_wheel_t				tx_wheel;						// Stations' next transmit deadlines, without workers.
+	zap_worker_t			*workers;						// Data-plane workers, if any. Stations go to one as they start.
+	unsigned __int32		worker_count;
+	zap_worker_t			*receivers;						// UDP receive threads, one per socket of udp_socket_rx's
+	unsigned __int32		receiver_count;					// SO_REUSEPORT group, if any. Station tid % count owns.
+	zap_mutex_t				lock;							// With receivers, held by the main loop except while it waits.
+	zap_rwlock_t			hash_lock;						// With receivers, guards station_hash's chains. Held only to walk them.
 } zap_server_t;
 
+// Station slot i of server, i below its station_count.
+#define ZAP_STATION( server, i )	( &( server )->station_blocks[( i ) / ZAP_STATION_BLOCK][( i ) % ZAP_STATION_BLOCK] )
+
 
 #ifndef SHUT_RD
 #define SHUT_RD   0
@@ -241,6 +539,21 @@ typedef struct
 #define SHUT_RDWR 2
 #endif // SHUT_RD
 
+// A station's clock against the controller's, from NTP-style exchanges on its control
+// connection. Each exchange gives an offset, good to within half its round trip; the filter
+// trusts the least delayed of the last few, and the drift between the best of the first
+// exchanges and the best of the latest carries the estimate forward.
+#define ZAP_CLOCK_SAMPLES					8
+typedef struct {
+	__int64					offset[ZAP_CLOCK_SAMPLES];		// Station's clock less ours, nsecs.
+	__int64					delay[ZAP_CLOCK_SAMPLES];		// Round trip, less the station's turnaround.
+	__int64					at[ZAP_CLOCK_SAMPLES];			// Our clock, mid-exchange.
+	unsigned __int32		count;							// Exchanges so far.
+	__int64					base_offset, base_at;			// Best of the first ZAP_CLOCK_SAMPLES, the drift reference.
+	__int64					last_offset, last_at;			// Best of the latest ZAP_CLOCK_SAMPLES.
+	double					drift;							// Offset change per nsec.
+} zap_clock_t;
+
 // 
 // The test configuration and state.. ( Controller state )
 //
@@ -251,9 +564,10 @@ typedef struct {
 	SOCKET					txs_socket_ctl;							// Socket for communicating with tx.
 	zap_station_config_t	station_config;							// Station configuration.
 	unsigned __int32		rxs_count;								// Number of receive stations.
-	unsigned __int32		rxs_ip_address[ZAP_MAX_RECEIVERS];		// Receive station IP addresses, data.
-	unsigned __int32		rxs_ip_address_ctl[ZAP_MAX_RECEIVERS];	// Receive station IP addresses, control.
-	SOCKET					rxs_socket_ctl[ZAP_MAX_RECEIVERS];		// Sockets for communicating with rx.
+	unsigned __int32		rxs_max;								// Room in the rxs_ arrays, grown by zap_config_add_rx(  ).
+	unsigned __int32		*rxs_ip_address;						// Receive station IP addresses, data.
+	unsigned __int32		*rxs_ip_address_ctl;					// Receive station IP addresses, control.
+	SOCKET					*rxs_socket_ctl;						// Sockets for communicating with rx.
 	unsigned __int32		open_reverse;							// Indicates data connections should be opened from rx->tx.
 	unsigned __int32		multi_ip_address;						// IP Address of multicast
 	unsigned __int32		ip_tos;									// ToS to use
@@ -268,7 +582,24 @@ typedef struct {
 	char					*tag;									// Tag String
 	char					*sub;									// Subtag String
 	char					*note;									// Note String
-	unsigned __int32		average;
+	zap_window_t			windows[ZAP_MAX_WINDOWS];				// Throughput averages reported; the first is avg.
+	unsigned __int32		window_count;
+	double					stats_error;							// Relative error throughput percentiles are kept to.
+	char					*sketchfile;							// Throughput histories of successive tests, merged.
+	char					*archivefile;							// Every sample of successive tests, for zapq.
+	unsigned __int32		*archive_rows;							// Samples not yet archived, ZAP_ARCHIVE_COLUMNS words each,
+	unsigned __int32		archive_count;							// room for ZAP_ARCHIVE_BLOCK_SAMPLES.
+	__int64					archive_block_usec;						// When the first of them came in.
+	__int64					archive_usec;							// When the test started, by get_current_usecs(  ).
+	__int64					archive_wall;							// The same, in usecs since 1970.
+	zap_clock_t				txs_clock;								// Transmit station's clock offset.
+	zap_clock_t				*rxs_clock;								// Receive stations'.
+	zap_history_t			*rxs_history;							// Receive stations' throughput, where there are several.
+	__int64					sync_usec;								// When the clocks are next sampled.
+	unsigned __int32		jitter;									// Latest reported jitter, nsecs.
+	unsigned __int32		ipdv_count;								// Delay variation over the test, nsecs.
+	__int64					ipdv_min, ipdv_max, ipdv_sum;
+	__int64					ipdv_p99;								// Worst of the samples' 99th percentiles.
 } zap_config_t;
 
 
@@ -284,6 +615,7 @@ typedef enum {
 	zap_type_test_start,							// 8 Frame sent to start the test, once all is configured.
 	zap_type_performance_result,					// 9 Frame sent from station to controller reporting performance.
 	zap_type_null,									// 10 Null frame.
+	zap_type_time_sync,								// 11 Clock offset exchange, controller to station and back.
 } zap_frame_enum;
 typedef struct {
 	unsigned __int32		payloads_received;				// Number of payloads received during the interval.
@@ -295,13 +627,72 @@ typedef struct {
 	unsigned __int32		first_payload_timestamp;		// Microsecond timestamp of the first payload
 	unsigned __int32		last_payload_timestamp;			// Microsecond timestamp of the last payload
 	unsigned __int32		bits_per_second;				// Calculated bits per second during the interval. ( as accurate as receiver can see )
+	unsigned __int32		bits_per_second_high;			// Upper 32 bits of bits_per_second, for rates past 4 Gbps.
+	unsigned __int32		owd_count;						// Payloads with a one-way delay measured during the interval.
+	unsigned __int32		owd_min_high;					// Least one-way delay, nsecs, signed. Receiver's clock less the
+	unsigned __int32		owd_min_low;					// transmitter's, so the controller must take out their offset.
+	unsigned __int32		owd_p50;						// One-way delay percentiles, nsecs above owd_min.
+	unsigned __int32		owd_p90;
+	unsigned __int32		owd_p99;
+	unsigned __int32		owd_p999;
+	unsigned __int32		owd_max;
+	unsigned __int32		jitter;							// RFC 3550 interarrival jitter, nsecs, as of the last payload.
+	unsigned __int32		ipdv_count;						// Consecutive payload pairs with a delay variation measured.
+	unsigned __int32		ipdv_min;						// Delay variation between consecutive payloads, nsecs, signed.
+	unsigned __int32		ipdv_mean;
+	unsigned __int32		ipdv_max;
+	unsigned __int32		ipdv_p99;
+	unsigned __int32		payloads_dropped_host;			// Of payloads_dropped, those the receiving socket's queue overflowed on. The
+															// rest were lost in the network.
+	unsigned __int32		udp_rcvbuf_errors;				// The receiving host's kernel counters over the interval, host wide. See zap_snmp_t.
+	unsigned __int32		udp_in_errors;
+	unsigned __int32		ip_reasm_fails;
 } zap_performance_frame_t;
 
+// Per-sample results archive ( zap -A ), read by zapq. Append only: each test adds a block as
+// every ZAP_ARCHIVE_BLOCK_SAMPLES samples come in, or ZAP_ARCHIVE_BLOCK_USEC after the first
+// of them, and one for the rest when it ends. A block is this header, alike in every block of
+// the test, and then column_count columns of sample_count words each. The first columns
+// are the words of zap_performance_frame_t in the order declared, in host order; two more
+// follow. Blocks are found by walking the headers, which index them by test id, tags and
+// time. Words only, so 32 and 64 bit builds lay blocks out alike.
+#define ZAP_ARCHIVE_MAGIC			0x5a415031							// "ZAP1"
+#define ZAP_ARCHIVE_VERSION			1
+#define ZAP_ARCHIVE_COLUMN( field )	( ( unsigned __int32 )( offsetof( zap_performance_frame_t, field ) / 4 ) )
+#define ZAP_ARCHIVE_COLUMN_RX		( ( unsigned __int32 )( sizeof( zap_performance_frame_t ) / 4 ) )	// Receiver's data IP address, network order.
+#define ZAP_ARCHIVE_COLUMN_MSEC		( ZAP_ARCHIVE_COLUMN_RX + 1 )		// When the controller had the sample, msecs into the test.
+#define ZAP_ARCHIVE_COLUMNS			( ZAP_ARCHIVE_COLUMN_RX + 2 )
+#define ZAP_ARCHIVE_BLOCK_SAMPLES	1024
+#define ZAP_ARCHIVE_BLOCK_USEC		10000000
+
+typedef struct {
+	unsigned __int32		magic;
+	unsigned __int32		version;
+	unsigned __int32		length;							// Bytes in the block, header included. The next block follows.
+	unsigned __int32		tid;
+	unsigned __int32		start_high, start_low;			// When the test started, usecs since 1970.
+	unsigned __int32		sample_count;
+	unsigned __int32		column_count;
+	unsigned __int32		tx_ip;							// Network order.
+	unsigned __int32		rx_count;
+	char					tag[64];						// -T, -S and -N, cut short if need be.
+	char					sub[64];
+	char					note[128];
+} zap_archive_header_t;
+
 typedef struct {
 	unsigned __int32		batch_number;
 	unsigned __int32		payload_number;
+	unsigned __int32		tx_nsec_high;					// Departure, transmitter's wall clock, nsecs.
+	unsigned __int32		tx_nsec_low;
 } zap_data_frame_t;
 
+typedef struct {
+	unsigned __int32		t1_high, t1_low;				// Controller's wall clock, nsecs, as the request left.
+	unsigned __int32		t2_high, t2_low;				// Station's, as the request arrived. 0 in a request.
+	unsigned __int32		t3_high, t3_low;				// Station's, as the response left.
+} zap_time_sync_frame_t;
+
 typedef struct {
 	unsigned __int32		batch_number;
 } zap_data_complete_frame_t;
@@ -336,6 +727,7 @@ typedef struct {
 		zap_open_control_frame_t			open_control;
 		zap_connect_frame_t					connect;
 		zap_performance_frame_t				performance;
+		zap_time_sync_frame_t				time_sync;
 	} payload;
 } zap_frame_t;
 
@@ -362,7 +754,17 @@ void exit_error( char *str );
 void zap_clean_station( zap_station_t *station, fd_set *fd);
 
 int zap_find_station( unsigned __int32 tid, zap_server_t *server, zap_station_t **station, unsigned __int32 add);
-int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsigned __int32 *remote_ip, struct timeval *tv);
+int zap_read_frame( SOCKET s, unsigned __int32 tcp, zap_frame_t **rx_frame, unsigned __int32 *remote_ip, __int64 *rx_nsec);
+int zap_check_datagram( zap_frame_t *frame, int len );
+int zap_check_version( zap_frame_t *frame );
+#ifndef WIN32
+int zap_rx_timestamp( struct msghdr *msg, __int64 *rx_nsec, unsigned __int32 *rx_drops );
+#endif
+int zap_rx_timestamp_enable( SOCKET sock );
+int zap_rx_timestamp_hw( SOCKET sock, const char *ifname );
+int zap_rx_overflow_enable( SOCKET sock );
+int zap_snmp_read( zap_snmp_t *snmp );
+void zap_snmp_sample( zap_server_t *server );
 int zap_socket( unsigned __int32 buff_size, int tcp, SOCKET *sock);
 int zap_bind( SOCKET sock);
 int zap_listen( SOCKET sock);
@@ -370,7 +772,12 @@ int zap_accept( zap_server_t *server, SOCKET sock, zap_station_t *station_cleane
 int zap_connect( unsigned __int32 remote_ip, int tcp, SOCKET sock, unsigned __int32 usec_timeout);
 int zap_get_ready( SOCKET s, unsigned __int32 tcp, unsigned __int32 usecs);
 int zap_config( unsigned __int32 tid, SOCKET s, zap_station_config_t *conf);
-int zap_send_data( unsigned __int32 tcp, unsigned __int32 tid, unsigned __int32 batch, unsigned __int32 payload, SOCKET s, unsigned __int32 remote_ip, unsigned __int32 payload_length);
+int zap_station_tx_prepare( zap_station_t *station );
+int zap_station_tx_addr( zap_station_t *station );
+int zap_station_tx_socket( zap_station_t *station );
+void zap_station_tx_release( zap_station_t *station );
+int zap_send_data( zap_station_t *station, SOCKET s );
+int zap_send_data_burst( zap_station_t *station, SOCKET s, unsigned __int32 count );
 int zap_send_performance_report( zap_station_t *station, zap_performance_frame_t *perf);
 int zap_send_null_frame( unsigned __int32 tid, SOCKET s, unsigned __int32 remote_ip);
 int zap_send_open_data_connection( unsigned __int32 tid, SOCKET s);
@@ -378,15 +785,92 @@ int zap_send_ready( unsigned __int32 tid, SOCKET s);
 int zap_data_connect( unsigned __int32 tid, SOCKET s, unsigned __int32 remote_station);
 int zap_test_start( unsigned __int32 tid, SOCKET s);
 int zap_test_complete( unsigned __int32 tid, SOCKET s);
-int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *history, zap_performance_frame_t *perf, double* total, double* throughput_array );
+int zap_send_time_sync( unsigned __int32 tid, SOCKET s, __int64 t1, __int64 t2 );
+int zap_time_sync( unsigned __int32 tid, SOCKET s, zap_clock_t *clock, unsigned __int32 count );
+void zap_clock_sample( zap_clock_t *clock, zap_frame_t *frame, __int64 t4 );
+__int64 zap_clock_offset( zap_clock_t *clock, __int64 at );
+void zap_stamp_data( zap_frame_t *frame, __int64 nsec );
+int zap_history_alloc( zap_history_t *history, unsigned __int32 bits );
+int zap_history_init( zap_history_t *history, double error );
+unsigned __int64 zap_history_value( zap_history_t *history, unsigned __int32 index );
+void zap_history_add( zap_history_t *history, unsigned __int64 value, unsigned __int64 count );
+void zap_history_merge( zap_history_t *history, zap_history_t *from );
+void zap_history_free( zap_history_t *history );
+unsigned __int64 get_stats( zap_history_t *history, double percentile );
+void gather_stats( zap_history_t *history, unsigned __int64 value );
+__int64 zap_get_nsec( unsigned __int32 high, unsigned __int32 low );
+int zap_control_process_rx( zap_config_t *config, SOCKET s, zap_history_t *history, zap_performance_frame_t *perf, double* total );
 int zap_compile_results( zap_config_t *config, zap_history_t *rate_history, zap_performance_frame_t *perf );
 
 int zap_send_data_complete( zap_station_t *station);
 int zap_rx_data( zap_server_t *server, SOCKET sock, int tcp, fd_set *fd, zap_station_t *station_cleaned);
+int zap_rx_frame( zap_server_t *server, SOCKET sock, zap_frame_t *frame, unsigned __int32 remote_ip, __int64 *rx_nsec);
+int zap_rx_station_frame( zap_server_t *server, zap_station_t *station, SOCKET sock, zap_frame_t *frame, unsigned __int32 remote_ip, __int64 *rx_nsec );
+int zap_batch_complete( zap_station_t *station, unsigned __int32 batch );
+#ifdef ZAP_HAVE_RECVMMSG
+int zap_rx_burst( zap_server_t *server, SOCKET sock, unsigned char *space, int wait );
+#endif
+
+// Timer wheel, zaptimer.c
+void zap_wheel_init( zap_wheel_t *wheel, __int64 now );
+void zap_timer_arm( zap_wheel_t *wheel, zap_timer_t *timer, __int64 expires );
+void zap_timer_cancel( zap_timer_t *timer );
+zap_timer_t *zap_wheel_expire( zap_wheel_t *wheel, __int64 now );
+__int64 zap_wheel_next( zap_wheel_t *wheel );
+
+// epoll event loop, zappoll.c
+typedef struct {
+	SOCKET					sock;					// Ready socket.
+	zap_station_t			*station;				// Station it was added for, NULL for the server's own.
+} zap_poll_event_t;
+
+int zap_poll_init( zap_server_t *server );
+int zap_poll_watch( zap_server_t *server, zap_station_t *station, SOCKET sock );
+int zap_poll_wait( zap_server_t *server, zap_poll_event_t *ready, int max, __int64 nsec );
+
+// Data-plane workers, zapworker.c
+int zap_workers_start( zap_server_t *server, unsigned __int32 count, void ( *run )( zap_worker_t *worker ) );
+void zap_worker_lock( zap_worker_t *worker );
+void zap_worker_unlock( zap_worker_t *worker );
+void zap_worker_wait( zap_worker_t *worker, __int64 until );
+int zap_worker_steal( zap_server_t *server, zap_worker_t *thief );
+int zap_receivers_start( zap_server_t *server, unsigned __int32 count, void ( *run )( zap_worker_t *receiver ) );
+void zap_server_lock( zap_server_t *server );
+void zap_server_unlock( zap_server_t *server );
+void zap_hash_lock( zap_server_t *server, int write );
+void zap_hash_unlock( zap_server_t *server, int write );
+void zap_station_own( zap_server_t *server, zap_station_t *station );
+int zap_rx_frame_locked( zap_server_t *server, SOCKET sock, zap_frame_t *frame, unsigned __int32 remote_ip, __int64 *rx_nsec );
+int zap_station_complete( zap_server_t *server, zap_station_t *station, SOCKET sock, unsigned __int32 batch );
+unsigned __int32 zap_receiver_wait( zap_worker_t *receiver );
+void zap_receiver_complete( zap_server_t *server, zap_worker_t *receiver, unsigned __int32 seen );
+zap_worker_t *zap_station_lock( zap_station_t *station );
+void zap_station_arm( zap_server_t *server, zap_station_t *station, __int64 expires );
+void zap_station_disown( zap_station_t *station );
+
+// io_uring engine, zapuring.c
+int zap_uring_init( zap_server_t *server );
+SOCKET zap_uring_fd( zap_server_t *server );
+int zap_uring_send_burst( zap_server_t *server, zap_station_t *station, unsigned __int32 count );
+int zap_uring_poll( zap_server_t *server );
+
+// Result writer, zapwriter.c
+int zap_writer_file( zap_writer_t *writer, const char *name );
+void zap_writer_raw( zap_writer_t *writer, int file );
+void zap_writer_printf( zap_writer_t *writer, const char *format, ... );
+void zap_writer_append( zap_writer_t *writer, const void *data, unsigned __int32 length );
+void zap_writer_header( zap_writer_t *writer );
+int zap_writer_commit( zap_writer_t *writer, int file );
+int zap_writer_stop( zap_writer_t *writer );
 
 
 char *inet_ntoa2( unsigned __int32 addr );
 __int64 get_current_usecs( void );
+__int64 get_current_nsecs( void );
+__int64 get_wall_nsecs( void );
+void zap_relinquish( void );
+__int64 zap_payload_delay_nsec( zap_station_t *station );
+int zap_tx_pacing_init( SOCKET s );
 void net_init( void );
 void cleanup_exit( int err );
 void InitLog(  );
@@ -0,0 +1,155 @@
+/*
+Copyright (c) 2004-2009, Ruckus Wireless, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of Ruckus Wireless nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER OR CONTRIBUTERS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// zappoll.c :
+//
+// epoll event loop for zapd.
+//
+// Sockets join the epoll set once, as they are accepted or connected, tagged with the
+// index of the station that owns them ( 0 for the server's own ), and leave it when they
+// are closed. A wait then costs in proportion to the sockets that are ready, not to the
+// stations configured, and is not bound by FD_SETSIZE. Level triggered, since frames
+// are read one at a time.
+//
+// Waits take nanoseconds, through epoll_pwait2 where the kernel has it, so the pacer's
+// sleep is as fine as select's was.
+//
+
+#include "zaplib.h"
+#include "error.h"
+
+#ifdef ZAP_HAVE_EPOLL
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_epoll_pwait2
+#define SYS_epoll_pwait2		441
+#endif
+
+#define ZAP_POLL_EVENTS			64				// Ready sockets taken per wait.
+
+// Create the server's epoll set and add its listening and UDP receive sockets. Returns
+// non-zero if the kernel has no epoll, leaving zapd on select.
+int zap_poll_init( zap_server_t *server )
+{
+	server->poll_fd = epoll_create1( EPOLL_CLOEXEC );
+	if ( server->poll_fd == INVALID_SOCKET ) {
+		return 1;
+	}
+	// UDP receives complete on the io_uring, if there is one; its descriptor polls readable when they do.
+	// Receivers, if any, read the UDP sockets themselves.
+	if ( zap_poll_watch( server, NULL, server->tcp_socket ) ||
+		( !server->receiver_count &&
+		zap_poll_watch( server, NULL, server->uring ? zap_uring_fd( server ) : server->udp_socket_rx ) ) ) {
+		close( server->poll_fd );
+		server->poll_fd = INVALID_SOCKET;
+		return 1;
+	}
+	return 0;
+}
+
+// Add sock, owned by station ( NULL for the server's own ), to the epoll set. Nothing to
+// do if zapd is on select. Closing sock takes it out again.
+int zap_poll_watch( zap_server_t *server, zap_station_t *station, SOCKET sock )
+{
+	struct epoll_event	ev;
+
+	if ( server->poll_fd == INVALID_SOCKET ) {
+		return 0;
+	}
+
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = EPOLLIN;
+	ev.data.u64 = ( ( unsigned __int64 )( station ? station->index + 1 : 0 ) << 32 ) | ( unsigned __int32 )sock;
+	if ( epoll_ctl( server->poll_fd, EPOLL_CTL_ADD, sock, &ev ) ) {
+		WARN_errno( 1, "zap_poll_watch - epoll_ctl" );
+		return 1;
+	}
+	return 0;
+}
+
+// Wait up to nsec ( forever if negative ) for sockets to become ready, and return up to max
+// of them. Returns how many, 0 on timeout.
+int zap_poll_wait( zap_server_t *server, zap_poll_event_t *ready, int max, __int64 nsec )
+{
+	static int			no_pwait2 = 0;
+	struct epoll_event	events[ZAP_POLL_EVENTS];
+	struct timespec		ts;
+	unsigned __int32	index;
+	int					n, i;
+
+	if ( max > ZAP_POLL_EVENTS ) {
+		max = ZAP_POLL_EVENTS;
+	}
+
+	n = -1;
+	if ( !no_pwait2 ) {
+		ts.tv_sec = ( time_t )( nsec / 1000000000 );
+		ts.tv_nsec = ( long )( nsec % 1000000000 );
+		n = ( int )syscall( SYS_epoll_pwait2, server->poll_fd, events, max, ( nsec < 0 ) ? NULL : &ts, NULL, 0 );
+		if ( ( n < 0 ) && ( errno == ENOSYS ) ) {
+			no_pwait2 = 1;
+		}
+	}
+	if ( no_pwait2 ) {
+		// Whole milliseconds only. Round down; the pacer spins out the rest.
+		n = epoll_wait( server->poll_fd, events, max, ( nsec < 0 ) ? -1 : ( int )( nsec / 1000000 ) );
+	}
+	if ( n < 0 ) {
+		if ( errno != EINTR ) {
+			WARN_errno( 1, "zap_poll_wait - epoll_wait" );
+		}
+		return 0;
+	}
+
+	for ( i = 0; i < n; i++ ) {
+		index = ( unsigned __int32 )( events[i].data.u64 >> 32 );
+		ready[i].sock = ( SOCKET )( events[i].data.u64 & 0xffffffff );
+		ready[i].station = index ? ZAP_STATION( server, index - 1 ) : NULL;
+	}
+	return n;
+}
+
+#else // !ZAP_HAVE_EPOLL
+
+int zap_poll_init( zap_server_t *server )
+{
+	return 1;
+}
+
+int zap_poll_watch( zap_server_t *server, zap_station_t *station, SOCKET sock )
+{
+	return 0;
+}
+
+int zap_poll_wait( zap_server_t *server, zap_poll_event_t *ready, int max, __int64 nsec )
+{
+	return 0;
+}
+
+#endif // ZAP_HAVE_EPOLL
@@ -0,0 +1,253 @@
+/*
+Copyright (c) 2004-2009, Ruckus Wireless, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of Ruckus Wireless nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER OR CONTRIBUTERS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// zaptimer.c : 
+//
+// Hierarchical timer wheel for zapd's per-station deadlines.
+//
+// Four levels of 64 slots. Level 0 slots are one tick ( ZAP_WHEEL_TICK_SHIFT, ~1 usec )
+// wide, and each level above is 64 times coarser, so a deadline is filed in O(1) and
+// drops a level each time its slot comes round. Expiring costs O(expired) plus one
+// cascade per 64 ticks; stretches with nothing armed are skipped outright. A bitmap
+// of occupied slots per level lets zap_wheel_next find the earliest deadline, to
+// the nanosecond, without walking the timers.
+//
+
+#include "zaplib.h"
+
+#define ZAP_WHEEL_MASK			( ZAP_WHEEL_SLOTS - 1 )
+#define ZAP_WHEEL_SPAN( l )		( ( __int64 )1 << ( ZAP_WHEEL_BITS * ( ( l ) + 1 ) ) )	// Ticks covered by levels 0..l.
+
+static unsigned __int32 zap_wheel_index( __int64 tick, unsigned __int32 level )
+{
+	return ( unsigned __int32 )( ( tick >> ( ZAP_WHEEL_BITS * level ) ) & ZAP_WHEEL_MASK );
+}
+
+// File an armed timer in the slot its deadline falls in, relative to the wheel's tick.
+static void zap_wheel_file( zap_wheel_t *wheel, zap_timer_t *timer )
+{
+	zap_timer_t			*head;
+	__int64				t, delta;
+	unsigned __int32	level;
+
+	t = timer->expires >> ZAP_WHEEL_TICK_SHIFT;
+	if ( t < wheel->tick ) {
+		t = wheel->tick;				// Already due; expires on the next pass.
+	}
+	delta = t - wheel->tick;
+	for ( level = 0; level < ZAP_WHEEL_LEVELS - 1; level++ ) {
+		if ( delta < ZAP_WHEEL_SPAN( level ) ) {
+			break;
+		}
+	}
+	if ( delta >= ZAP_WHEEL_SPAN( level ) ) {
+		t = wheel->tick + ZAP_WHEEL_SPAN( level ) - 1;	// Beyond the wheel; refiled as it comes round.
+	}
+
+	timer->level = level;
+	timer->slot = zap_wheel_index( t, level );
+	head = &wheel->slots[level][timer->slot];
+	// Append, so timers due together expire in the order they were armed.
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+	wheel->map[level] |= ( unsigned __int64 )1 << timer->slot;
+}
+
+static void zap_wheel_unlink( zap_wheel_t *wheel, zap_timer_t *timer )
+{
+	zap_timer_t		*head = &wheel->slots[timer->level][timer->slot];
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+	if ( head->next == head ) {
+		wheel->map[timer->level] &= ~( ( unsigned __int64 )1 << timer->slot );
+	}
+}
+
+// Refile everything in one slot of a coarser level; called as that slot comes due.
+static void zap_wheel_cascade( zap_wheel_t *wheel, unsigned __int32 level, unsigned __int32 slot )
+{
+	zap_timer_t		*head = &wheel->slots[level][slot];
+	zap_timer_t		*timer;
+
+	while ( head->next != head ) {
+		timer = head->next;
+		zap_wheel_unlink( wheel, timer );
+		zap_wheel_file( wheel, timer );
+	}
+}
+
+// Step the wheel onto tick, which must be a multiple of ZAP_WHEEL_SLOTS, pulling
+// down whatever the coarser levels hold for the stretch now starting.
+static void zap_wheel_turn( zap_wheel_t *wheel, __int64 tick )
+{
+	unsigned __int32	level, slot;
+
+	wheel->tick = tick;
+	for ( level = 1; level < ZAP_WHEEL_LEVELS; level++ ) {
+		slot = zap_wheel_index( tick, level );
+		zap_wheel_cascade( wheel, level, slot );
+		if ( slot ) {
+			break;
+		}
+	}
+}
+
+void zap_wheel_init( zap_wheel_t *wheel, __int64 now )
+{
+	unsigned __int32	level, slot;
+
+	memset( wheel, 0, sizeof( *wheel ) );
+	for ( level = 0; level < ZAP_WHEEL_LEVELS; level++ ) {
+		for ( slot = 0; slot < ZAP_WHEEL_SLOTS; slot++ ) {
+			wheel->slots[level][slot].next = &wheel->slots[level][slot];
+			wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+		}
+	}
+	wheel->tick = now >> ZAP_WHEEL_TICK_SHIFT;
+}
+
+// Arm, or re-arm, timer to expire at get_current_nsecs(  ) time expires. Zero, or
+// any time already past, expires on the wheel's next pass.
+void zap_timer_arm( zap_wheel_t *wheel, zap_timer_t *timer, __int64 expires )
+{
+	zap_timer_cancel( timer );
+	timer->wheel = wheel;
+	timer->expires = expires;
+	zap_wheel_file( wheel, timer );
+	wheel->count++;
+}
+
+void zap_timer_cancel( zap_timer_t *timer )
+{
+	if ( timer->wheel ) {
+		zap_wheel_unlink( timer->wheel, timer );
+		timer->wheel->count--;
+		timer->wheel = NULL;
+	}
+}
+
+// Detach every timer due by now. Returns them chained through next, in the order
+// they fell due; each is disarmed, so it may be re-armed while the chain is walked.
+zap_timer_t *zap_wheel_expire( zap_wheel_t *wheel, __int64 now )
+{
+	zap_timer_t			*expired = NULL, **tail = &expired;
+	zap_timer_t			*head, *timer, *next;
+	__int64				target = now >> ZAP_WHEEL_TICK_SHIFT;
+	unsigned __int32	slot;
+
+	while ( wheel->tick <= target ) {
+		if ( !wheel->count ) {
+			// Nothing to cascade or expire anywhere; catch straight up.
+			wheel->tick = target;
+			break;
+		}
+
+		slot = zap_wheel_index( wheel->tick, 0 );
+		head = &wheel->slots[0][slot];
+		for ( timer = head->next; timer != head; timer = next ) {
+			next = timer->next;
+			// The current tick may be only partly over.
+			if ( ( wheel->tick < target ) || ( timer->expires <= now ) ) {
+				zap_wheel_unlink( wheel, timer );
+				timer->wheel = NULL;
+				wheel->count--;
+				*tail = timer;
+				tail = &timer->next;
+			}
+		}
+		*tail = NULL;
+
+		if ( wheel->tick == target ) {
+			break;
+		}
+		if ( !( wheel->map[0] >> slot >> 1 ) ) {
+			// Nothing more in this turn of level 0; skip to the next, or to target.
+			if ( ( wheel->tick | ZAP_WHEEL_MASK ) < target ) {
+				zap_wheel_turn( wheel, ( wheel->tick | ZAP_WHEEL_MASK ) + 1 );
+			} else {
+				wheel->tick = target;
+			}
+		} else {
+			wheel->tick++;
+		}
+	}
+
+	return expired;
+}
+
+// The earliest time anything armed may be due, or 0 if nothing is armed. A deadline
+// still sitting on a coarser level reports the time its slot cascades, which is never late.
+__int64 zap_wheel_next( zap_wheel_t *wheel )
+{
+	zap_timer_t			*head, *timer;
+	__int64				next = 0, t;
+	unsigned __int32	level, cur, slot, j;
+
+	if ( !wheel->count ) {
+		return 0;
+	}
+
+	// Level 0 holds the next ZAP_WHEEL_SLOTS ticks, in slot order from the current one.
+	cur = zap_wheel_index( wheel->tick, 0 );
+	for ( j = 0; j < ZAP_WHEEL_SLOTS; j++ ) {
+		slot = ( cur + j ) & ZAP_WHEEL_MASK;
+		if ( wheel->map[0] & ( ( unsigned __int64 )1 << slot ) ) {
+			head = &wheel->slots[0][slot];
+			for ( timer = head->next; timer != head; timer = timer->next ) {
+				t = ( timer->expires > 0 ) ? timer->expires : 1;	// Keep "due now" apart from "nothing armed".
+				if ( !next || ( t < next ) ) {
+					next = t;
+				}
+			}
+			break;
+		}
+	}
+
+	for ( level = 1; level < ZAP_WHEEL_LEVELS; level++ ) {
+		if ( !wheel->map[level] ) {
+			continue;
+		}
+		cur = zap_wheel_index( wheel->tick, level );
+		for ( j = 1; j <= ZAP_WHEEL_SLOTS; j++ ) {
+			slot = ( cur + j ) & ZAP_WHEEL_MASK;
+			if ( wheel->map[level] & ( ( unsigned __int64 )1 << slot ) ) {
+				t = ( ( wheel->tick >> ( ZAP_WHEEL_BITS * level ) ) + j ) << ( ZAP_WHEEL_BITS * level );
+				t <<= ZAP_WHEEL_TICK_SHIFT;
+				if ( !next || ( t < next ) ) {
+					next = t;
+				}
+				break;
+			}
+		}
+	}
+
+	return next;
+}
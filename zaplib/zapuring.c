@@ -0,0 +1,462 @@
+/*
+Copyright (c) 2004-2009, Ruckus Wireless, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of Ruckus Wireless nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER OR CONTRIBUTERS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// zapuring.c : 
+//
+// io_uring data-plane engine for zapd.
+//
+// UDP data sends are queued as SENDMSG submissions and UDP receives are kept posted as
+// RECVMSG submissions. Sends go out on each station's own connected socket; receives are
+// posted on udp_socket_rx, registered as a fixed file.
+// A whole transmit burst costs one io_uring_enter, and receive completions are harvested
+// from the shared completion ring, so the per-packet syscall count falls to near zero.
+// The ring descriptor is pollable, so it simply replaces udp_socket_rx in zapd's select
+// set, and sends in flight no longer hold up receive processing.
+//
+// The ring is driven with raw system calls so zapd keeps building without liburing.
+//
+
+#include "zaplib.h"
+#include "error.h"
+
+#ifdef ZAP_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define ZAP_URING_ENTRIES		256				// Submission queue depth.
+#define ZAP_URING_TX_SLOTS		192				// Data sends that may be in flight at once.
+#define ZAP_URING_RX_SLOTS		32				// Receives kept posted on udp_socket_rx.
+#define ZAP_URING_FILE_RX		0				// Fixed file index of udp_socket_rx.
+#define ZAP_URING_RX_TAG		0x80000000		// user_data bit marking a receive completion.
+
+// One data send in flight. Everything the kernel reads lives here until completion,
+// and the kernel holds its own reference to the socket from submission on, so a station
+// may be cleaned up while its sends are still queued.
+typedef struct {
+	zap_frame_t				hdr;				// Private copy of the station's template header.
+	struct iovec			iov[2];
+	struct msghdr			msg;
+} zap_uring_tx_t;
+
+// One posted receive.
+typedef struct {
+	struct msghdr			msg;
+	struct iovec			iov;
+	struct sockaddr_in		addr;
+	unsigned __int64		ctrl[ZAP_RX_CTRL_LEN / sizeof( unsigned __int64 )];
+	unsigned char			*buf;
+	int						len;				// Result of the completed receive.
+} zap_uring_rx_t;
+
+struct zap_uring_s {
+	int						fd;
+
+	unsigned				*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned				sq_entries;
+	unsigned				sq_local_tail;		// Tail including entries not yet published.
+	unsigned				sq_pending;			// Entries not yet consumed by io_uring_enter.
+	struct io_uring_sqe		*sqes;
+
+	unsigned				*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe		*cqes;
+
+	void					*sq_ptr, *cq_ptr;
+	size_t					sq_len, cq_len, sqes_len;
+
+	zap_uring_tx_t			tx[ZAP_URING_TX_SLOTS];
+	unsigned				tx_free[ZAP_URING_TX_SLOTS];
+	unsigned				tx_free_count;
+	unsigned				tx_errors;
+
+	zap_uring_rx_t			rx[ZAP_URING_RX_SLOTS];
+	unsigned				rx_done[ZAP_URING_RX_SLOTS];	// Completed receives waiting for zap_uring_poll.
+	unsigned				rx_done_count;
+};
+
+static const char zap_uring_fill[MAX_PACKET_LEN];
+
+
+static int zap_uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags )
+{
+	return ( int )syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+
+static void zap_uring_free( zap_uring_t *ring )
+{
+	int			i;
+
+	if ( ring->sqes && ( ring->sqes != MAP_FAILED ) ) {
+		munmap( ring->sqes, ring->sqes_len );
+	}
+	if ( ring->cq_ptr && ( ring->cq_ptr != MAP_FAILED ) && ( ring->cq_ptr != ring->sq_ptr ) ) {
+		munmap( ring->cq_ptr, ring->cq_len );
+	}
+	if ( ring->sq_ptr && ( ring->sq_ptr != MAP_FAILED ) ) {
+		munmap( ring->sq_ptr, ring->sq_len );
+	}
+	if ( ring->fd >= 0 ) {
+		close( ring->fd );
+	}
+	for ( i = 0; i < ZAP_URING_RX_SLOTS; i++ ) {
+		free( ring->rx[i].buf );
+	}
+	free( ring );
+}
+
+
+// Hand queued submissions to the kernel, optionally waiting for at least wait completions.
+static int zap_uring_submit( zap_uring_t *ring, unsigned wait )
+{
+	int			rv;
+
+	__atomic_store_n( ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE );
+	if ( !ring->sq_pending && !wait ) {
+		return 0;
+	}
+	do {
+		rv = zap_uring_enter( ring->fd, ring->sq_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0 );
+	} while ( ( rv < 0 ) && ( errno == EINTR ) );
+	if ( rv < 0 ) {
+		WARN_errno( 1, "zap_uring_submit - io_uring_enter" );
+		return 1;
+	}
+	ring->sq_pending -= rv;
+
+	return 0;
+}
+
+
+static struct io_uring_sqe *zap_uring_sqe( zap_uring_t *ring )
+{
+	struct io_uring_sqe		*sqe;
+	unsigned				head, idx;
+
+	head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+	if ( ( ring->sq_local_tail - head ) >= ring->sq_entries ) {
+		if ( zap_uring_submit( ring, 0 ) ) {
+			return NULL;
+		}
+		head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+		if ( ( ring->sq_local_tail - head ) >= ring->sq_entries ) {
+			erk;
+			return NULL;
+		}
+	}
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset( sqe, 0, sizeof( *sqe ) );
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+	ring->sq_pending++;
+
+	return sqe;
+}
+
+
+// Move completions off the ring. Send slots are freed right away; receives are parked
+// for zap_uring_poll so frames are only ever processed from zapd's receive path.
+static void zap_uring_reap( zap_uring_t *ring )
+{
+	struct io_uring_cqe		*cqe;
+	unsigned				head, tail, tag;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE );
+	while ( head != tail ) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		tag = ( unsigned )cqe->user_data;
+		if ( tag & ZAP_URING_RX_TAG ) {
+			tag &= ~ZAP_URING_RX_TAG;
+			ring->rx[tag].len = cqe->res;
+			ring->rx_done[ring->rx_done_count++] = tag;
+		} else {
+			if ( cqe->res < 0 ) {
+				if ( !ring->tx_errors++ ) {
+					fprintf( stderr, "io_uring data send failed: %s\n", strerror( -cqe->res ) );
+				}
+			}
+			ring->tx_free[ring->tx_free_count++] = tag;
+		}
+		head++;
+	}
+	__atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+}
+
+
+static int zap_uring_post_rx( zap_uring_t *ring, unsigned slot )
+{
+	zap_uring_rx_t			*rx = &ring->rx[slot];
+	struct io_uring_sqe		*sqe;
+
+	sqe = zap_uring_sqe( ring );
+	if ( !sqe ) {
+		return 1;
+	}
+
+	memset( &rx->msg, 0, sizeof( rx->msg ) );
+	rx->iov.iov_base = rx->buf;
+	rx->iov.iov_len = MAX_PACKET_LEN;
+	rx->msg.msg_name = &rx->addr;
+	rx->msg.msg_namelen = sizeof( rx->addr );
+	rx->msg.msg_iov = &rx->iov;
+	rx->msg.msg_iovlen = 1;
+	rx->msg.msg_control = rx->ctrl;
+	rx->msg.msg_controllen = sizeof( rx->ctrl );
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ZAP_URING_FILE_RX;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = ( unsigned long )&rx->msg;
+	sqe->len = 1;
+	sqe->user_data = slot | ZAP_URING_RX_TAG;
+
+	return 0;
+}
+
+
+int zap_uring_init( zap_server_t *server )
+{
+	struct io_uring_params	p;
+	zap_uring_t				*ring;
+	int						files[1];
+	unsigned				i;
+
+	ring = ( zap_uring_t * )calloc( 1, sizeof( *ring ) );
+	if ( !ring ) {
+		return 1;
+	}
+
+	memset( &p, 0, sizeof( p ) );
+	ring->fd = ( int )syscall( __NR_io_uring_setup, ZAP_URING_ENTRIES, &p );
+	if ( ring->fd < 0 ) {
+		WARN_errno( 1, "zap_uring_init - io_uring_setup" );
+		free( ring );
+		return 1;
+	}
+
+	// Map the submission ring, completion ring and submission entries.
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( ring->cq_len > ring->sq_len ) {
+			ring->sq_len = ring->cq_len;
+		}
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sq_ptr = mmap( NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+	if ( ring->sq_ptr == MAP_FAILED ) {
+		WARN_errno( 1, "zap_uring_init - mmap" );
+		zap_uring_free( ring );
+		return 1;
+	}
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap( NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+		if ( ring->cq_ptr == MAP_FAILED ) {
+			WARN_errno( 1, "zap_uring_init - mmap" );
+			zap_uring_free( ring );
+			return 1;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof( struct io_uring_sqe );
+	ring->sqes = ( struct io_uring_sqe * )mmap( NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+	if ( ring->sqes == MAP_FAILED ) {
+		WARN_errno( 1, "zap_uring_init - mmap" );
+		zap_uring_free( ring );
+		return 1;
+	}
+
+	ring->sq_head = ( unsigned * )( ( char * )ring->sq_ptr + p.sq_off.head );
+	ring->sq_tail = ( unsigned * )( ( char * )ring->sq_ptr + p.sq_off.tail );
+	ring->sq_mask = ( unsigned * )( ( char * )ring->sq_ptr + p.sq_off.ring_mask );
+	ring->sq_array = ( unsigned * )( ( char * )ring->sq_ptr + p.sq_off.array );
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = ( unsigned * )( ( char * )ring->cq_ptr + p.cq_off.head );
+	ring->cq_tail = ( unsigned * )( ( char * )ring->cq_ptr + p.cq_off.tail );
+	ring->cq_mask = ( unsigned * )( ( char * )ring->cq_ptr + p.cq_off.ring_mask );
+	ring->cqes = ( struct io_uring_cqe * )( ( char * )ring->cq_ptr + p.cq_off.cqes );
+
+	// Every receive names its socket by fixed file index.
+	files[ZAP_URING_FILE_RX] = server->udp_socket_rx;
+	if ( syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, 1 ) < 0 ) {
+		WARN_errno( 1, "zap_uring_init - io_uring_register" );
+		zap_uring_free( ring );
+		return 1;
+	}
+
+	for ( i = 0; i < ZAP_URING_TX_SLOTS; i++ ) {
+		ring->tx_free[i] = i;
+	}
+	ring->tx_free_count = ZAP_URING_TX_SLOTS;
+
+	for ( i = 0; i < ZAP_URING_RX_SLOTS; i++ ) {
+		ring->rx[i].buf = ( unsigned char * )malloc( MAX_PACKET_LEN );
+		if ( !ring->rx[i].buf || zap_uring_post_rx( ring, i ) ) {
+			zap_uring_free( ring );
+			return 1;
+		}
+	}
+	if ( zap_uring_submit( ring, 0 ) ) {
+		zap_uring_free( ring );
+		return 1;
+	}
+
+	server->uring = ring;
+
+	return 0;
+}
+
+
+SOCKET zap_uring_fd( zap_server_t *server )
+{
+	return server->uring->fd;
+}
+
+
+// Queue the station's next count UDP payloads, starting at ( batch_num, payload_num ),
+// and submit them with a single io_uring_enter. Only blocks when every send slot is
+// already in flight.
+int zap_uring_send_burst( zap_server_t *server, zap_station_t *station, unsigned __int32 count )
+{
+	zap_uring_t				*ring = server->uring;
+	zap_uring_tx_t			*tx;
+	struct io_uring_sqe		*sqe;
+	unsigned				i, slot;
+
+	if ( !station->tx_frame ) {
+		erk;
+		return 1;
+	}
+
+	for ( i = 0; i < count; i++ ) {
+		while ( !ring->tx_free_count ) {
+			if ( zap_uring_submit( ring, 1 ) ) {
+				return 1;
+			}
+			zap_uring_reap( ring );
+		}
+
+		sqe = zap_uring_sqe( ring );
+		if ( !sqe ) {
+			return 1;
+		}
+		slot = ring->tx_free[--ring->tx_free_count];
+		tx = &ring->tx[slot];
+
+		memcpy( &tx->hdr, station->tx_frame, ZAP_DATA_HEADER_LEN );
+		tx->hdr.payload.data.batch_number = htonl( station->batch_num );
+		tx->hdr.payload.data.payload_number = htonl( station->payload_num + i );
+		zap_stamp_data( &tx->hdr, get_wall_nsecs(  ) );
+		tx->iov[0].iov_base = &tx->hdr;
+		tx->iov[0].iov_len = ZAP_DATA_HEADER_LEN;
+		tx->iov[1].iov_base = ( void * )zap_uring_fill;
+		tx->iov[1].iov_len = station->tx_frame_length - ZAP_DATA_HEADER_LEN;
+
+		memset( &tx->msg, 0, sizeof( tx->msg ) );
+		tx->msg.msg_iov = tx->iov;
+		tx->msg.msg_iovlen = 2;
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = station->s_udp_tx;
+		sqe->addr = ( unsigned long )&tx->msg;
+		sqe->len = 1;
+		sqe->user_data = slot;
+	}
+
+	return zap_uring_submit( ring, 0 );
+}
+
+
+// Process every completed receive, re-post the receives and submit anything queued. Goes
+// round again while every receive completed, so udp_socket_rx is read dry before zapd moves
+// on to the stations' TCP sockets, and their data_completes.
+int zap_uring_poll( zap_server_t *server )
+{
+	zap_uring_t			*ring = server->uring;
+	zap_uring_rx_t		*rx;
+	zap_frame_t			*frame;
+	__int64				nsec;
+	unsigned			i, count;
+
+	do {
+		zap_uring_reap( ring );
+
+		count = ring->rx_done_count;
+		ring->rx_done_count = 0;
+		for ( i = 0; i < count; i++ ) {
+			rx = &ring->rx[ring->rx_done[i]];
+			if ( rx->len >= 0 ) {
+				frame = ( zap_frame_t * )rx->buf;
+				if ( !zap_check_datagram( frame, rx->len ) && !zap_check_version( frame ) ) {
+					zap_rx_frame_locked( server, server->udp_socket_rx, frame, rx->addr.sin_addr.s_addr, zap_rx_timestamp( &rx->msg, &nsec, &server->rx_drops.count ) ? NULL : &nsec );
+				}
+			} else if ( rx->len != -EINTR ) {
+				fprintf( stderr, "io_uring receive failed: %s\n", strerror( -rx->len ) );
+			}
+			if ( zap_uring_post_rx( ring, ring->rx_done[i] ) ) {
+				return 1;
+			}
+		}
+
+		// Receives re-posted on a socket with frames queued complete as they are submitted.
+		if ( zap_uring_submit( ring, 0 ) ) {
+			return 1;
+		}
+	} while ( count == ZAP_URING_RX_SLOTS );
+
+	return 0;
+}
+
+#else // !ZAP_HAVE_URING
+
+int zap_uring_init( zap_server_t *server )
+{
+	return 1;
+}
+
+SOCKET zap_uring_fd( zap_server_t *server )
+{
+	return INVALID_SOCKET;
+}
+
+int zap_uring_send_burst( zap_server_t *server, zap_station_t *station, unsigned __int32 count )
+{
+	return 1;
+}
+
+int zap_uring_poll( zap_server_t *server )
+{
+	return 1;
+}
+
+#endif // ZAP_HAVE_URING
@@ -0,0 +1,649 @@
+/*
+Copyright (c) 2004-2009, Ruckus Wireless, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of Ruckus Wireless nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER OR CONTRIBUTERS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// zapworker.c :
+//
+// Data-plane worker threads for zapd.
+//
+// Each worker owns some of the transmitting stations and runs them off a timer wheel of
+// its own, so stations on different workers transmit on different cores. A station goes
+// to the least loaded worker when its test starts, and stays there until it is cleaned,
+// unless an idle or lightly loaded worker steals it. A steal only happens when it narrows
+// the gap between the two workers' loads, so stations never bounce back and forth.
+//
+// Receivers split UDP receive the same way. Each reads one socket of an SO_REUSEPORT group
+// bound to zapd's port, and a classic BPF program steers every datagram to socket
+// zap_test_id % count, so a station's frames arrive on, and are accounted by, the receiver
+// that owns it. Should the kernel refuse the program, it spreads datagrams by flow hash
+// instead, and a receiver takes the owner's lock for frames that are not its own.
+//
+// A station's data_complete comes over TCP, to the main loop, and may overtake the last of
+// its data still queued on a receiver's socket. So the main loop hands it to the receiver
+// reading the station's data, which acts on it once it has read its socket dry.
+//
+// Lock order: a worker holding its own lock only ever try-locks another, so two workers
+// stealing from each other cannot deadlock. zapd's main thread takes at most one, after
+// the server lock it holds whenever receivers run and it is not waiting.
+//
+
+#include "zaplib.h"
+#include "error.h"
+
+#ifdef ZAP_HAVE_REUSEPORT
+#include <linux/filter.h>
+#include <poll.h>
+#include <fcntl.h>
+#endif
+
+#ifdef WIN32
+static DWORD WINAPI zap_worker_thread( LPVOID arg )
+{
+	zap_worker_t		*worker = ( zap_worker_t * )arg;
+
+	worker->run( worker );
+	return 0;
+}
+#else
+static void *zap_worker_thread( void *arg )
+{
+	zap_worker_t		*worker = ( zap_worker_t * )arg;
+
+	worker->run( worker );
+	return NULL;
+}
+#endif
+
+// A station's share of a worker, in kbps. Never 0, so an idle-rate station still counts.
+static unsigned __int32 zap_station_load( zap_station_t *station )
+{
+	__int64				kbps;
+
+	kbps = ( ( __int64 )station->tx_frame_length * 8000000 ) / zap_payload_delay_nsec( station );
+	if ( kbps < 1 ) {
+		kbps = 1;
+	}
+	if ( kbps > 0x7fffffff ) {
+		kbps = 0x7fffffff;
+	}
+	return ( unsigned __int32 )kbps;
+}
+
+// Start count workers, each running run(  ). Returns 0 on success.
+int zap_workers_start( zap_server_t *server, unsigned __int32 count, void ( *run )( zap_worker_t *worker ) )
+{
+	zap_worker_t		*worker;
+	unsigned __int32	i;
+#ifndef WIN32
+	pthread_mutexattr_t	attr;
+#endif
+
+	server->workers = ( zap_worker_t * )calloc( count, sizeof( zap_worker_t ) );
+	if ( !server->workers ) {
+		erk;
+		return 1;
+	}
+#ifndef WIN32
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+#endif
+	for ( i = 0; i < count; i++ ) {
+		worker = &server->workers[i];
+		worker->server = server;
+		worker->run = run;
+		worker->index = i;
+		zap_wheel_init( &worker->wheel, get_current_nsecs(  ) );
+#ifdef WIN32
+		InitializeCriticalSection( &worker->lock );
+		InitializeConditionVariable( &worker->wake );
+#else
+		pthread_mutex_init( &worker->lock, &attr );
+		pthread_cond_init( &worker->wake, NULL );
+#endif
+	}
+	// Stations may be handed out as soon as the first one runs.
+	server->worker_count = count;
+
+	for ( i = 0; i < count; i++ ) {
+		worker = &server->workers[i];
+#ifdef WIN32
+		worker->thread = CreateThread( NULL, 0, zap_worker_thread, worker, 0, NULL );
+		if ( !worker->thread ) {
+			erk;
+			return 1;
+		}
+#else
+		if ( pthread_create( &worker->thread, NULL, zap_worker_thread, worker ) ) {
+			WARN_errno( 1, "pthread_create" );
+			return 1;
+		}
+#endif
+	}
+	return 0;
+}
+
+void zap_worker_lock( zap_worker_t *worker )
+{
+	if ( worker ) {
+#ifdef WIN32
+		EnterCriticalSection( &worker->lock );
+#else
+		pthread_mutex_lock( &worker->lock );
+#endif
+	}
+}
+
+void zap_worker_unlock( zap_worker_t *worker )
+{
+	if ( worker ) {
+#ifdef WIN32
+		LeaveCriticalSection( &worker->lock );
+#else
+		pthread_mutex_unlock( &worker->lock );
+#endif
+	}
+}
+
+static int zap_worker_trylock( zap_worker_t *worker )
+{
+#ifdef WIN32
+	return TryEnterCriticalSection( &worker->lock ) ? 0 : 1;
+#else
+	return pthread_mutex_trylock( &worker->lock ) ? 1 : 0;
+#endif
+}
+
+// Sleep, with the lock held once, until get_current_nsecs(  ) time until or until woken.
+// 0 waits for a wakeup alone.
+void zap_worker_wait( zap_worker_t *worker, __int64 until )
+{
+	__int64				nsec = 0;
+
+	if ( until ) {
+		nsec = until - get_current_nsecs(  );
+		if ( nsec <= 0 ) {
+			return;
+		}
+	}
+#ifdef WIN32
+	SleepConditionVariableCS( &worker->wake, &worker->lock, until ? ( DWORD )( ( nsec + 999999 ) / 1000000 ) : INFINITE );
+#else
+	if ( until ) {
+		struct timespec		ts;
+
+		// Condition variables time out against the wall clock.
+		clock_gettime( CLOCK_REALTIME, &ts );
+		nsec += ts.tv_nsec;
+		ts.tv_sec += ( time_t )( nsec / 1000000000 );
+		ts.tv_nsec = ( long )( nsec % 1000000000 );
+		pthread_cond_timedwait( &worker->wake, &worker->lock, &ts );
+	} else {
+		pthread_cond_wait( &worker->wake, &worker->lock );
+	}
+#endif
+}
+
+static void zap_worker_signal( zap_worker_t *worker )
+{
+#ifdef WIN32
+	WakeConditionVariable( &worker->wake );
+#else
+	pthread_cond_signal( &worker->wake );
+#endif
+}
+
+// Move station, whose owner and thief are both locked by the caller.
+static void zap_worker_move( zap_station_t *station, zap_worker_t *thief )
+{
+	zap_worker_t		*owner = station->worker;
+	unsigned __int32	load = zap_station_load( station );
+	__int64				expires;
+
+	if ( station->tx_timer.wheel ) {
+		expires = station->tx_timer.expires;
+		zap_timer_cancel( &station->tx_timer );
+		zap_timer_arm( &thief->wheel, &station->tx_timer, expires );
+	}
+	owner->load -= load;
+	owner->stations--;
+	thief->load += load;
+	thief->stations++;
+	station->worker = thief;
+}
+
+// Called by thief, holding its own lock, before it sleeps. Takes one station from the most
+// loaded worker if that brings their loads closer. Returns 1 if it took one.
+int zap_worker_steal( zap_server_t *server, zap_worker_t *thief )
+{
+	zap_worker_t		*victim = NULL, *worker;
+	zap_station_t		*station, *best = NULL;
+	__int64				gap, after, best_after;
+	unsigned __int32	i, count;
+
+	// Pick a victim from the unlocked hints...
+	for ( i = 0; i < server->worker_count; i++ ) {
+		worker = &server->workers[i];
+		if ( ( worker != thief ) && ( worker->stations > 1 ) && ( worker->load > thief->load ) &&
+			( !victim || ( worker->load > victim->load ) ) ) {
+			victim = worker;
+		}
+	}
+	if ( !victim || zap_worker_trylock( victim ) ) {
+		return 0;
+	}
+
+	// ...then decide on the real figures.
+	gap = ( __int64 )victim->load - thief->load;
+	best_after = gap;
+	if ( victim->stations > 1 ) {
+		// The main loop adds slots as we go; acquire the count to see their blocks.
+		count = ZAP_LOAD_ACQUIRE( server->station_count );
+		for ( i = 0; i < count; i++ ) {
+			station = ZAP_STATION( server, i );
+			if ( ( station->worker != victim ) || ( station->state != zap_station_state_running_tx ) ) {
+				continue;
+			}
+			after = gap - 2 * ( __int64 )zap_station_load( station );
+			if ( after < 0 ) {
+				after = -after;
+			}
+			if ( after < best_after ) {
+				best_after = after;
+				best = station;
+			}
+		}
+	}
+	if ( best ) {
+		zap_worker_move( best, thief );
+	}
+
+	zap_worker_unlock( victim );
+	return best ? 1 : 0;
+}
+
+// Lock the worker that owns station, and return it. NULL, with nothing locked, if no worker
+// owns it. Only a holder of the server lock hands stations out, so to it an unowned station
+// stays so.
+zap_worker_t *zap_station_lock( zap_station_t *station )
+{
+	zap_worker_t		*worker;
+
+	while ( ( worker = station->worker ) ) {
+		// A worker with stations due barely lets go of its lock; tell it to stand aside.
+		ZAP_ATOMIC_INC( worker->waiters );
+		zap_worker_lock( worker );
+		ZAP_ATOMIC_DEC( worker->waiters );
+		if ( station->worker == worker ) {
+			return worker;
+		}
+		// Stolen while we waited.
+		zap_worker_unlock( worker );
+	}
+	return NULL;
+}
+
+// (Re)arm station's transmit timer at expires, on its worker's wheel. A station without one
+// goes to the least loaded worker, or to the server's own wheel if zapd runs no workers.
+void zap_station_arm( zap_server_t *server, zap_station_t *station, __int64 expires )
+{
+	zap_worker_t		*worker;
+	unsigned __int32	i;
+
+	if ( !server->worker_count ) {
+		zap_timer_arm( &server->tx_wheel, &station->tx_timer, expires );
+		return;
+	}
+
+	worker = zap_station_lock( station );
+	if ( !worker ) {
+		worker = &server->workers[0];
+		for ( i = 1; i < server->worker_count; i++ ) {
+			if ( server->workers[i].load < worker->load ) {
+				worker = &server->workers[i];
+			}
+		}
+		zap_worker_lock( worker );
+		worker->load += zap_station_load( station );
+		worker->stations++;
+		station->worker = worker;
+	}
+	zap_timer_arm( &worker->wheel, &station->tx_timer, expires );
+	zap_worker_signal( worker );
+	zap_worker_unlock( worker );
+}
+
+// Take station off its worker, if it has one, and off any wheel. Once this returns no
+// worker will touch the station again until it is re-armed.
+void zap_station_disown( zap_station_t *station )
+{
+	zap_worker_t		*worker;
+
+	worker = zap_station_lock( station );
+	zap_timer_cancel( &station->tx_timer );
+	if ( worker ) {
+		worker->load -= zap_station_load( station );
+		worker->stations--;
+		station->worker = NULL;
+		// It may have been all this worker had; let it look for more.
+		zap_worker_signal( worker );
+		zap_worker_unlock( worker );
+	}
+}
+
+void zap_server_lock( zap_server_t *server )
+{
+	if ( server->receiver_count ) {
+#ifdef WIN32
+		EnterCriticalSection( &server->lock );
+#else
+		pthread_mutex_lock( &server->lock );
+#endif
+	}
+}
+
+void zap_server_unlock( zap_server_t *server )
+{
+	if ( server->receiver_count ) {
+#ifdef WIN32
+		LeaveCriticalSection( &server->lock );
+#else
+		pthread_mutex_unlock( &server->lock );
+#endif
+	}
+}
+
+// Lock station_hash's chains, shared to walk them, or with write to link or unlink a
+// station. Nothing to do if zapd runs no receivers. Never held while taking another lock.
+void zap_hash_lock( zap_server_t *server, int write )
+{
+	if ( server->receiver_count ) {
+#ifdef WIN32
+		if ( write ) {
+			AcquireSRWLockExclusive( &server->hash_lock );
+		} else {
+			AcquireSRWLockShared( &server->hash_lock );
+		}
+#else
+		if ( write ) {
+			pthread_rwlock_wrlock( &server->hash_lock );
+		} else {
+			pthread_rwlock_rdlock( &server->hash_lock );
+		}
+#endif
+	}
+}
+
+void zap_hash_unlock( zap_server_t *server, int write )
+{
+	if ( server->receiver_count ) {
+#ifdef WIN32
+		if ( write ) {
+			ReleaseSRWLockExclusive( &server->hash_lock );
+		} else {
+			ReleaseSRWLockShared( &server->hash_lock );
+		}
+#else
+		pthread_rwlock_unlock( &server->hash_lock );
+#endif
+	}
+}
+
+// Give a receiving station, set up and under the server lock, to the receiver its frames are
+// steered to. Nothing to do if zapd runs no receivers.
+void zap_station_own( zap_server_t *server, zap_station_t *station )
+{
+	zap_worker_t		*receiver;
+
+	if ( !server->receiver_count ) {
+		return;
+	}
+	receiver = &server->receivers[station->id % server->receiver_count];
+	zap_worker_lock( receiver );
+	receiver->load += zap_station_load( station );
+	receiver->stations++;
+	station->worker = receiver;
+	zap_worker_unlock( receiver );
+}
+
+// zap_rx_frame(  ) for a UDP frame, read by a receiver or by the main loop: act on it under the
+// lock of whoever owns its station, or under the server lock if no one does yet.
+int zap_rx_frame_locked( zap_server_t *server, SOCKET sock, zap_frame_t *frame, unsigned __int32 remote_ip, __int64 *rx_nsec )
+{
+	zap_station_t		*station;
+	zap_worker_t		*worker;
+	unsigned __int32	tid = ntohl( frame->header.zap_test_id );
+	int					rv = 1;
+
+	if ( zap_find_station( tid, server, &station, 0 ) ) {
+		return 1;
+	}
+	worker = zap_station_lock( station );
+	if ( !worker ) {
+		zap_server_lock( server );
+		// Owned while we waited, by the main loop starting its test.
+		worker = zap_station_lock( station );
+		if ( worker ) {
+			zap_server_unlock( server );
+		}
+	}
+	// The main loop may have cleaned the station, and even taken its slot for another test,
+	// between the lookup and the lock. Now it cannot; drop the frame if it no longer fits.
+	if ( ( station->id == tid ) && ( station->state != zap_station_state_off ) ) {
+		station->rx_socket = sock;
+		rv = zap_rx_station_frame( server, station, sock, frame, remote_ip, rx_nsec );
+	}
+	if ( worker ) {
+		zap_worker_unlock( worker );
+	} else {
+		zap_server_unlock( server );
+	}
+	return rv;
+}
+
+#ifdef ZAP_HAVE_REUSEPORT
+
+// Start count receivers, each running run(  ) on its own socket of the SO_REUSEPORT group that
+// server->udp_socket_rx was bound into, and which becomes the first receiver's. Returns 0 on
+// success.
+int zap_receivers_start( zap_server_t *server, unsigned __int32 count, void ( *run )( zap_worker_t *receiver ) )
+{
+	struct sock_filter	code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, 8 },					// A = zap_test_id; 0 is the UDP payload.
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0 },					// A %= count.
+		{ BPF_RET | BPF_A, 0, 0, 0 },							// Socket A of the group.
+	};
+	struct sock_fprog	prog;
+	zap_worker_t		*receiver;
+	unsigned __int32	i;
+	int					val = 1;
+	pthread_mutexattr_t	attr;
+
+	server->receivers = ( zap_worker_t * )calloc( count, sizeof( zap_worker_t ) );
+	if ( !server->receivers ) {
+		erk;
+		return 1;
+	}
+	// Recursive like a worker's: the main loop cleans a station with its receiver locked.
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+	for ( i = 0; i < count; i++ ) {
+		receiver = &server->receivers[i];
+		receiver->server = server;
+		receiver->run = run;
+		receiver->index = i;
+		pthread_mutex_init( &receiver->lock, &attr );
+		pthread_cond_init( &receiver->wake, NULL );
+		if ( !i ) {
+			receiver->rx_socket = server->udp_socket_rx;
+			continue;
+		}
+		// Sockets join the group in bind order, which the program's indexes follow.
+		if ( zap_socket( 0, 0, &receiver->rx_socket ) ||
+			zap_rx_timestamp_enable( receiver->rx_socket ) ||
+			setsockopt( receiver->rx_socket, SOL_SOCKET, SO_REUSEPORT, ( const char * )&val, sizeof( val ) ) ||
+			zap_bind( receiver->rx_socket ) ) {
+			WARN_errno( 1, "zap_receivers_start - socket" );
+			return 1;
+		}
+		zap_rx_overflow_enable( receiver->rx_socket );
+	}
+	for ( i = 0; i < count; i++ ) {
+		receiver = &server->receivers[i];
+		if ( pipe( receiver->rx_wake ) ||
+			fcntl( receiver->rx_wake[0], F_SETFL, O_NONBLOCK ) ||
+			fcntl( receiver->rx_wake[1], F_SETFL, O_NONBLOCK ) ) {
+			WARN_errno( 1, "zap_receivers_start - pipe" );
+			return 1;
+		}
+	}
+
+	// Without it the kernel spreads datagrams by flow hash, and receivers lock for strangers.
+	code[1].k = count;
+	prog.len = sizeof( code ) / sizeof( code[0] );
+	prog.filter = code;
+	if ( setsockopt( server->udp_socket_rx, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof( prog ) ) ) {
+		WARN_errno( 1, "zap_receivers_start - SO_ATTACH_REUSEPORT_CBPF" );
+	}
+
+	pthread_mutex_init( &server->lock, NULL );
+	pthread_rwlock_init( &server->hash_lock, NULL );
+	// The main loop holds the server lock from here on.
+	server->receiver_count = count;
+	zap_server_lock( server );
+
+	for ( i = 0; i < count; i++ ) {
+		receiver = &server->receivers[i];
+		if ( pthread_create( &receiver->thread, NULL, zap_worker_thread, receiver ) ) {
+			WARN_errno( 1, "pthread_create" );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Hand station's data_complete for batch, read by the main loop off sock, to the receiver
+// reading its data, which acts on it in zap_receiver_complete(  ). Only one waits at a time; a
+// later one takes its place, and the batch it was for closes as the later batch's data comes
+// in. Returns 0, handing nothing over, if zapd runs no receivers or sock is one of theirs.
+int zap_station_complete( zap_server_t *server, zap_station_t *station, SOCKET sock, unsigned __int32 batch )
+{
+	zap_worker_t		*receiver;
+	unsigned __int32	i;
+
+	if ( !server->receiver_count || station->config.tcp ) {
+		return 0;
+	}
+	// Its owner, unless the kernel steers its data elsewhere.
+	receiver = station->worker;
+	for ( i = 0; i < server->receiver_count; i++ ) {
+		if ( server->receivers[i].rx_socket == sock ) {
+			return 0;
+		}
+		if ( server->receivers[i].rx_socket == station->rx_socket ) {
+			receiver = &server->receivers[i];
+		}
+	}
+	if ( !receiver ) {
+		return 0;
+	}
+	station->rx_complete = receiver;
+	station->rx_complete_batch = batch;
+	station->rx_complete_seq = ZAP_ATOMIC_INC( receiver->rx_completes ) + 1;
+	// Wake it, should it wait on an empty socket. A full pipe has woken it already.
+	if ( ( write( receiver->rx_wake[1], "", 1 ) < 0 ) && ( errno != EAGAIN ) ) {
+		WARN_errno( 1, "zap_station_complete - write" );
+	}
+	return 1;
+}
+
+// Wait until receiver's socket has frames, or the main loop hands it a data_complete. Returns
+// how many it has been handed so far, counted before the socket is read, so every one of
+// them came in after the frames sent ahead of it were queued there.
+unsigned __int32 zap_receiver_wait( zap_worker_t *receiver )
+{
+	struct pollfd		fds[2];
+	char				drain[64];
+
+	fds[0].fd = receiver->rx_socket;
+	fds[0].events = POLLIN;
+	fds[1].fd = receiver->rx_wake[0];
+	fds[1].events = POLLIN;
+	if ( ( poll( fds, 2, -1 ) < 0 ) && ( errno != EINTR ) ) {
+		WARN_errno( 1, "zap_receiver_wait - poll" );
+	}
+	if ( fds[1].revents & POLLIN ) {
+		while ( read( receiver->rx_wake[0], drain, sizeof( drain ) ) > 0 ) {
+		}
+	}
+	return ZAP_LOAD_ACQUIRE( receiver->rx_completes );
+}
+
+// Act on the data_completes handed to receiver, up to the seen'th, once it has read its socket.
+void zap_receiver_complete( zap_server_t *server, zap_worker_t *receiver, unsigned __int32 seen )
+{
+	zap_station_t		*station;
+	zap_worker_t		*worker;
+	unsigned __int32	i, count;
+
+	if ( seen == receiver->rx_completed ) {
+		return;
+	}
+	receiver->rx_completed = seen;
+	count = ZAP_LOAD_ACQUIRE( server->station_count );
+	for ( i = 0; i < count; i++ ) {
+		station = ZAP_STATION( server, i );
+		// An unlocked hint, then the real thing. One no one owns is being cleaned.
+		if ( station->rx_complete != receiver ) {
+			continue;
+		}
+		worker = zap_station_lock( station );
+		if ( !worker ) {
+			continue;
+		}
+		if ( ( station->rx_complete == receiver ) && ( ( __int32 )( station->rx_complete_seq - seen ) <= 0 ) ) {
+			station->rx_complete = NULL;
+			if ( ( station->state == zap_station_state_running_rx ) &&
+				zap_batch_complete( station, station->rx_complete_batch ) ) {
+				erk;
+			}
+		}
+		zap_worker_unlock( worker );
+	}
+}
+
+#else // !ZAP_HAVE_REUSEPORT
+
+int zap_receivers_start( zap_server_t *server, unsigned __int32 count, void ( *run )( zap_worker_t *receiver ) )
+{
+	return 1;
+}
+
+int zap_station_complete( zap_server_t *server, zap_station_t *station, SOCKET sock, unsigned __int32 batch )
+{
+	return 0;
+}
+
+#endif // ZAP_HAVE_REUSEPORT
@@ -0,0 +1,311 @@
+/*
+Copyright (c) 2004-2009, Ruckus Wireless, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of Ruckus Wireless nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER OR CONTRIBUTERS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// zapwriter.c :
+//
+// Result writer for zap.
+//
+// The controller formats its -F, -L and -D output into records, and a thread of its own
+// writes them, so a slow disk or a network home directory never holds up the reports
+// coming in on the control sockets. Records pass through a single-producer, single-
+// consumer ring; the producer only waits should the ring fill. Files stay open from their
+// first record until the writer stops, and are flushed once ZAP_WRITER_FLUSH_BYTES have
+// gone to one or ZAP_WRITER_FLUSH_USEC after the first of them, whichever is sooner.
+//
+// The thread starts with the first record and stops, writing out all that was queued,
+// with zap_writer_stop(  ). Records queued after that start it afresh.
+//
+
+#include "zaplib.h"
+#include "error.h"
+#include <stdarg.h>
+
+#define ZAP_WRITER_MASK			( ZAP_WRITER_SLOTS - 1 )
+
+static void zap_writer_nap( unsigned __int32 msec )
+{
+#ifdef WIN32
+	Sleep( msec );
+#else
+	usleep( msec * 1000 );
+#endif
+}
+
+static void zap_writer_flush( zap_writer_file_t *file )
+{
+	if ( file->fileio && file->pending ) {
+		fflush( file->fileio );
+		file->pending = 0;
+	}
+}
+
+// Write record out to its file, opening it first if need be.
+static void zap_writer_put( zap_writer_t *writer, zap_record_t *record )
+{
+	zap_writer_file_t	*file = &writer->files[record->file];
+	unsigned __int32	start = 0;
+
+	if ( !file->fileio && !file->failed ) {
+		file->fileio = fopen( file->name, file->raw ? "ab" : "a+" );
+		if ( !file->fileio ) {
+			fprintf( stderr, "Error, %s probably open by another application.\n", file->name );
+			file->failed = 1;
+			writer->failed = 1;
+		} else if ( file->raw ) {
+			setvbuf( file->fileio, NULL, _IONBF, 0 );
+		}
+	}
+	if ( file->fileio ) {
+		if ( record->header ) {
+			fseek( file->fileio, 0, SEEK_END );
+			if ( ftell( file->fileio ) > 0 ) {
+				start = record->header;
+			}
+		}
+		if ( fwrite( record->text + start, 1, record->length - start, file->fileio ) != record->length - start ) {
+			WARN_errno( 1, file->name );
+			writer->failed = 1;
+		}
+		if ( !file->pending ) {
+			file->flush_usec = get_current_usecs(  ) + ZAP_WRITER_FLUSH_USEC;
+		}
+		file->pending += record->length - start;
+		if ( file->pending >= ZAP_WRITER_FLUSH_BYTES ) {
+			zap_writer_flush( file );
+		}
+	}
+	free( record->text );
+}
+
+static void zap_writer_run( zap_writer_t *writer )
+{
+	unsigned __int32	head, tail;
+	int					i, stop;
+
+	tail = writer->tail;
+	for ( ;; ) {
+		// Read stop ahead of head, so that once stopped, the last records are seen too.
+		stop = ZAP_LOAD_ACQUIRE( writer->stop );
+		head = ZAP_LOAD_ACQUIRE( writer->head );
+		if ( tail == head ) {
+			for ( i = 0; i < ZAP_WRITER_FILES; i++ ) {
+				if ( writer->files[i].pending && ( stop || ( get_current_usecs(  ) - writer->files[i].flush_usec >= 0 ) ) ) {
+					zap_writer_flush( &writer->files[i] );
+				}
+			}
+			if ( stop ) {
+				break;
+			}
+			zap_writer_nap( ZAP_WRITER_NAP_MSEC );
+			continue;
+		}
+		while ( tail != head ) {
+			zap_writer_put( writer, &writer->slots[tail & ZAP_WRITER_MASK] );
+			tail++;
+			ZAP_STORE_RELEASE( writer->tail, tail );
+		}
+	}
+
+	for ( i = 0; i < ZAP_WRITER_FILES; i++ ) {
+		if ( writer->files[i].fileio ) {
+			if ( fclose( writer->files[i].fileio ) ) {
+				writer->failed = 1;
+			}
+			writer->files[i].fileio = NULL;
+		}
+	}
+}
+
+#ifdef WIN32
+static DWORD WINAPI zap_writer_thread( LPVOID arg )
+{
+	zap_writer_run( ( zap_writer_t * )arg );
+	return 0;
+}
+#else
+static void *zap_writer_thread( void *arg )
+{
+	zap_writer_run( ( zap_writer_t * )arg );
+	return NULL;
+}
+#endif
+
+// The index of the file called name, for zap_writer_commit(  ), or -1 if there are already
+// ZAP_WRITER_FILES.
+int zap_writer_file( zap_writer_t *writer, const char *name )
+{
+	int					i;
+
+	for ( i = 0; i < writer->file_count; i++ ) {
+		if ( !strcmp( writer->files[i].name, name ) ) {
+			return i;
+		}
+	}
+	if ( writer->file_count == ZAP_WRITER_FILES ) {
+		return -1;
+	}
+	writer->files[i].name = ( char * )malloc( strlen( name ) + 1 );
+	if ( !writer->files[i].name ) {
+		erk;
+		return -1;
+	}
+	strcpy( writer->files[i].name, name );
+	return writer->file_count++;
+}
+
+// Have file's records written whole, in binary and unbuffered, so that each goes down in one
+// write and processes appending to the file at once do not interleave them.
+void zap_writer_raw( zap_writer_t *writer, int file )
+{
+	if ( file >= 0 ) {
+		writer->files[file].raw = 1;
+	}
+}
+
+// Append to the record being formatted.
+void zap_writer_printf( zap_writer_t *writer, const char *format, ... )
+{
+	zap_record_t		*record = &writer->staged;
+	va_list				args;
+	unsigned __int32	max;
+	char				*text;
+	int					n;
+
+	for ( ;; ) {
+		va_start( args, format );
+		n = record->text ? vsnprintf( record->text + record->length, record->max - record->length, format, args ) : -1;
+		va_end( args );
+		if ( ( n >= 0 ) && ( ( unsigned __int32 )n < record->max - record->length ) ) {
+			record->length += n;
+			return;
+		}
+		// Too long, or an older C library that will not say how long; make room and go again.
+		max = record->max ? record->max * 2 : 1024;
+		if ( ( n >= 0 ) && ( max < record->length + n + 1 ) ) {
+			max = record->length + n + 1;
+		}
+		text = ( char * )realloc( record->text, max );
+		if ( !text ) {
+			erk;
+			writer->failed = 1;
+			return;
+		}
+		record->text = text;
+		record->max = max;
+	}
+}
+
+// Append length bytes of data to the record being formatted.
+void zap_writer_append( zap_writer_t *writer, const void *data, unsigned __int32 length )
+{
+	zap_record_t		*record = &writer->staged;
+	unsigned __int32	max;
+	char				*text;
+
+	if ( record->max - record->length < length ) {
+		max = record->max ? record->max : 1024;
+		while ( max - record->length < length ) {
+			max *= 2;
+		}
+		text = ( char * )realloc( record->text, max );
+		if ( !text ) {
+			erk;
+			writer->failed = 1;
+			return;
+		}
+		record->text = text;
+		record->max = max;
+	}
+	memcpy( record->text + record->length, data, length );
+	record->length += length;
+}
+
+// What has been formatted so far is the file's header, only written to an empty file.
+void zap_writer_header( zap_writer_t *writer )
+{
+	writer->staged.header = writer->staged.length;
+}
+
+// Queue what has been formatted to be written to file, from zap_writer_file(  ). Returns
+// non-zero if it cannot be.
+int zap_writer_commit( zap_writer_t *writer, int file )
+{
+	zap_record_t		*record = &writer->staged;
+
+	if ( ( file < 0 ) || !record->length ) {
+		free( record->text );
+		memset( record, 0, sizeof( *record ) );
+		return ( file < 0 );
+	}
+
+	if ( !writer->running ) {
+		writer->stop = 0;
+#ifdef WIN32
+		writer->thread = CreateThread( NULL, 0, zap_writer_thread, writer, 0, NULL );
+		if ( !writer->thread ) {
+			erk;
+			return 1;
+		}
+#else
+		if ( pthread_create( &writer->thread, NULL, zap_writer_thread, writer ) ) {
+			WARN_errno( 1, "pthread_create" );
+			return 1;
+		}
+#endif
+		writer->running = 1;
+	}
+
+	while ( writer->head - ZAP_LOAD_ACQUIRE( writer->tail ) == ZAP_WRITER_SLOTS ) {
+		zap_writer_nap( 1 );
+	}
+	record->file = file;
+	writer->slots[writer->head & ZAP_WRITER_MASK] = *record;
+	ZAP_STORE_RELEASE( writer->head, writer->head + 1 );
+	memset( record, 0, sizeof( *record ) );
+	return 0;
+}
+
+// Write out all that is queued, close the files and end the thread. Returns non-zero if
+// anything could not be written since the writer last stopped.
+int zap_writer_stop( zap_writer_t *writer )
+{
+	int					failed;
+
+	if ( writer->running ) {
+		ZAP_STORE_RELEASE( writer->stop, 1 );
+#ifdef WIN32
+		WaitForSingleObject( writer->thread, INFINITE );
+		CloseHandle( writer->thread );
+#else
+		pthread_join( writer->thread, NULL );
+#endif
+		writer->running = 0;
+	}
+	failed = writer->failed;
+	writer->failed = 0;
+	return failed;
+}
@@ -0,0 +1,586 @@
+/*
+Copyright (c) 2004-2009, Ruckus Wireless, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of Ruckus Wireless nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL COPYRIGHT HOLDER OR CONTRIBUTERS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// zapq.c : 
+//
+// Query tool for zap's per-sample results archives ( zap -A ).
+//
+// Archives are mapped into memory, not read, and walked block by block, a test's samples
+// coming in one or more blocks, interleaved with other zaps' when they share an archive;
+// blocks are chosen on their headers alone, by test id, tags and start time. The
+// samples of one column of the chosen blocks are then gathered, summed and sorted by
+// several threads at once, each taking a run of blocks holding about as many samples as
+// the others', and the sorted runs are merged for exact percentiles across every test.
+//
+// Random notes:
+//
+// * An archive still being appended to may end in part of a block. It is left out.
+//
+// * Blocks of one test have like headers, so are told apart from other tests by test id and
+//   start time. They are looked for only among the last ZAPQ_TEST_WINDOW blocks.
+//
+
+#include "../zaplib/zaplib.h"
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#define ZAPQ_MAX_THREADS		64
+#define ZAPQ_NONE				0xffffffff
+#define ZAPQ_TEST_WINDOW		1024
+
+typedef struct {
+	const char				*name;
+	unsigned __int32		low, high;				// Columns of the value's low and high words; high is ZAPQ_NONE if it has none.
+	int						is_signed;
+	double					scale;
+	const char				*unit;
+} zapq_column_t;
+
+static zapq_column_t zapq_columns[] = {
+	{ "throughput",	ZAP_ARCHIVE_COLUMN( bits_per_second ), ZAP_ARCHIVE_COLUMN( bits_per_second_high ), 0, 1e-6, "mbps" },
+	{ "received",	ZAP_ARCHIVE_COLUMN( payloads_received ), ZAPQ_NONE, 0, 1.0, "payloads" },
+	{ "dropped",	ZAP_ARCHIVE_COLUMN( payloads_dropped ), ZAPQ_NONE, 0, 1.0, "payloads" },
+	{ "host",		ZAP_ARCHIVE_COLUMN( payloads_dropped_host ), ZAPQ_NONE, 0, 1.0, "payloads" },
+	{ "outoforder",	ZAP_ARCHIVE_COLUMN( payloads_outoforder ), ZAPQ_NONE, 0, 1.0, "payloads" },
+	{ "repeated",	ZAP_ARCHIVE_COLUMN( payloads_repeated ), ZAPQ_NONE, 0, 1.0, "payloads" },
+	{ "jitter",		ZAP_ARCHIVE_COLUMN( jitter ), ZAPQ_NONE, 0, 1e-6, "ms" },
+	{ "owd50",		ZAP_ARCHIVE_COLUMN( owd_p50 ), ZAPQ_NONE, 0, 1e-6, "ms above least" },
+	{ "owd99",		ZAP_ARCHIVE_COLUMN( owd_p99 ), ZAPQ_NONE, 0, 1e-6, "ms above least" },
+	{ "ipdv99",		ZAP_ARCHIVE_COLUMN( ipdv_p99 ), ZAPQ_NONE, 1, 1e-6, "ms" },
+	{ "rcvbuf",		ZAP_ARCHIVE_COLUMN( udp_rcvbuf_errors ), ZAPQ_NONE, 0, 1.0, "errors" },
+};
+
+static double zapq_r[] = { 0.0, 0.5, 0.90, 0.95, 0.990, 0.999, 1.0 };
+static const char *zapq_histarr[] = { "0%", "50%", "90%", "95%", "99%", "99.9%", "100%" };
+
+// A block chosen from an archive.
+typedef struct {
+	zap_archive_header_t	*header;
+	unsigned __int64		offset;					// Of its samples in zapq_values.
+	double					sum, min, max;
+	unsigned __int32		test;					// The first block of its test.
+	unsigned __int64		samples;				// In the first block, those of the whole test.
+} zapq_block_t;
+
+// A run of blocks for one thread.
+typedef struct {
+	unsigned __int32		first, last;			// Blocks first up to last.
+	unsigned __int64		start, end;				// Their samples in zapq_values.
+	double					sum;
+#ifdef WIN32
+	HANDLE					thread;
+#else
+	pthread_t				thread;
+#endif
+} zapq_part_t;
+
+typedef struct {
+	const char				*tag, *sub, *note;
+	int						by_tid;
+	unsigned __int32		tid;
+	__int64					after, before;			// Test starts, usecs since 1970; 0 for no limit.
+} zapq_filter_t;
+
+static zapq_column_t		*zapq_column = &zapq_columns[0];
+static zapq_block_t			*zapq_blocks;
+static unsigned __int32		zapq_block_count, zapq_block_max;
+static double				*zapq_values;
+
+
+// Map the archive name into memory. Returns its start, or NULL if it cannot be.
+static unsigned char *zapq_map( const char *name, size_t *size )
+{
+	static unsigned char	empty[1];
+	unsigned char			*base;
+#ifdef WIN32
+	HANDLE					file, mapping;
+	LARGE_INTEGER			length;
+
+	file = CreateFileA( name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL );
+	if ( file == INVALID_HANDLE_VALUE ) {
+		return NULL;
+	}
+	if ( !GetFileSizeEx( file, &length ) ) {
+		CloseHandle( file );
+		return NULL;
+	}
+	*size = ( size_t )length.QuadPart;
+	if ( !*size ) {
+		CloseHandle( file );
+		return empty;
+	}
+	mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	base = mapping ? ( unsigned char * )MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	if ( mapping ) {
+		CloseHandle( mapping );
+	}
+	CloseHandle( file );
+	return base;
+#else
+	struct stat				st;
+	int						fd;
+
+	fd = open( name, O_RDONLY );
+	if ( fd < 0 ) {
+		return NULL;
+	}
+	if ( fstat( fd, &st ) ) {
+		close( fd );
+		return NULL;
+	}
+	*size = ( size_t )st.st_size;
+	if ( !*size ) {
+		close( fd );
+		return empty;
+	}
+	// The mapping outlasts the descriptor, and zapq.
+	base = ( unsigned char * )mmap( NULL, *size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	return ( base == MAP_FAILED ) ? NULL : base;
+#endif
+}
+
+static __int64 zapq_start( zap_archive_header_t *header )
+{
+	return ( __int64 )( ( ( unsigned __int64 )header->start_high << 32 ) | header->start_low );
+}
+
+static int zapq_match( zap_archive_header_t *header, zapq_filter_t *filter )
+{
+	if ( ( filter->tag && strncmp( header->tag, filter->tag, sizeof( header->tag ) ) ) ||
+		( filter->sub && strncmp( header->sub, filter->sub, sizeof( header->sub ) ) ) ||
+		( filter->note && !strstr( header->note, filter->note ) ) ||
+		( filter->by_tid && ( header->tid != filter->tid ) ) ||
+		( filter->after && ( zapq_start( header ) < filter->after ) ) ||
+		( filter->before && ( zapq_start( header ) >= filter->before ) ) ) {
+		return 0;
+	}
+	return 1;
+}
+
+// Gather the chosen blocks into tests, the first block of each holding the whole test's
+// samples, sum, min and max. Returns the number of tests.
+static unsigned __int32 zapq_tests( void )
+{
+	zapq_block_t			*block, *first;
+	unsigned __int32		b, c, tests = 0;
+
+	for ( b = 0; b < zapq_block_count; b++ ) {
+		block = &zapq_blocks[b];
+		block->test = b;
+		block->samples = block->header->sample_count;
+		for ( c = b; c-- > 0 && c + ZAPQ_TEST_WINDOW > b; ) {
+			first = &zapq_blocks[c];
+			if ( ( first->test == c ) && ( first->header->tid == block->header->tid ) &&
+				( zapq_start( first->header ) == zapq_start( block->header ) ) ) {
+				first->samples += block->samples;
+				first->sum += block->sum;
+				if ( block->min < first->min ) {
+					first->min = block->min;
+				}
+				if ( block->max > first->max ) {
+					first->max = block->max;
+				}
+				block->test = c;
+				break;
+			}
+		}
+		if ( block->test == b ) {
+			tests++;
+		}
+	}
+	return tests;
+}
+
+// Walk the blocks of the archive at base, adding those filter chooses. Returns 0 on success.
+static int zapq_scan( const char *name, unsigned char *base, size_t size, zapq_filter_t *filter )
+{
+	zap_archive_header_t	*header;
+	zapq_block_t			*blocks;
+	size_t					offset = 0;
+	unsigned __int32		max;
+
+	while ( size - offset >= sizeof( *header ) ) {
+		header = ( zap_archive_header_t * )( base + offset );
+		if ( ( header->magic != ZAP_ARCHIVE_MAGIC ) || ( header->version != ZAP_ARCHIVE_VERSION ) ) {
+			fprintf( stderr, "Error: %s is not a zap archive past byte %llu.\n", name, ( unsigned long long )offset );
+			return 1;
+		}
+		if ( ( header->length > size - offset ) ||
+			( header->length != sizeof( *header ) + ( unsigned __int64 )header->column_count * header->sample_count * 4 ) ) {
+			fprintf( stderr, "Warning: %s ends in part of a block, left out.\n", name );
+			break;
+		}
+		if ( header->sample_count && zapq_match( header, filter ) ) {
+			if ( zapq_block_count == zapq_block_max ) {
+				max = zapq_block_max ? zapq_block_max * 2 : 256;
+				blocks = ( zapq_block_t * )realloc( zapq_blocks, max * sizeof( *blocks ) );
+				if ( !blocks ) {
+					fprintf( stderr, "Error: can not allocate memory for blocks.\n" );
+					return 1;
+				}
+				zapq_blocks = blocks;
+				zapq_block_max = max;
+			}
+			memset( &zapq_blocks[zapq_block_count], 0, sizeof( zapq_blocks[0] ) );
+			zapq_blocks[zapq_block_count++].header = header;
+		}
+		offset += header->length;
+	}
+	return 0;
+}
+
+// Sample i of a block, in the column's units.
+static double zapq_value( zap_archive_header_t *header, zapq_column_t *column, unsigned __int32 i )
+{
+	unsigned __int32		*columns = ( unsigned __int32 * )( header + 1 );
+	unsigned __int64		value;
+
+	if ( column->low >= header->column_count ) {
+		return 0;
+	}
+	value = columns[( size_t )column->low * header->sample_count + i];
+	if ( ( column->high != ZAPQ_NONE ) && ( column->high < header->column_count ) ) {
+		value |= ( unsigned __int64 )columns[( size_t )column->high * header->sample_count + i] << 32;
+	}
+	if ( column->is_signed ) {
+		return ( double )( __int32 )value * column->scale;
+	}
+	return ( double )value * column->scale;
+}
+
+static int zapq_compare( const void *a, const void *b )
+{
+	double		x = *( const double * )a;
+	double		y = *( const double * )b;
+
+	return ( x > y ) - ( x < y );
+}
+
+// Gather, sum and sort one part's samples.
+static void zapq_run( zapq_part_t *part )
+{
+	zapq_block_t			*block;
+	double					value, *out;
+	unsigned __int32		b, i;
+
+	for ( b = part->first; b < part->last; b++ ) {
+		block = &zapq_blocks[b];
+		out = &zapq_values[block->offset];
+		for ( i = 0; i < block->header->sample_count; i++ ) {
+			value = zapq_value( block->header, zapq_column, i );
+			if ( !i || ( value < block->min ) ) {
+				block->min = value;
+			}
+			if ( !i || ( value > block->max ) ) {
+				block->max = value;
+			}
+			block->sum += value;
+			*out++ = value;
+		}
+		part->sum += block->sum;
+	}
+	qsort( &zapq_values[part->start], ( size_t )( part->end - part->start ), sizeof( double ), zapq_compare );
+}
+
+#ifdef WIN32
+static DWORD WINAPI zapq_thread( LPVOID arg )
+{
+	zapq_run( ( zapq_part_t * )arg );
+	return 0;
+}
+#else
+static void *zapq_thread( void *arg )
+{
+	zapq_run( ( zapq_part_t * )arg );
+	return NULL;
+}
+#endif
+
+// Merge the parts' sorted runs of zapq_values into sorted.
+static void zapq_merge( zapq_part_t *parts, unsigned __int32 count, double *sorted )
+{
+	unsigned __int64		next[ZAPQ_MAX_THREADS];
+	unsigned __int32		i, least;
+
+	for ( i = 0; i < count; i++ ) {
+		next[i] = parts[i].start;
+	}
+	for ( ;; ) {
+		least = count;
+		for ( i = 0; i < count; i++ ) {
+			if ( ( next[i] < parts[i].end ) &&
+				( ( least == count ) || ( zapq_values[next[i]] < zapq_values[next[least]] ) ) ) {
+				least = i;
+			}
+		}
+		if ( least == count ) {
+			return;
+		}
+		*sorted++ = zapq_values[next[least]++];
+	}
+}
+
+static unsigned __int32 zapq_cpus( void )
+{
+#ifdef WIN32
+	SYSTEM_INFO				info;
+
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors;
+#else
+	long					n = sysconf( _SC_NPROCESSORS_ONLN );
+
+	return ( n > 0 ) ? ( unsigned __int32 )n : 1;
+#endif
+}
+
+// Run count threads over the chosen blocks, leaving every sample sorted in zapq_values and
+// their sum in sum. Returns 0 on success.
+static int zapq_gather( unsigned __int32 count, unsigned __int64 total, double *sum )
+{
+	zapq_part_t				parts[ZAPQ_MAX_THREADS];
+	unsigned __int32		i, b;
+	double					*sorted;
+
+	// Cut the blocks into runs of about total / count samples.
+	memset( parts, 0, sizeof( parts ) );
+	b = 0;
+	for ( i = 0; i < count; i++ ) {
+		parts[i].first = b;
+		parts[i].start = ( b < zapq_block_count ) ? zapq_blocks[b].offset : total;
+		while ( ( b < zapq_block_count ) &&
+			( ( i == count - 1 ) || ( zapq_blocks[b].offset < total * ( i + 1 ) / count ) ) ) {
+			b++;
+		}
+		parts[i].last = b;
+		parts[i].end = ( b < zapq_block_count ) ? zapq_blocks[b].offset : total;
+	}
+
+	for ( i = 1; i < count; i++ ) {
+#ifdef WIN32
+		parts[i].thread = CreateThread( NULL, 0, zapq_thread, &parts[i], 0, NULL );
+		if ( !parts[i].thread ) {
+			return 1;
+		}
+#else
+		if ( pthread_create( &parts[i].thread, NULL, zapq_thread, &parts[i] ) ) {
+			return 1;
+		}
+#endif
+	}
+	zapq_run( &parts[0] );
+	*sum = parts[0].sum;
+	for ( i = 1; i < count; i++ ) {
+#ifdef WIN32
+		WaitForSingleObject( parts[i].thread, INFINITE );
+		CloseHandle( parts[i].thread );
+#else
+		pthread_join( parts[i].thread, NULL );
+#endif
+		*sum += parts[i].sum;
+	}
+
+	if ( count > 1 ) {
+		sorted = ( double * )malloc( ( size_t )total * sizeof( double ) );
+		if ( !sorted ) {
+			return 1;
+		}
+		zapq_merge( parts, count, sorted );
+		free( zapq_values );
+		zapq_values = sorted;
+	}
+	return 0;
+}
+
+static void zapq_usage( const char *name )
+{
+	unsigned __int32		i;
+
+	fprintf( stderr, "%s [options] <archive> [<archive> ...]\n", name );
+	fprintf( stderr, "   Reports on the samples zap -A<archive> kept. Options are CaSe sensitive!\n" );
+	fprintf( stderr, "     -T<tag>            - Only tests with this -T tag.\n" );
+	fprintf( stderr, "     -S<sub>            - Only tests with this -S sub tag.\n" );
+	fprintf( stderr, "     -N<text>           - Only tests whose -N note holds <text>.\n" );
+	fprintf( stderr, "     -t<tid>            - Only the test with this ID.\n" );
+	fprintf( stderr, "     -a<time>           - Only tests started at or after <time>, in seconds since 1970.\n" );
+	fprintf( stderr, "     -b<time>           - Only tests started before <time>, in seconds since 1970.\n" );
+	fprintf( stderr, "     -c<column>         - The samples' column to report on. Defaults to throughput. One of:\n" );
+	fprintf( stderr, "                         " );
+	for ( i = 0; i < sizeof( zapq_columns ) / sizeof( zapq_columns[0] ); i++ ) {
+		fprintf( stderr, " %s", zapq_columns[i].name );
+	}
+	fprintf( stderr, "\n" );
+	fprintf( stderr, "     -j<threads>        - Threads to gather samples with. Defaults to one per CPU.\n" );
+	fprintf( stderr, "     -l                 - List each test chosen, too.\n" );
+}
+
+int main( int argc, char *argv[] )
+{
+	zapq_filter_t			filter;
+	unsigned char			*base;
+	size_t					size;
+	unsigned __int64		total = 0;
+	unsigned __int32		threads, tests, b, i;
+	int						list = 0, archives = 0;
+	double					sum;
+	time_t					start;
+	char					time_str[30];
+
+	memset( &filter, 0, sizeof( filter ) );
+	threads = zapq_cpus(  );
+
+	for ( i = 1; i < ( unsigned __int32 )argc; i++ ) {
+		if ( argv[i][0] != '-' ) {
+			continue;
+		}
+		switch ( argv[i][1] ) {
+			case 'T':
+				filter.tag = &argv[i][2];
+				break;
+			case 'S':
+				filter.sub = &argv[i][2];
+				break;
+			case 'N':
+				filter.note = &argv[i][2];
+				break;
+			case 't':
+				filter.by_tid = 1;
+				filter.tid = ( unsigned __int32 )strtoul( &argv[i][2], NULL, 0 );
+				break;
+			case 'a':
+				filter.after = ( __int64 )strtoul( &argv[i][2], NULL, 0 ) * 1000000;
+				break;
+			case 'b':
+				filter.before = ( __int64 )strtoul( &argv[i][2], NULL, 0 ) * 1000000;
+				break;
+			case 'c':
+				for ( b = 0; b < sizeof( zapq_columns ) / sizeof( zapq_columns[0] ); b++ ) {
+					if ( !strcmp( zapq_columns[b].name, &argv[i][2] ) ) {
+						break;
+					}
+				}
+				if ( b == sizeof( zapq_columns ) / sizeof( zapq_columns[0] ) ) {
+					zapq_usage( argv[0] );
+					return 1;
+				}
+				zapq_column = &zapq_columns[b];
+				break;
+			case 'j':
+				threads = ( unsigned __int32 )strtoul( &argv[i][2], NULL, 0 );
+				break;
+			case 'l':
+				list = 1;
+				break;
+			default:
+				zapq_usage( argv[0] );
+				return 1;
+		}
+	}
+
+	for ( i = 1; i < ( unsigned __int32 )argc; i++ ) {
+		if ( argv[i][0] == '-' ) {
+			continue;
+		}
+		archives++;
+		base = zapq_map( argv[i], &size );
+		if ( !base ) {
+			fprintf( stderr, "Error: could not open %s.\n", argv[i] );
+			return 1;
+		}
+		if ( zapq_scan( argv[i], base, size, &filter ) ) {
+			return 1;
+		}
+	}
+	if ( !archives ) {
+		zapq_usage( argv[0] );
+		return 1;
+	}
+
+	for ( b = 0; b < zapq_block_count; b++ ) {
+		zapq_blocks[b].offset = total;
+		total += zapq_blocks[b].header->sample_count;
+	}
+	if ( !total ) {
+		printf( "No tests chosen.\n" );
+		return 0;
+	}
+	zapq_values = ( double * )malloc( ( size_t )total * sizeof( double ) );
+	if ( !zapq_values ) {
+		fprintf( stderr, "Error: can not allocate memory for %llu samples.\n", ( unsigned long long )total );
+		return 1;
+	}
+	if ( threads < 1 ) {
+		threads = 1;
+	}
+	if ( threads > ZAPQ_MAX_THREADS ) {
+		threads = ZAPQ_MAX_THREADS;
+	}
+	if ( threads > zapq_block_count ) {
+		threads = zapq_block_count;
+	}
+	if ( zapq_gather( threads, total, &sum ) ) {
+		fprintf( stderr, "Error: could not gather samples.\n" );
+		return 1;
+	}
+	tests = zapq_tests(  );
+
+	if ( list ) {
+		printf( "%8s  %-24s  %7s  %10s %10s %10s  %s\n", "tid", "started", "samples", "mean", "min", "max", "tag/sub/note" );
+		for ( b = 0; b < zapq_block_count; b++ ) {
+			zap_archive_header_t	*header = zapq_blocks[b].header;
+
+			if ( zapq_blocks[b].test != b ) {
+				continue;
+			}
+			start = ( time_t )( zapq_start( header ) / 1000000 );
+			strncpy( time_str, ctime( &start ), sizeof( time_str ) - 1 );
+			time_str[24] = 0;		// Take off the newline.
+			printf( "%08x  %-24s  %7llu  %10.3f %10.3f %10.3f  %.64s/%.64s/%.128s\n",
+				header->tid,
+				time_str,
+				( unsigned long long )zapq_blocks[b].samples,
+				zapq_blocks[b].sum / zapq_blocks[b].samples,
+				zapq_blocks[b].min,
+				zapq_blocks[b].max,
+				header->tag,
+				header->sub,
+				header->note );
+		}
+	}
+
+	printf( "%u tests, %llu samples of %s ( %s ): mean %.3f |",
+		tests, ( unsigned long long )total, zapq_column->name, zapq_column->unit, sum / total );
+	for ( i = 0; i < sizeof( zapq_r ) / sizeof( zapq_r[0] ); i++ ) {
+		printf( " %s %.3f", zapq_histarr[i], zapq_values[( size_t )( zapq_r[i] * ( total - 1 ) + 0.5 )] );
+	}
+	printf( "\n" );
+	return 0;
+}